@@ -0,0 +1,59 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "store.h"
+#include "addrset.h"
+
+static size_t addrhash(struct addrset *set, struct addr *a)
+{
+    size_t h;
+    
+    memcpy(&h, a->hash, sizeof(h));
+    return(h & (set->sz - 1));
+}
+
+int addrsethas(struct addrset *set, struct addr *a)
+{
+    size_t i;
+    
+    if(set->sz == 0)
+	return(0);
+    for(i = addrhash(set, a); !niladdr(&set->tab[i]); i = (i + 1) & (set->sz - 1)) {
+	if(!addrcmp(&set->tab[i], a))
+	    return(1);
+    }
+    return(0);
+}
+
+void addrsetadd(struct addrset *set, struct addr *a)
+{
+    struct addr *old;
+    size_t i, osz;
+    
+    if(set->n * 2 >= set->sz) {
+	old = set->tab;
+	osz = set->sz;
+	set->sz = (osz == 0)?65536:(osz * 2);
+	set->tab = calloc(set->sz, sizeof(*set->tab));
+	set->n = 0;
+	for(i = 0; i < osz; i++) {
+	    if(!niladdr(&old[i]))
+		addrsetadd(set, &old[i]);
+	}
+	if(old != NULL)
+	    free(old);
+    }
+    for(i = addrhash(set, a); !niladdr(&set->tab[i]); i = (i + 1) & (set->sz - 1)) {
+	if(!addrcmp(&set->tab[i], a))
+	    return;
+    }
+    set->tab[i] = *a;
+    set->n++;
+}
+
+void addrsetfree(struct addrset *set)
+{
+    if(set->tab != NULL)
+	free(set->tab);
+    memset(set, 0, sizeof(*set));
+}
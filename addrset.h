@@ -0,0 +1,16 @@
+#ifndef _ADDRSET_H
+#define _ADDRSET_H
+
+#include "store.h"
+
+/* An open-addressed hash set of block addresses */
+struct addrset {
+    struct addr *tab;
+    size_t n, sz;
+};
+
+int addrsethas(struct addrset *set, struct addr *a);
+void addrsetadd(struct addrset *set, struct addr *a);
+void addrsetfree(struct addrset *set);
+
+#endif
@@ -7,44 +7,213 @@
 
 #define min(a, b) (((b) < (a))?(b):(a))
 #define ISDELOP(op) (((op).buf == NULL) && ((op).fillfn == NULL))
+/*
+ * Indirect blocks are allocated on the heap, since trees with large
+ * fan-outs have indirect blocks far too large for the stack.
+ */
+#define INDIRSZ(blsize) (sizeof(struct btnode) << (blsize))
+
+/*
+ * Holes are nodes whose address is zero but for its last four bytes,
+ * which hold the length of each leaf under it, little-endian. No
+ * block can have such a hash in practice, and the length is never
+ * zero, so that the nil address is not a hole. A hole is always
+ * full, and may stand for a single leaf or a whole subtree of them.
+ */
+#define HOLEPFX (sizeof(struct addr) - 4)
+
+ssize_t btholelen(struct addr *a)
+{
+    int i;
+    size_t len;
+    
+    for(i = 0; i < HOLEPFX; i++) {
+	if(a->hash[i] != 0)
+	    return(-1);
+    }
+    for(i = 3, len = 0; i >= 0; i--)
+	len = (len << 8) | a->hash[HOLEPFX + i];
+    return((len == 0)?-1:len);
+}
+
+static void mkhole(struct addr *a, size_t len)
+{
+    int i;
+    
+    memset(a, 0, sizeof(*a));
+    for(i = 0; i < 4; i++, len >>= 8)
+	a->hash[HOLEPFX + i] = len & 0xff;
+}
+
+static int iszero(const void *buf, size_t len)
+{
+    const unsigned char *p;
+    
+    p = buf;
+    return((len > 0) && (p[0] == 0) && !memcmp(p, p + 1, len - 1));
+}
+
+/*
+ * Fills in the indirect block of the hole tree, which has all of its
+ * children, each a hole one level down. Returns their number.
+ */
+static block_t expandhole(struct btnode *tree, struct btnode *indir, size_t blsize)
+{
+    block_t i, c;
+    
+    c = 1LL << blsize;
+    for(i = 0; i < c; i++) {
+	indir[i].d = ((tree->d & 0x7f) - 1) | 0x80;
+	indir[i].a = tree->a;
+    }
+    return(c);
+}
 
 ssize_t btget(struct store *st, struct btnode *tree, block_t bl, void *buf, size_t len, size_t blsize)
 {
     int d;
     block_t c, sel;
-    struct btnode indir[1 << blsize];
+    struct btnode *indir;
     ssize_t sz;
     
     if(tree->d == 0) {
 	errno = ERANGE;
 	return(-1);
     }
+    indir = NULL;
     while(1) {
 	d = tree->d & 0x7f;
 	/* This check should really only be necessary on the first
 	 * iteration, but I felt it was easier to put it in the
 	 * loop. */
 	if((bl >> (d * blsize)) > 0) {
+	    sz = -1;
 	    errno = ERANGE;
-	    return(-1);
+	    break;
 	}
 	
-	if(d == 0)
-	    return(storeget(st, buf, len, &tree->a));
+	if((sz = btholelen(&tree->a)) >= 0) {
+	    memset(buf, 0, min(len, sz));
+	    break;
+	}
+	
+	if(d == 0) {
+	    sz = storeget(st, buf, len, &tree->a);
+	    break;
+	}
 	
 	/* Luckily, this is tail recursive */
-	if((sz = storeget(st, indir, sizeof(indir), &tree->a)) < 0)
-	    return(-1);
+	if(indir == NULL)
+	    indir = malloc(INDIRSZ(blsize));
+	if((sz = storeget(st, indir, INDIRSZ(blsize), &tree->a)) < 0)
+	    break;
 	c = sz / sizeof(struct btnode);
 	sel = bl >> ((d - 1) * blsize);
 	if(sel >= c) {
+	    sz = -1;
 	    errno = ERANGE;
-	    return(-1);
+	    break;
 	}
 	tree = &indir[sel];
 	bl &= (1LL << ((d - 1) * blsize)) - 1;
     }
-    return(0);
+    if(indir != NULL)
+	free(indir);
+    return(sz);
+}
+
+/*
+ * Collects the addresses of at most n consecutive leaves, starting
+ * at bl. Returns the number of leaves found, which is less than n if
+ * the tree ends before that.
+ */
+int btleaves(struct store *st, struct btnode *tree, block_t bl, int n, struct addr *as, size_t blsize)
+{
+    int d, got, r;
+    block_t c, sel, nextsz;
+    struct btnode *indir;
+    ssize_t sz;
+    
+    d = tree->d & 0x7f;
+    if((tree->d == 0) || ((bl >> (d * blsize)) > 0))
+	return(0);
+    if(d == 0) {
+	as[0] = tree->a;
+	return(1);
+    }
+    indir = malloc(INDIRSZ(blsize));
+    if(btholelen(&tree->a) >= 0) {
+	c = expandhole(tree, indir, blsize);
+    } else {
+	if((sz = storeget(st, indir, INDIRSZ(blsize), &tree->a)) < 0) {
+	    free(indir);
+	    return(-1);
+	}
+	c = sz / sizeof(struct btnode);
+    }
+    nextsz = 1LL << ((d - 1) * blsize);
+    got = 0;
+    for(sel = bl >> ((d - 1) * blsize); (sel < c) && (got < n); sel++) {
+	if((r = btleaves(st, &indir[sel], bl & (nextsz - 1), n - got, as + got, blsize)) < 0) {
+	    free(indir);
+	    return(-1);
+	}
+	got += r;
+	bl = 0;
+    }
+    free(indir);
+    return(got);
+}
+
+/*
+ * Gets the n blocks starting at bl, fetching them from the store all
+ * at once. Returns the number of blocks read, which is less than n
+ * if the tree ends before that, and their lengths in szs.
+ */
+int btgetmany(struct store *st, struct btnode *tree, block_t bl, int n, void **bufs, const size_t *lens, ssize_t *szs, size_t blsize)
+{
+    struct addr *as;
+    void **sbufs;
+    size_t *slens;
+    ssize_t *sszs;
+    int i, m, got, ret;
+    
+    as = malloc(sizeof(*as) * n);
+    if((got = btleaves(st, tree, bl, n, as, blsize)) < 0) {
+	free(as);
+	return(-1);
+    }
+    /* Holes are squeezed out of the list of blocks to get */
+    sbufs = malloc(sizeof(*sbufs) * got);
+    slens = malloc(sizeof(*slens) * got);
+    sszs = malloc(sizeof(*sszs) * got);
+    for(i = 0, m = 0; i < got; i++) {
+	if((szs[i] = btholelen(&as[i])) >= 0) {
+	    memset(bufs[i], 0, min(lens[i], szs[i]));
+	} else {
+	    sbufs[m] = bufs[i];
+	    slens[m] = lens[i];
+	    as[m++] = as[i];
+	}
+    }
+    ret = storegetmany(st, sbufs, slens, as, sszs, m);
+    for(i = 0, m = 0; !ret && (i < got); i++) {
+	if(szs[i] < 0)
+	    szs[i] = sszs[m++];
+    }
+    free(sbufs);
+    free(slens);
+    free(sszs);
+    free(as);
+    if(ret)
+	return(-1);
+    for(i = 0; i < got; i++) {
+	if(szs[i] < 0) {
+	    errno = ENOENT;
+	    return(-1);
+	}
+    }
+    return(got);
 }
 
 static int btputleaf(struct store *st, struct btnode *leaf, struct btop *op, block_t bloff)
@@ -57,6 +226,11 @@ static int btputleaf(struct store *st, struct btnode *leaf, struct btop *op, blo
 	leaf->d = 0;
 	return(0);
     }
+    if(op->stored) {
+	leaf->d = 0x80;
+	leaf->a = op->a;
+	return(0);
+    }
     buf = NULL;
     if(op->buf == NULL) {
 	buf = op->buf = malloc(op->len);
@@ -78,7 +252,7 @@ static int countops(struct btop *ops, int numops, block_t bloff, block_t maxbl)
     int i;
     
     for(i = 0; i < numops; i++) {
-	if(ops[i].blk - bloff >= maxbl)
+	if((ops[i].blk < bloff) || (ops[i].blk - bloff >= maxbl))
 	    break;
     }
     return(i);
@@ -88,12 +262,13 @@ static int countops(struct btop *ops, int numops, block_t bloff, block_t maxbl)
  * blputmany() in many ways makes the code uglier, but it saves a
  * *lot* of space, since it doesn't need to store intermediary blocks.
  */
-static int btputmany2(struct store *st, struct btnode *tree, struct btop *ops, int numops, size_t blsize, block_t bloff)
+static int btputmany2(struct store *st, struct btnode *tree, struct btop *ops, int numops, size_t blsize, block_t bloff);
+
+static int btputmany3(struct store *st, struct btnode *tree, struct btop *ops, int numops, size_t blsize, block_t bloff, struct btnode *indir)
 {
     int i, subops, d, f, hasid;
     block_t c, sel, bl, nextsz;
     struct addr na;
-    struct btnode indir[1 << blsize];
     ssize_t sz;
     
     d = tree->d & 0x7f;
@@ -109,8 +284,9 @@ static int btputmany2(struct store *st, struct btnode *tree, struct btop *ops, i
 	bl = ops[i].blk - bloff;
     
 	if((d == 0) && (bl == 0)) {
-	    if(btputleaf(st, tree, ops, bloff))
+	    if(btputleaf(st, tree, ops + i, bloff))
 		return(-1);
+	    f = tree->d & 0x80;
 	    i++;
 	    continue;
 	}
@@ -135,16 +311,20 @@ static int btputmany2(struct store *st, struct btnode *tree, struct btop *ops, i
 	    }
 	    /* Assume that numops == largest block number + 1 -- gaps
 	     * will be detected as errors later */
-	    for(bl = numops - 1; bl > 0; d++, bl <<= blsize);
+	    for(bl = numops - 1; bl > 0; d++, bl >>= blsize);
 	    tree->d = d;
 	    c = 0;
 	    hasid = 1;
 	} else {
 	    /* Get indirect block */
 	    if(!hasid) {
-		if((sz = storeget(st, indir, sizeof(indir), &tree->a)) < 0)
-		    return(-1);
-		c = sz / sizeof(struct btnode);
+		if(btholelen(&tree->a) >= 0) {
+		    c = expandhole(tree, indir, blsize);
+		} else {
+		    if((sz = storeget(st, indir, INDIRSZ(blsize), &tree->a)) < 0)
+			return(-1);
+		    c = sz / sizeof(struct btnode);
+		}
 		hasid = 1;
 	    }
 	}
@@ -174,15 +354,20 @@ static int btputmany2(struct store *st, struct btnode *tree, struct btop *ops, i
 	    /* Filled up */
 	    tree->d |= 0x80;
 	    f = 1;
-	} else if(indir[sel].d == 0) {
+	} else if(indir[sel].d != ((d - 1) | 0x80)) {
+	    /* No longer full, if it was */
+	    tree->d &= 0x7f;
+	    f = 0;
 	    /* Erased */
-	    if(--c == 1) {
-		tree->d = indir[0].d;
-		tree->a = indir[0].a;
-	    }
+	    if(indir[sel].d == 0)
+		c--;
 	}
     }
     if(hasid) {
+	if(c == 0) {
+	    tree->d = 0;
+	    return(0);
+	}
 	if(storeput(st, indir, c * sizeof(struct btnode), &na))
 	    return(-1);
 	tree->a = na;
@@ -190,8 +375,85 @@ static int btputmany2(struct store *st, struct btnode *tree, struct btop *ops, i
     return(0);
 }
 
+static int btputmany2(struct store *st, struct btnode *tree, struct btop *ops, int numops, size_t blsize, block_t bloff)
+{
+    struct btnode *indir;
+    int ret;
+    
+    /* Leaf puts need no indirect block */
+    if(((tree->d & 0x7f) == 0) && (numops == 1) && (ops[0].blk == bloff))
+	return(btputmany3(st, tree, ops, numops, blsize, bloff, NULL));
+    indir = malloc(INDIRSZ(blsize));
+    ret = btputmany3(st, tree, ops, numops, blsize, bloff, indir);
+    free(indir);
+    return(ret);
+}
+
+/*
+ * Puts the data of all leaves at once before walking the tree, so
+ * that the store can hash them as one batch. Leaves of nothing but
+ * zeroes are made holes instead.
+ */
+static int btputleaves(struct store *st, struct btop *ops, int numops)
+{
+    const void **bufs;
+    size_t *lens;
+    struct addr *as;
+    struct btop **lops;
+    int i, n, ret;
+    
+    bufs = malloc(sizeof(*bufs) * numops);
+    lens = malloc(sizeof(*lens) * numops);
+    as = malloc(sizeof(*as) * numops);
+    lops = malloc(sizeof(*lops) * numops);
+    ret = -1;
+    for(i = 0, n = 0; i < numops; i++) {
+	if(ISDELOP(ops[i]) || ops[i].stored)
+	    continue;
+	lops[n] = &ops[i];
+	lens[n] = ops[i].len;
+	if(ops[i].buf == NULL) {
+	    bufs[n] = malloc(ops[i].len);
+	    if(ops[i].fillfn((void *)bufs[n], ops[i].len, ops[i].pdata)) {
+		free((void *)bufs[n]);
+		goto out;
+	    }
+	} else {
+	    bufs[n] = ops[i].buf;
+	}
+	if(iszero(bufs[n], lens[n])) {
+	    if(ops[i].buf == NULL)
+		free((void *)bufs[n]);
+	    ops[i].stored = 1;
+	    mkhole(&ops[i].a, lens[n]);
+	    continue;
+	}
+	n++;
+    }
+    if(storeputmany(st, bufs, lens, as, n))
+	goto out;
+    for(i = 0; i < n; i++) {
+	lops[i]->stored = 1;
+	lops[i]->a = as[i];
+    }
+    ret = 0;
+    
+out:
+    for(i = 0; i < n; i++) {
+	if(lops[i]->buf == NULL)
+	    free((void *)bufs[i]);
+    }
+    free(bufs);
+    free(lens);
+    free(as);
+    free(lops);
+    return(ret);
+}
+
 int btputmany(struct store *st, struct btnode *tree, struct btop *ops, int numops, size_t blsize)
 {
+    if(btputleaves(st, ops, numops))
+	return(-1);
     return(btputmany2(st, tree, ops, numops, blsize, 0));
 }
 
@@ -206,6 +468,117 @@ int btput(struct store *st, struct btnode *tree, block_t bl, void *buf, size_t l
     return(btputmany(st, tree, &ops, 1, blsize));
 }
 
+/*
+ * Puts a node of depth d above tree, by adding indirect blocks with
+ * it as their only child, as when the tree grows past what its
+ * depth can hold.
+ */
+static int raisetree(struct store *st, struct btnode *tree, int d)
+{
+    struct btnode indir;
+    struct addr na;
+    
+    while((tree->d & 0x7f) < d) {
+	indir = *tree;
+	if(storeput(st, &indir, sizeof(indir), &na))
+	    return(-1);
+	tree->d = (indir.d & 0x7f) + 1;
+	tree->a = na;
+    }
+    return(0);
+}
+
+/*
+ * Makes the n leaves from bl on of the subtree tree, which holds
+ * leaves of depth d, holes of the address ha. Subtrees that are
+ * covered entirely become single hole nodes.
+ */
+static int puthole(struct store *st, struct btnode *tree, int d, block_t bl, block_t n, struct addr *ha, size_t blsize)
+{
+    struct btnode *indir;
+    struct addr na;
+    block_t c, sel, nextsz, sb, se;
+    ssize_t sz;
+    int ret;
+    
+    if((bl == 0) && (n == (1LL << (d * blsize)))) {
+	tree->d = d | 0x80;
+	tree->a = *ha;
+	return(0);
+    }
+    if((tree->d != 0) && raisetree(st, tree, d))
+	return(-1);
+    indir = malloc(INDIRSZ(blsize));
+    ret = -1;
+    if(tree->d == 0) {
+	c = 0;
+    } else if(btholelen(&tree->a) >= 0) {
+	c = expandhole(tree, indir, blsize);
+    } else {
+	if((sz = storeget(st, indir, INDIRSZ(blsize), &tree->a)) < 0)
+	    goto out;
+	c = sz / sizeof(struct btnode);
+    }
+    nextsz = 1LL << ((d - 1) * blsize);
+    for(sel = bl / nextsz; sel * nextsz < bl + n; sel++) {
+	if(sel > c) {
+	    errno = ERANGE;
+	    goto out;
+	}
+	if(sel == c) {
+	    if((c > 0) && (indir[c - 1].d != ((d - 1) | 0x80))) {
+		errno = ERANGE;
+		goto out;
+	    }
+	    indir[c++].d = 0;
+	}
+	sb = (bl > sel * nextsz)?(bl - (sel * nextsz)):0;
+	se = ((bl + n < (sel + 1) * nextsz)?(bl + n):((sel + 1) * nextsz)) - (sel * nextsz);
+	if(puthole(st, &indir[sel], d - 1, sb, se - sb, ha, blsize))
+	    goto out;
+    }
+    if(storeput(st, indir, c * sizeof(struct btnode), &na))
+	goto out;
+    tree->a = na;
+    tree->d = d;
+    if((c == (1LL << blsize)) && (indir[c - 1].d == ((d - 1) | 0x80)))
+	tree->d |= 0x80;
+    ret = 0;
+    
+out:
+    free(indir);
+    return(ret);
+}
+
+/*
+ * Makes the n leaves from bl on holes of len bytes each, without
+ * touching the store for any of their data. As with btputmany(), bl
+ * may be at most the number of leaves already in the tree, which
+ * grows as needed.
+ */
+int btputhole(struct store *st, struct btnode *tree, block_t bl, block_t n, size_t len, size_t blsize)
+{
+    struct btnode nt;
+    struct addr ha;
+    int d;
+    
+    if((len == 0) || (len > STORE_MAXBLSZ)) {
+	errno = EINVAL;
+	return(-1);
+    }
+    if(n == 0)
+	return(0);
+    mkhole(&ha, len);
+    for(d = 0; ((bl + n - 1) >> (d * blsize)) > 0; d++);
+    if((tree->d != 0) && ((tree->d & 0x7f) > d))
+	d = tree->d & 0x7f;
+    nt = *tree;
+    if(puthole(st, &nt, d, bl, n, &ha, blsize))
+	return(-1);
+    *tree = nt;
+    return(0);
+}
+
 void btmkop(struct btop *op, block_t bl, void *buf, size_t len)
 {
     memset(op, 0, sizeof(*op));
@@ -234,7 +607,7 @@ void btsortops(struct btop *ops, int numops)
 block_t btcount(struct store *st, struct btnode *tree, size_t blsize)
 {
     int d, f;
-    struct btnode indir[1 << blsize];
+    struct btnode *indir;
     block_t c, ret;
     ssize_t sz;
     
@@ -248,15 +621,68 @@ block_t btcount(struct store *st, struct btnode *tree, size_t blsize)
 	return(0);
     
     ret = 0;
+    indir = malloc(INDIRSZ(blsize));
     while(1) {
-	if((sz = storeget(st, indir, sizeof(indir), &tree->a)) < 0)
-	    return(-1);
+	if((sz = storeget(st, indir, INDIRSZ(blsize), &tree->a)) < 0) {
+	    ret = -1;
+	    break;
+	}
 	c = sz / sizeof(struct btnode);
 	ret += (c - 1) * (1LL << ((d - 1) * blsize));
 	d = indir[c - 1].d & 0x7f;
 	f = indir[c - 1].d & 0x80;
-	if(f)
-	    return(ret + (1LL << (d * blsize)));
+	if(f) {
+	    ret += 1LL << (d * blsize);
+	    break;
+	}
 	tree = &indir[c - 1];
     }
+    free(indir);
+    return(ret);
+}
+
+/*
+ * Calls fn for every node of the tree, parents before children. Since
+ * indirect blocks are just arrays of btnodes, this does not need to
+ * know the fan-out of the tree. If fn returns a positive value for a
+ * node, its children are skipped; a negative value aborts the walk.
+ * Holes have no block in the store, and are skipped altogether.
+ * Indirect blocks are first read into a buffer fitting a fan-out of
+ * 256, and read again in the rare case that they are larger.
+ */
+#define WALKBUFSZ INDIRSZ(8)
+
+int btwalk(struct store *st, struct btnode *tree, int (*fn)(struct btnode *node, void *pdata), void *pdata)
+{
+    struct btnode *indir;
+    ssize_t sz;
+    int i, c, ret;
+    
+    if((tree->d == 0) || (btholelen(&tree->a) >= 0))
+	return(0);
+    if((ret = fn(tree, pdata)) != 0)
+	return((ret < 0)?-1:0);
+    if((tree->d & 0x7f) == 0)
+	return(0);
+    indir = malloc(WALKBUFSZ);
+    if((sz = storeget(st, indir, WALKBUFSZ, &tree->a)) < 0) {
+	free(indir);
+	return(-1);
+    }
+    if(sz > WALKBUFSZ) {
+	indir = realloc(indir, sz);
+	if((sz = storeget(st, indir, sz, &tree->a)) < 0) {
+	    free(indir);
+	    return(-1);
+	}
+    }
+    c = sz / sizeof(struct btnode);
+    for(i = 0; i < c; i++) {
+	if(btwalk(st, &indir[i], fn, pdata)) {
+	    free(indir);
+	    return(-1);
+	}
+    }
+    free(indir);
+    return(0);
 }
@@ -17,13 +17,20 @@ struct btop {
     size_t len;
     int (*fillfn)(void *buf, size_t len, void *pdata);
     void *pdata;
+    int stored;
+    struct addr a;
 };
 
 ssize_t btget(struct store *st, struct btnode *tree, block_t bl, void *buf, size_t len, size_t blsize);
+int btleaves(struct store *st, struct btnode *tree, block_t bl, int n, struct addr *as, size_t blsize);
+int btgetmany(struct store *st, struct btnode *tree, block_t bl, int n, void **bufs, const size_t *lens, ssize_t *szs, size_t blsize);
 int btputmany(struct store *st, struct btnode *tree, struct btop *ops, int numops, size_t blsize);
 int btput(struct store *st, struct btnode *tree, block_t bl, void *buf, size_t len, size_t blsize);
 block_t btcount(struct store *st, struct btnode *tree, size_t blsize);
 void btsortops(struct btop *ops, int numops);
 void btmkop(struct btop *op, block_t bl, void *buf, size_t len);
+int btputhole(struct store *st, struct btnode *tree, block_t bl, block_t n, size_t len, size_t blsize);
+ssize_t btholelen(struct addr *a);
+int btwalk(struct store *st, struct btnode *tree, int (*fn)(struct btnode *node, void *pdata), void *pdata);
 
 #endif
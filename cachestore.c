@@ -0,0 +1,291 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "store.h"
+
+/*
+ * A read-through cache in front of another store, holding the most
+ * recently used blocks up to a total size. Puts are written through
+ * to the backing store. It replaces the fixed-size cache of the
+ * stores underneath it, which is turned off, and it owns the backing
+ * store, which is released with it.
+ */
+
+#define min(a, b) (((b) < (a))?(b):(a))
+
+struct cblock {
+    struct cblock *next, *lprev, *lnext;
+    struct addr a;
+    void *data;
+    size_t len;
+};
+
+struct cstore {
+    struct store *back;
+    struct cblock **tab;
+    /* LRU list, most recently used first */
+    struct cblock *lru, *lrutail;
+    size_t n, sz;
+    size_t size, maxsize;
+};
+
+static size_t chash(struct cstore *cs, struct addr *a)
+{
+    size_t h;
+    
+    memcpy(&h, a->hash, sizeof(h));
+    return(h & (cs->sz - 1));
+}
+
+static void lruunlink(struct cstore *cs, struct cblock *b)
+{
+    if(b->lprev != NULL)
+	b->lprev->lnext = b->lnext;
+    else
+	cs->lru = b->lnext;
+    if(b->lnext != NULL)
+	b->lnext->lprev = b->lprev;
+    else
+	cs->lrutail = b->lprev;
+}
+
+static void lrufront(struct cstore *cs, struct cblock *b)
+{
+    b->lprev = NULL;
+    if((b->lnext = cs->lru) != NULL)
+	cs->lru->lprev = b;
+    else
+	cs->lrutail = b;
+    cs->lru = b;
+}
+
+static struct cblock *cfind(struct cstore *cs, struct addr *a)
+{
+    struct cblock *b;
+    
+    for(b = cs->tab[chash(cs, a)]; b != NULL; b = b->next) {
+	if(!addrcmp(&b->a, a))
+	    return(b);
+    }
+    return(NULL);
+}
+
+static void cremove(struct cstore *cs, struct cblock *b)
+{
+    struct cblock **bp;
+    
+    for(bp = &cs->tab[chash(cs, &b->a)]; *bp != b; bp = &(*bp)->next);
+    *bp = b->next;
+    lruunlink(cs, b);
+    cs->size -= b->len;
+    cs->n--;
+    free(b->data);
+    free(b);
+}
+
+static void cgrow(struct cstore *cs)
+{
+    struct cblock **old, *b, *next;
+    size_t i, osz, h;
+    
+    old = cs->tab;
+    osz = cs->sz;
+    cs->sz = osz * 2;
+    cs->tab = calloc(cs->sz, sizeof(*cs->tab));
+    for(i = 0; i < osz; i++) {
+	for(b = old[i]; b != NULL; b = next) {
+	    next = b->next;
+	    h = chash(cs, &b->a);
+	    b->next = cs->tab[h];
+	    cs->tab[h] = b;
+	}
+    }
+    free(old);
+}
+
+static void cadd(struct cstore *cs, struct addr *a, const void *data, size_t len)
+{
+    struct cblock *b;
+    size_t h;
+    
+    if(len > cs->maxsize)
+	return;
+    if((b = cfind(cs, a)) != NULL) {
+	lruunlink(cs, b);
+	lrufront(cs, b);
+	return;
+    }
+    while((cs->lrutail != NULL) && (cs->size + len > cs->maxsize))
+	cremove(cs, cs->lrutail);
+    if(cs->n >= cs->sz)
+	cgrow(cs);
+    b = malloc(sizeof(*b));
+    b->a = *a;
+    b->len = len;
+    b->data = memcpy(malloc(len ? len : 1), data, len);
+    h = chash(cs, a);
+    b->next = cs->tab[h];
+    cs->tab[h] = b;
+    lrufront(cs, b);
+    cs->size += len;
+    cs->n++;
+}
+
+static ssize_t cget(struct cstore *cs, void *buf, size_t len, struct addr *a)
+{
+    struct cblock *b;
+    
+    if((b = cfind(cs, a)) == NULL)
+	return(-2);
+    lruunlink(cs, b);
+    lrufront(cs, b);
+    if(buf != NULL)
+	memcpy(buf, b->data, min(len, b->len));
+    return(b->len);
+}
+
+static int put(struct store *st, const void *buf, size_t len, struct addr *at)
+{
+    struct cstore *cs;
+    
+    cs = st->pdata;
+    if(storeput(cs->back, buf, len, at))
+	return(-1);
+    cadd(cs, at, buf, len);
+    return(0);
+}
+
+static ssize_t get(struct store *st, void *buf, size_t len, struct addr *at)
+{
+    struct cstore *cs;
+    ssize_t sz;
+    
+    cs = st->pdata;
+    if((sz = cget(cs, buf, len, at)) != -2)
+	return(sz);
+    if((sz = storeget(cs->back, buf, len, at)) < 0)
+	return(-1);
+    if((buf != NULL) && (sz <= len))
+	cadd(cs, at, buf, sz);
+    return(sz);
+}
+
+static int putmany(struct store *st, const void **bufs, const size_t *lens, struct addr *ats, int n)
+{
+    struct cstore *cs;
+    int i;
+    
+    cs = st->pdata;
+    if(storeputmany(cs->back, bufs, lens, ats, n))
+	return(-1);
+    for(i = 0; i < n; i++)
+	cadd(cs, &ats[i], bufs[i], lens[i]);
+    return(0);
+}
+
+static int getmany(struct store *st, void **bufs, const size_t *lens, struct addr *ats, ssize_t *szs, int n)
+{
+    struct cstore *cs;
+    void **mbufs;
+    size_t *mlens;
+    struct addr *mats;
+    ssize_t *mszs;
+    int i, m, *mi, ret;
+    
+    cs = st->pdata;
+    mi = malloc(sizeof(*mi) * n);
+    for(i = 0, m = 0; i < n; i++) {
+	if((szs[i] = cget(cs, bufs[i], lens[i], &ats[i])) == -2)
+	    mi[m++] = i;
+    }
+    ret = 0;
+    if(m > 0) {
+	mbufs = malloc(sizeof(*mbufs) * m);
+	mlens = malloc(sizeof(*mlens) * m);
+	mats = malloc(sizeof(*mats) * m);
+	mszs = malloc(sizeof(*mszs) * m);
+	for(i = 0; i < m; i++) {
+	    mbufs[i] = bufs[mi[i]];
+	    mlens[i] = lens[mi[i]];
+	    mats[i] = ats[mi[i]];
+	}
+	if(storegetmany(cs->back, mbufs, mlens, mats, mszs, m)) {
+	    ret = -1;
+	} else {
+	    for(i = 0; i < m; i++) {
+		szs[mi[i]] = mszs[i];
+		if((mszs[i] >= 0) && (mszs[i] <= mlens[i]))
+		    cadd(cs, &mats[i], mbufs[i], mszs[i]);
+	    }
+	}
+	free(mbufs);
+	free(mlens);
+	free(mats);
+	free(mszs);
+    }
+    free(mi);
+    return(ret);
+}
+
+static int bulk(struct store *st, int on)
+{
+    struct cstore *cs;
+    
+    cs = st->pdata;
+    return(storebulk(cs->back, on));
+}
+
+static int hot(struct store *st, struct addr *as, int max)
+{
+    struct cstore *cs;
+    struct cblock *b;
+    int n;
+    
+    cs = st->pdata;
+    for(b = cs->lru, n = 0; (b != NULL) && (n < max); b = b->lnext)
+	as[n++] = b->a;
+    return(n);
+}
+
+static int release(struct store *st)
+{
+    struct cstore *cs;
+    int ret;
+    
+    cs = st->pdata;
+    if((ret = releasestore(cs->back)) != 0)
+	return(ret);
+    while(cs->lru != NULL)
+	cremove(cs, cs->lru);
+    free(cs->tab);
+    free(cs);
+    return(0);
+}
+
+static struct storeops ops = {
+    .put = put,
+    .get = get,
+    .release = release,
+    .bulk = bulk,
+    .putmany = putmany,
+    .getmany = getmany,
+    .hot = hot,
+};
+
+/* Wraps back in a cache of at most maxsize bytes of block data. */
+struct store *newcachestore(struct store *back, size_t maxsize)
+{
+    struct store *st;
+    struct cstore *cs;
+    
+    cs = calloc(1, sizeof(*cs));
+    cs->back = back;
+    cs->maxsize = maxsize;
+    cs->sz = 1024;
+    cs->tab = calloc(cs->sz, sizeof(*cs->tab));
+    storenocache(back);
+    st = newstore(&ops);
+    storenocache(st);
+    st->pdata = cs;
+    return(st);
+}
@@ -0,0 +1,285 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "store.h"
+#include "blocktree.h"
+#include "vcfs.h"
+#include "chunk.h"
+
+/*
+ * Content-defined chunking of file data, so that an insertion into a
+ * file only changes the chunks around it, and the rest still dedup
+ * against the blocks of earlier revisions.
+ *
+ * Boundaries are found with a Gear rolling hash, normalized as in
+ * FastCDC: no boundary is looked for in the first CDCMIN bytes of a
+ * chunk, a harder mask is used up to CDCAVG bytes and an easier one
+ * after that, which keeps most chunks close to the average size.
+ * The masks test the top bits of the hash, which depend on the 64
+ * bytes last shifted in. The Gear table is generated from a fixed
+ * seed, and must never change, or chunks would stop deduplicating
+ * against everything already stored.
+ *
+ * The data tree of a chunked file holds one chunk per leaf, and its
+ * chunks field a size index: a tree whose leaf k holds the end
+ * offsets of chunks k * CHIDXN and onwards, as u_int64_t.
+ */
+
+/* Leaves dropped per btputmany() when truncating */
+#define CHTRUNCBATCH 4096
+
+#define MASKS (((1ULL << 18) - 1) << 46)
+#define MASKL (((1ULL << 14) - 1) << 50)
+#define GEARSEED 0x766366736364632eULL
+
+#define min(a, b) (((b) < (a))?(b):(a))
+
+static u_int64_t gear[256];
+static pthread_once_t gearonce = PTHREAD_ONCE_INIT;
+
+/* splitmix64 */
+static void mkgear(void)
+{
+    u_int64_t s, z;
+    int i;
+    
+    s = GEARSEED;
+    for(i = 0; i < 256; i++) {
+	z = (s += 0x9e3779b97f4a7c15ULL);
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	gear[i] = z ^ (z >> 31);
+    }
+}
+
+/*
+ * Returns the length of the first chunk of the len bytes at buf. If
+ * there is no boundary before the data ends, len is returned, which
+ * is only a chunk if the file ends there as well; the caller should
+ * otherwise have at least CDCMAX bytes at hand.
+ */
+size_t cdcsplit(const void *buf, size_t len)
+{
+    const unsigned char *p;
+    u_int64_t h;
+    size_t i, norm, max;
+    
+    pthread_once(&gearonce, mkgear);
+    if(len <= CDCMIN)
+	return(len);
+    p = buf;
+    max = min(len, CDCMAX);
+    norm = min(max, CDCAVG);
+    h = 0;
+    for(i = CDCMIN; i < norm; i++) {
+	h = (h << 1) + gear[p[i]];
+	if(!(h & MASKS))
+	    return(i + 1);
+    }
+    for(; i < max; i++) {
+	h = (h << 1) + gear[p[i]];
+	if(!(h & MASKL))
+	    return(i + 1);
+    }
+    return(max);
+}
+
+/*
+ * Appends n chunks to the file ino, which must be empty or chunked,
+ * adding their end offsets to its size index. The last leaf of the
+ * index is rewritten if it was not full.
+ */
+int chunkappend(struct store *st, struct inode *ino, const void **bufs, const size_t *lens, int n)
+{
+    struct btop *ops;
+    u_int64_t *ends, end;
+    block_t nleaves, first, nch;
+    ssize_t sz;
+    int i, k, nl, ret;
+    
+    if((ino->size > 0) && (ino->chunks.d == 0)) {
+	errno = EINVAL;
+	return(-1);
+    }
+    if(n == 0)
+	return(0);
+    nleaves = 0;
+    sz = 0;
+    ends = malloc(sizeof(*ends) * (CHIDXN + n));
+    if(ino->chunks.d != 0) {
+	if((nleaves = btcount(st, &ino->chunks, CHIDXBLSIZE)) < 0) {
+	    free(ends);
+	    return(-1);
+	}
+	if((sz = btget(st, &ino->chunks, nleaves - 1, ends, sizeof(*ends) * CHIDXN, CHIDXBLSIZE)) < 0) {
+	    free(ends);
+	    return(-1);
+	}
+	sz /= sizeof(*ends);
+	/* A full last leaf is left alone */
+	if(sz == CHIDXN)
+	    sz = 0;
+	else
+	    nleaves--;
+    }
+    first = nleaves;
+    nch = (nleaves * CHIDXN) + sz;
+    nl = (sz + n + CHIDXN - 1) / CHIDXN;
+    ops = malloc(sizeof(*ops) * ((n > nl)?n:nl));
+    for(i = 0, end = ino->size; i < n; i++) {
+	btmkop(ops + i, nch + i, (void *)bufs[i], lens[i]);
+	ends[sz + i] = (end += lens[i]);
+    }
+    ret = -1;
+    if(btputmany(st, &ino->data, ops, n, FILEBLSIZE))
+	goto out;
+    for(k = 0; k < nl; k++)
+	btmkop(ops + k, first + k, ends + (k * CHIDXN), sizeof(*ends) * min(CHIDXN, sz + n - (k * CHIDXN)));
+    if(btputmany(st, &ino->chunks, ops, nl, CHIDXBLSIZE))
+	goto out;
+    ino->size = end;
+    ret = 0;
+    
+out:
+    free(ops);
+    free(ends);
+    return(ret);
+}
+
+/*
+ * Finds the data block of ino that holds the byte at off, and the
+ * offset in the file at which that block starts. Chunked files are
+ * searched through their size index, first for the leaf and then
+ * for the chunk in it.
+ */
+block_t chunkfind(struct store *st, struct inode *ino, u_int64_t off, u_int64_t *start)
+{
+    u_int64_t *ends;
+    block_t lo, hi, mid, nleaves, leaf;
+    ssize_t sz;
+    int i, n;
+    
+    if(off >= ino->size) {
+	errno = ERANGE;
+	return(-1);
+    }
+    if(ino->chunks.d == 0) {
+	*start = off - (off % FILEBLKSZ);
+	return(off / FILEBLKSZ);
+    }
+    if((nleaves = btcount(st, &ino->chunks, CHIDXBLSIZE)) < 0)
+	return(-1);
+    ends = malloc(sizeof(*ends) * CHIDXN);
+    /* The first leaf whose last chunk ends after off */
+    for(lo = 0, hi = nleaves - 1; lo < hi; ) {
+	mid = lo + ((hi - lo) / 2);
+	if((sz = btget(st, &ino->chunks, mid, ends, sizeof(*ends) * CHIDXN, CHIDXBLSIZE)) <= 0)
+	    goto err;
+	if(ends[(sz / sizeof(*ends)) - 1] > off)
+	    hi = mid;
+	else
+	    lo = mid + 1;
+    }
+    leaf = lo;
+    if(leaf > 0) {
+	if((sz = btget(st, &ino->chunks, leaf - 1, ends, sizeof(*ends) * CHIDXN, CHIDXBLSIZE)) <= 0)
+	    goto err;
+	*start = ends[(sz / sizeof(*ends)) - 1];
+    } else {
+	*start = 0;
+    }
+    if((sz = btget(st, &ino->chunks, leaf, ends, sizeof(*ends) * CHIDXN, CHIDXBLSIZE)) <= 0)
+	goto err;
+    n = sz / sizeof(*ends);
+    for(i = 0; (i < n) && (ends[i] <= off); i++)
+	*start = ends[i];
+    if(i == n) {
+	errno = EIO;
+	goto err;
+    }
+    free(ends);
+    return((leaf * CHIDXN) + i);
+    
+err:
+    if(sz == 0)
+	errno = EIO;
+    free(ends);
+    return(-1);
+}
+
+/* Drops the leaves of tree from n down to from, last first. */
+static int dropleaves(struct store *st, struct btnode *tree, block_t from, block_t n, size_t blsize)
+{
+    struct btop ops[CHTRUNCBATCH];
+    int i;
+    
+    while(n > from) {
+	for(i = 0; (i < CHTRUNCBATCH) && (n > from); i++)
+	    btmkop(ops + i, --n, NULL, 0);
+	if(btputmany(st, tree, ops, i, blsize))
+	    return(-1);
+    }
+    return(0);
+}
+
+/*
+ * Shrinks the chunked file ino to size, which must be smaller than
+ * its current size. The chunk that size falls in is cut short, and
+ * those after it are dropped from the data and from the size index.
+ */
+int chunktrunc(struct store *st, struct inode *ino, u_int64_t size)
+{
+    u_int64_t *ends, start, lstart;
+    block_t bl, last, keep, nleaves, kl;
+    ssize_t sz;
+    char *buf;
+    int n;
+    
+    if((ino->chunks.d == 0) || (size >= ino->size)) {
+	errno = EINVAL;
+	return(-1);
+    }
+    if(size == 0) {
+	ino->data.d = 0;
+	ino->chunks.d = 0;
+	ino->size = 0;
+	return(0);
+    }
+    if(((bl = chunkfind(st, ino, size, &start)) < 0) ||
+       ((last = chunkfind(st, ino, ino->size - 1, &lstart)) < 0))
+	return(-1);
+    keep = (start < size)?(bl + 1):bl;
+    if(dropleaves(st, &ino->data, keep, last + 1, FILEBLSIZE))
+	return(-1);
+    if(start < size) {
+	buf = malloc(CDCMAX);
+	if(((sz = btget(st, &ino->data, bl, buf, CDCMAX, FILEBLSIZE)) < 0) ||
+	   btput(st, &ino->data, bl, buf, size - start, FILEBLSIZE)) {
+	    free(buf);
+	    return(-1);
+	}
+	free(buf);
+    }
+    if((nleaves = btcount(st, &ino->chunks, CHIDXBLSIZE)) < 0)
+	return(-1);
+    kl = (keep - 1) / CHIDXN;
+    if(dropleaves(st, &ino->chunks, kl + 1, nleaves, CHIDXBLSIZE))
+	return(-1);
+    ends = malloc(sizeof(*ends) * CHIDXN);
+    n = ((keep - 1) % CHIDXN) + 1;
+    if(btget(st, &ino->chunks, kl, ends, sizeof(*ends) * CHIDXN, CHIDXBLSIZE) < (ssize_t)(sizeof(*ends) * n)) {
+	free(ends);
+	errno = EIO;
+	return(-1);
+    }
+    ends[n - 1] = size;
+    if(btput(st, &ino->chunks, kl, ends, sizeof(*ends) * n, CHIDXBLSIZE)) {
+	free(ends);
+	return(-1);
+    }
+    free(ends);
+    ino->size = size;
+    return(0);
+}
@@ -0,0 +1,22 @@
+#ifndef _CHUNK_H
+#define _CHUNK_H
+
+#include "store.h"
+#include "blocktree.h"
+#include "vcfs.h"
+
+/* Bounds and average size of content-defined chunks */
+#define CDCMIN (16 << 10)
+#define CDCAVG (64 << 10)
+#define CDCMAX (256 << 10)
+
+#define CHIDXBLSIZE 8
+/* Chunk end offsets per leaf of the size index */
+#define CHIDXN 512
+
+size_t cdcsplit(const void *buf, size_t len);
+int chunkappend(struct store *st, struct inode *ino, const void **bufs, const size_t *lens, int n);
+block_t chunkfind(struct store *st, struct inode *ino, u_int64_t off, u_int64_t *start);
+int chunktrunc(struct store *st, struct inode *ino, u_int64_t size);
+
+#endif
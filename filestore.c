@@ -1,5 +1,6 @@
 #define _LARGEFILE64_SOURCE
 #define _XOPEN_SOURCE 500
+#define _GNU_SOURCE
 #include <stdlib.h>
 #include <unistd.h>
 #include <stdio.h>
@@ -8,16 +9,42 @@
 #include <string.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <dirent.h>
 #include <gcrypt.h>
+#include <zlib.h>
+#include <pthread.h>
 #include <assert.h>
 
 #include "utils.h"
 #include "store.h"
 #include "log.h"
+#include "uring.h"
 
 #define LOGMAGIC "Dolda/Venti-1"
 #define IDXMAGIC "Dolda/Index-1"
 #define LOGENTMAGIC "\xca\xe5\x7a\x93"
+/* Records a move of another store over this one, see mvfstore() */
+#define MOVEFILE "moving"
+
+/*
+ * The log is split into segments of at most LOGSEGSIZE bytes, the
+ * first of which is named "log" and the following ones "log.N". All
+ * but the last segment are sealed: they are never written again, so
+ * they are opened read-only and mapped into memory. Index entries
+ * refer to log entries by segment number and offset, packed by
+ * SEGOFF(), so that stores from before segmentation are simply
+ * stores with one segment.
+ */
+#define LOGSEGSIZE (1LL << 30)
+#define SEGSHIFT 40
+#define SEGOFF(seg, off) (((u_int64_t)(seg) << SEGSHIFT) | (u_int64_t)(off))
+#define OFFSEG(o) ((int)((o) >> SEGSHIFT))
+#define OFFOFF(o) ((loff_t)((o) & ((1ULL << SEGSHIFT) - 1)))
+
+/* Queue depth of the io_uring used with FST_URING */
+#define URINGDEPTH 64
 
 typedef loff_t idx_t;
 
@@ -43,23 +70,132 @@ struct logent {
     u_int8_t fl;
 };
 
+/*
+ * A log entry with LOGENT_DEFLATE set holds its uncompressed length
+ * as a u_int16_t, followed by the zlib-compressed data; len is then
+ * the stored length. The name is always the hash of the uncompressed
+ * data. Blocks that do not shrink are stored raw.
+ */
+#define LOGENT_DEFLATE 1
+/*
+ * A log entry with LOGENT_ALIGNED set is followed by padding up to
+ * the next LOGALIGN boundary, so that the entry after it starts on a
+ * sector. Stores opened with FST_ALIGN write all entries this way.
+ */
+#define LOGENT_ALIGNED 2
+#define LOGALIGN 512
+/*
+ * Blocks longer than 65535 bytes are stored in entries with
+ * LOGENT_LONG set, whose header is followed by a u_int32_t holding
+ * the stored length, len being zero. The uncompressed length in
+ * front of compressed data is then a u_int32_t as well.
+ */
+#define LOGENT_LONG 4
+#define SHORTMAX 65535
+
+/* An entry header as read, with its full stored length resolved. */
+struct entinfo {
+    struct logent le;
+    size_t hlen, len;
+};
+
+/*
+ * With FST_DIRECT, log segments are read with O_DIRECT, bypassing
+ * the page cache, through buffers from a pool of DIOALIGN-aligned
+ * buffers, each large enough to hold any short entry wherever it
+ * starts in an aligned block. Segments are then never mapped, and
+ * the pages written to the current segment are dropped from the page
+ * cache every DIODROP bytes, so that the store cache is the only
+ * cache holding blocks.
+ */
+#define DIOALIGN 4096
+#define DIOBUFSZ ((sizeof(struct logent) + SHORTMAX + 2 * DIOALIGN - 1) & ~(DIOALIGN - 1))
+#define DIOPOOLSZ 16
+#define DIODROP (4 << 20)
+
+struct logseg {
+    int fd, dfd;
+    loff_t size, dropped;
+    int sealed;
+    void *map;
+    int verified;
+    unsigned char *vmap;
+    size_t vmapsz;
+};
+
+struct bulkrun {
+    int fd;
+    idx_t n;
+};
+
+struct bulk {
+    struct idxent *pend;
+    idx_t npend;
+    idx_t *htab;
+    struct bulkrun *runs;
+    int nruns;
+    char *mark;
+    int markfd;
+};
+
 struct fstore {
-    int logfd;
+    char *dir;
+    int flags;
+    struct logseg *segs;
+    int nsegs;
     int idxfd;
-    loff_t logsize;
     idx_t idxsize;
+    int lockfd, locks;
+    int usersfd;
+    struct bulk *bulk;
+    pthread_mutex_t seglock;
+    pthread_t scrubth;
+    int scrubbing;
+    volatile int scrubstop;
+    struct uring *ring;
 };
 
+static int bulkend(struct fstore *fst);
+
 static int release(struct fstore *fst)
 {
-    if(fst->logfd >= 0) {
-	fsync(fst->logfd);
-	close(fst->logfd);
+    int i;
+    
+    if((fst->bulk != NULL) && (fst->idxfd >= 0) && bulkend(fst))
+	flog(LOG_CRIT, "could not finish bulk index load; the index must be rebuilt");
+    /* Leaves the marker of a failed load to be found stale */
+    if(fst->bulk != NULL)
+	close(fst->bulk->markfd);
+    if(fst->scrubbing) {
+	fst->scrubstop = 1;
+	pthread_join(fst->scrubth, NULL);
     }
+    for(i = 0; i < fst->nsegs; i++) {
+	if(fst->segs[i].map != NULL)
+	    munmap(fst->segs[i].map, fst->segs[i].size);
+	if(fst->segs[i].vmap != NULL)
+	    free(fst->segs[i].vmap);
+	if(!fst->segs[i].sealed)
+	    fsync(fst->segs[i].fd);
+	if(fst->segs[i].dfd >= 0)
+	    close(fst->segs[i].dfd);
+	close(fst->segs[i].fd);
+    }
+    if(fst->segs != NULL)
+	free(fst->segs);
+    if(fst->dir != NULL)
+	free(fst->dir);
     if(fst->idxfd >= 0) {
 	fsync(fst->idxfd);
 	close(fst->idxfd);
     }
+    if(fst->ring != NULL)
+	freeuring(fst->ring);
+    if(fst->lockfd >= 0)
+	close(fst->lockfd);
+    if(fst->usersfd >= 0)
+	close(fst->usersfd);
+    pthread_mutex_destroy(&fst->seglock);
     free(fst);
     return(0);
 }
@@ -69,11 +205,575 @@ static int releaseg(struct store *st)
     return(release(st->pdata));
 }
 
+static void segname(char *dir, int seg, char *buf, size_t len)
+{
+    if(seg == 0)
+	snprintf(buf, len, "%s/log", dir);
+    else
+	snprintf(buf, len, "%s/log.%i", dir, seg);
+}
+
+static void sealseg(struct fstore *fst, struct logseg *seg)
+{
+    void *map;
+    
+    seg->sealed = 1;
+    if(seg->dfd >= 0) {
+	posix_fadvise(seg->fd, 0, 0, POSIX_FADV_DONTNEED);
+	return;
+    }
+    if((map = mmap(NULL, seg->size, PROT_READ, MAP_SHARED, seg->fd, 0)) != MAP_FAILED)
+	seg->map = map;
+}
+
+/* Opens the O_DIRECT descriptor of a segment, if FST_DIRECT is in effect. */
+static void directseg(struct fstore *fst, struct logseg *seg, char *path)
+{
+    seg->dfd = -1;
+    if(!(fst->flags & FST_DIRECT))
+	return;
+    if((seg->dfd = open(path, O_RDONLY | O_DIRECT | O_LARGEFILE)) < 0) {
+	flog(LOG_WARNING, "could not open %s for direct I/O, using the page cache: %s", path, strerror(errno));
+	fst->flags &= ~FST_DIRECT;
+    }
+}
+
+static int openseg(struct fstore *fst, int sealed)
+{
+    struct logseg *seg;
+    char tbuf[1024];
+    struct loghdr lh;
+    struct stat64 sb;
+    
+    segname(fst->dir, fst->nsegs, tbuf, sizeof(tbuf));
+    fst->segs = realloc(fst->segs, sizeof(*fst->segs) * (fst->nsegs + 1));
+    seg = &fst->segs[fst->nsegs];
+    memset(seg, 0, sizeof(*seg));
+    seg->dfd = -1;
+    if((seg->fd = open(tbuf, (sealed?O_RDONLY:O_RDWR) | O_LARGEFILE)) < 0) {
+	flog(LOG_ERR, "could not open log %s: %s", tbuf, strerror(errno));
+	return(-1);
+    }
+    fst->nsegs++;
+    directseg(fst, seg, tbuf);
+    if(fstat64(seg->fd, &sb)) {
+	flog(LOG_ERR, "could not stat log %s: %s", tbuf, strerror(errno));
+	return(-1);
+    }
+    seg->size = sb.st_size;
+    if(readall(seg->fd, &lh, sizeof(lh), 0)) {
+	flog(LOG_ERR, "could not read log header of %s: %s", tbuf, strerror(errno));
+	return(-1);
+    }
+    if(memcmp(lh.magic, LOGMAGIC, sizeof(LOGMAGIC))) {
+	flog(LOG_ERR, "invalid log magic in %s", tbuf);
+	return(-1);
+    }
+    seg->dropped = seg->size;
+    if(sealed)
+	sealseg(fst, seg);
+    return(0);
+}
+
+static int mkseg(char *path)
+{
+    int fd;
+    struct loghdr lh;
+    
+    if((fd = open(path, O_RDWR | O_CREAT | O_EXCL | O_LARGEFILE, 0600)) < 0) {
+	flog(LOG_ERR, "could not create log %s: %s", path, strerror(errno));
+	return(-1);
+    }
+    memcpy(lh.magic, LOGMAGIC, sizeof(LOGMAGIC));
+    if(writeall(fd, &lh, sizeof(lh), 0)) {
+	flog(LOG_ERR, "could not write log header: %s", strerror(errno));
+	close(fd);
+	return(-1);
+    }
+    return(fd);
+}
+
+/*
+ * Seals the current segment and starts a new one. The new segment is
+ * only renamed into place once it has its header, so that other
+ * processes never come across it half made.
+ */
+static int newseg(struct fstore *fst)
+{
+    struct logseg *seg;
+    char tbuf[1024], nbuf[1024];
+    int fd;
+    
+    segname(fst->dir, fst->nsegs, tbuf, sizeof(tbuf));
+    snprintf(nbuf, sizeof(nbuf), "%s/log.new", fst->dir);
+    unlink(nbuf);
+    if((fd = mkseg(nbuf)) < 0)
+	return(-1);
+    if(rename(nbuf, tbuf)) {
+	flog(LOG_ERR, "could not create log %s: %s", tbuf, strerror(errno));
+	close(fd);
+	unlink(nbuf);
+	return(-1);
+    }
+    seg = &fst->segs[fst->nsegs - 1];
+    fsync(seg->fd);
+    /* The background scrubber may be looking at the segment table */
+    pthread_mutex_lock(&fst->seglock);
+    sealseg(fst, seg);
+    fst->segs = realloc(fst->segs, sizeof(*fst->segs) * (fst->nsegs + 1));
+    seg = &fst->segs[fst->nsegs++];
+    memset(seg, 0, sizeof(*seg));
+    seg->fd = fd;
+    seg->size = sizeof(struct loghdr);
+    directseg(fst, seg, tbuf);
+    pthread_mutex_unlock(&fst->seglock);
+    return(0);
+}
+
+/*
+ * Several processes may have the same store open at once. Appends to
+ * the log and the index are serialized by an exclusive flock() on the
+ * file "lock" in the store directory, after taking which the log tail,
+ * the segment table and the index are brought up to date with what
+ * other processes have written. Readers take no lock, but catch up
+ * whenever they miss a block or come across a segment they do not
+ * know of. A bulk load takes the lock only for each batch it appends
+ * and for its final merge, so other writers carry on alongside it.
+ *
+ * Every process also holds a shared flock() on the file "users" for
+ * as long as it has the store open, so that fstoreexclusive() can
+ * tell whether anyone else is using it.
+ */
+
+/* Picks up the growth of the last segment and any newer segments. */
+static int syncsegs(struct fstore *fst)
+{
+    struct logseg *seg;
+    struct stat64 sb;
+    char tbuf[1024];
+    int more, ret;
+    
+    ret = 0;
+    pthread_mutex_lock(&fst->seglock);
+    while(1) {
+	segname(fst->dir, fst->nsegs, tbuf, sizeof(tbuf));
+	more = !access(tbuf, F_OK);
+	/* Once there is a next segment, this one is complete */
+	seg = &fst->segs[fst->nsegs - 1];
+	if(!fstat64(seg->fd, &sb) && (sb.st_size > seg->size))
+	    seg->size = sb.st_size;
+	if(!more)
+	    break;
+	sealseg(fst, seg);
+	if(openseg(fst, 0)) {
+	    ret = -1;
+	    break;
+	}
+    }
+    pthread_mutex_unlock(&fst->seglock);
+    return(ret);
+}
+
+/*
+ * Picks up index entries added by other processes, reopening the
+ * index if it has been replaced. Returns 1 if the index has changed.
+ */
+static int syncindex(struct fstore *fst)
+{
+    char tbuf[1024];
+    struct stat64 sb, cur;
+    struct idxhdr ih;
+    int fd, ret;
+    
+    ret = 0;
+    snprintf(tbuf, sizeof(tbuf), "%s/index", fst->dir);
+    if(stat64(tbuf, &sb) || fstat64(fst->idxfd, &cur)) {
+	flog(LOG_ERR, "could not stat index: %s", strerror(errno));
+	return(-1);
+    }
+    if((sb.st_ino != cur.st_ino) || (sb.st_dev != cur.st_dev)) {
+	if((fd = open(tbuf, O_RDWR | O_LARGEFILE)) < 0) {
+	    flog(LOG_ERR, "could not reopen index %s: %s", tbuf, strerror(errno));
+	    return(-1);
+	}
+	close(fst->idxfd);
+	fst->idxfd = fd;
+	ret = 1;
+    }
+    if(readall(fst->idxfd, &ih, sizeof(ih), 0)) {
+	flog(LOG_ERR, "could not read index header: %s", strerror(errno));
+	return(-1);
+    }
+    if(ih.size != fst->idxsize) {
+	fst->idxsize = ih.size;
+	ret = 1;
+    }
+    return(ret);
+}
+
+static void unlockstore(struct fstore *fst)
+{
+    if((--fst->locks == 0) && (fst->lockfd >= 0))
+	flock(fst->lockfd, LOCK_UN);
+}
+
+/* Takes the append lock, which nests within a process. */
+static int lockstore(struct fstore *fst)
+{
+    if(fst->locks++ > 0)
+	return(0);
+    if(fst->lockfd >= 0) {
+	while(flock(fst->lockfd, LOCK_EX)) {
+	    if(errno != EINTR) {
+		flog(LOG_ERR, "could not lock %s: %s", fst->dir, strerror(errno));
+		fst->locks--;
+		return(-1);
+	    }
+	}
+    }
+    /* Nothing to catch up with yet when opening the store */
+    if(fst->idxfd < 0)
+	return(0);
+    if((syncindex(fst) < 0) || syncsegs(fst)) {
+	unlockstore(fst);
+	return(-1);
+    }
+    return(0);
+}
+
+static int segread(struct logseg *seg, void *buf, size_t len, loff_t off)
+{
+    if(seg->map != NULL) {
+	if(off + len > seg->size) {
+	    errno = ENODATA;
+	    return(-1);
+	}
+	memcpy(buf, seg->map + off, len);
+	return(0);
+    }
+    return(readall(seg->fd, buf, len, off));
+}
+
+/*
+ * Where the data of a log entry is read to: the caller's buffer if it
+ * is large enough, or else one allocated for the purpose, which is
+ * then owned by the entbuf and reused for the next entry.
+ */
+struct entbuf {
+    char *buf;
+    size_t sz;
+    int own;
+};
+
+static char *entbufget(struct entbuf *eb, size_t sz)
+{
+    if((sz <= eb->sz) && (eb->buf != NULL))
+	return(eb->buf);
+    if(eb->own) {
+	eb->buf = realloc(eb->buf, sz);
+    } else {
+	eb->buf = malloc(sz);
+	eb->own = 1;
+    }
+    eb->sz = sz;
+    return(eb->buf);
+}
+
+static void entbuffree(struct entbuf *eb)
+{
+    if(eb->own)
+	free(eb->buf);
+}
+
+/* Decompresses the stored data of a LOGENT_DEFLATE entry into eb. */
+static ssize_t inflateent(struct entinfo *ei, const void *data, struct entbuf *eb)
+{
+    u_int16_t rlen;
+    u_int32_t lrlen;
+    size_t plen;
+    uLongf dlen;
+    
+    if(ei->le.fl & LOGENT_LONG) {
+	if(ei->len < (plen = sizeof(lrlen)))
+	    return(-1);
+	memcpy(&lrlen, data, plen);
+    } else {
+	if(ei->len < (plen = sizeof(rlen)))
+	    return(-1);
+	memcpy(&rlen, data, plen);
+	lrlen = rlen;
+    }
+    if(lrlen > STORE_MAXBLSZ)
+	return(-1);
+    dlen = lrlen;
+    if((uncompress((Bytef *)entbufget(eb, lrlen), &dlen, (const Bytef *)data + plen, ei->len - plen) != Z_OK) || (dlen != lrlen))
+	return(-1);
+    return(dlen);
+}
+
+/*
+ * Fills in ei from the raw entry header at p, of which avail bytes
+ * are at hand. Returns zero if the header is complete and valid.
+ */
+static int parsehdr(const char *p, size_t avail, struct entinfo *ei)
+{
+    u_int32_t llen;
+    
+    if(avail < sizeof(ei->le))
+	return(-1);
+    memcpy(&ei->le, p, sizeof(ei->le));
+    if(memcmp(ei->le.magic, LOGENTMAGIC, 4))
+	return(-1);
+    ei->hlen = sizeof(ei->le);
+    ei->len = ei->le.len;
+    if(ei->le.fl & LOGENT_LONG) {
+	if(avail < sizeof(ei->le) + sizeof(llen))
+	    return(-1);
+	memcpy(&llen, p + sizeof(ei->le), sizeof(llen));
+	if(llen > STORE_MAXBLSZ + sizeof(llen))
+	    return(-1);
+	ei->hlen += sizeof(llen);
+	ei->len = llen;
+    }
+    return(0);
+}
+
+static void *diopool[DIOPOOLSZ];
+static int ndiopool = 0;
+static pthread_mutex_t diolock = PTHREAD_MUTEX_INITIALIZER;
+
+static void *getdiobuf(void)
+{
+    void *buf;
+    
+    buf = NULL;
+    pthread_mutex_lock(&diolock);
+    if(ndiopool > 0)
+	buf = diopool[--ndiopool];
+    pthread_mutex_unlock(&diolock);
+    if((buf == NULL) && posix_memalign(&buf, DIOALIGN, DIOBUFSZ))
+	return(NULL);
+    return(buf);
+}
+
+static void putdiobuf(void *buf)
+{
+    pthread_mutex_lock(&diolock);
+    if(ndiopool < DIOPOOLSZ) {
+	diopool[ndiopool++] = buf;
+	buf = NULL;
+    }
+    pthread_mutex_unlock(&diolock);
+    if(buf != NULL)
+	free(buf);
+}
+
+static ssize_t readsegent(struct logseg *lseg, int seg, loff_t base, loff_t off, struct entinfo *ei, struct entbuf *eb);
+
+/*
+ * Reads an entry through O_DIRECT, with a single read of everything
+ * from the aligned block it starts in that a short entry could
+ * possibly cover. Long entries that do not fit are read again into a
+ * buffer of their own.
+ */
+static ssize_t readdirect(struct logseg *lseg, int seg, loff_t off, struct entinfo *ei, struct entbuf *eb)
+{
+    struct logseg win;
+    char *dbuf, *lbuf;
+    loff_t a;
+    size_t lsz;
+    ssize_t ret;
+    
+    if((dbuf = getdiobuf()) == NULL) {
+	flog(LOG_CRIT, "could not allocate direct I/O buffer: %s", strerror(errno));
+	return(-1);
+    }
+    lbuf = NULL;
+    a = off & ~(loff_t)(DIOALIGN - 1);
+    ret = pread64(lseg->dfd, dbuf, DIOBUFSZ, a);
+    if((ret == DIOBUFSZ) && !parsehdr(dbuf + (off - a), ret - (off - a), ei) && (off + ei->hlen + ei->len > a + ret)) {
+	lsz = (off - a + ei->hlen + ei->len + DIOALIGN - 1) & ~(DIOALIGN - 1);
+	if(posix_memalign((void **)&lbuf, DIOALIGN, lsz)) {
+	    flog(LOG_CRIT, "could not allocate direct I/O buffer: %s", strerror(errno));
+	    putdiobuf(dbuf);
+	    return(-1);
+	}
+	ret = pread64(lseg->dfd, lbuf, lsz, a);
+    }
+    if(ret < 0) {
+	flog(LOG_CRIT, "could not read log entry at %i:%lli: %s", seg, (long long)off, strerror(errno));
+	putdiobuf(dbuf);
+	if(lbuf != NULL)
+	    free(lbuf);
+	errno = EIO;
+	return(-1);
+    }
+    memset(&win, 0, sizeof(win));
+    win.dfd = -1;
+    win.map = (lbuf != NULL)?lbuf:dbuf;
+    win.size = ret;
+    ret = readsegent(&win, seg, a, off, ei, eb);
+    putdiobuf(dbuf);
+    if(lbuf != NULL)
+	free(lbuf);
+    return(ret);
+}
+
+/*
+ * Reads the header of the log entry at off in segment number seg
+ * into ei, and its uncompressed data into eb. The segment data is
+ * read from lseg, whose first byte is at base in the segment. Returns
+ * the length of the data, which is not verified against the hash.
+ */
+static ssize_t readsegent(struct logseg *lseg, int seg, loff_t base, loff_t off, struct entinfo *ei, struct entbuf *eb)
+{
+    char hbuf[sizeof(struct logent) + sizeof(u_int32_t)], *zbuf;
+    ssize_t sz;
+    
+    if((lseg->map == NULL) && (lseg->dfd >= 0))
+	return(readdirect(lseg, seg, off, ei, eb));
+    if(segread(lseg, hbuf, sizeof(struct logent), off - base)) {
+	flog(LOG_CRIT, "could not read log entry at %i:%lli: %s", seg, (long long)off, strerror(errno));
+	errno = EIO;
+	return(-1);
+    }
+    if((((struct logent *)hbuf)->fl & LOGENT_LONG) && segread(lseg, hbuf + sizeof(struct logent), sizeof(u_int32_t), off - base + sizeof(struct logent))) {
+	flog(LOG_CRIT, "could not read log entry at %i:%lli: %s", seg, (long long)off, strerror(errno));
+	errno = EIO;
+	return(-1);
+    }
+    if(parsehdr(hbuf, sizeof(hbuf), ei)) {
+	flog(LOG_CRIT, "invalid entry header in log at %i:%lli", seg, (long long)off);
+	errno = EIO;
+	return(-1);
+    }
+    if(!(ei->le.fl & LOGENT_DEFLATE)) {
+	if(segread(lseg, entbufget(eb, ei->len), ei->len, off - base + ei->hlen)) {
+	    flog(LOG_CRIT, "could not read log data at %i:%lli: %s", seg, (long long)off, strerror(errno));
+	    errno = EIO;
+	    return(-1);
+	}
+	return(ei->len);
+    }
+    zbuf = malloc(ei->len);
+    if(segread(lseg, zbuf, ei->len, off - base + ei->hlen)) {
+	flog(LOG_CRIT, "could not read log data at %i:%lli: %s", seg, (long long)off, strerror(errno));
+	free(zbuf);
+	errno = EIO;
+	return(-1);
+    }
+    if((sz = inflateent(ei, zbuf, eb)) < 0) {
+	flog(LOG_CRIT, "could not decompress log data at %i:%lli", seg, (long long)off);
+	free(zbuf);
+	errno = EIO;
+	return(-1);
+    }
+    free(zbuf);
+    return(sz);
+}
+
+/* Returns the offset of the entry following the one at off. */
+static loff_t entnext(loff_t off, struct entinfo *ei)
+{
+    off += ei->hlen + ei->len;
+    if(ei->le.fl & LOGENT_ALIGNED)
+	off = (off + LOGALIGN - 1) & ~(loff_t)(LOGALIGN - 1);
+    return(off);
+}
+
+static ssize_t readent(struct fstore *fst, int seg, loff_t off, struct entinfo *ei, struct entbuf *eb)
+{
+    if(seg >= fst->nsegs)
+	syncsegs(fst);
+    if((seg < 0) || (seg >= fst->nsegs)) {
+	flog(LOG_CRIT, "invalid log segment %i", seg);
+	errno = EIO;
+	return(-1);
+    }
+    return(readsegent(&fst->segs[seg], seg, 0, off, ei, eb));
+}
+
+#define min(a, b) (((b) < (a))?(b):(a))
+
 static void hash(const void *buf, size_t len, struct addr *a)
 {
     gcry_md_hash_buffer(GCRY_MD_SHA256, a->hash, buf, len);
 }
 
+/*
+ * Hashes a batch of blocks. libgcrypt already picks the fastest
+ * SHA-256 code the CPU supports (SHA-NI, AVX2 and so on) for each
+ * buffer, so what remains to be gained is spreading large batches
+ * over several threads.
+ */
+#define HASHTHRMIN (1 << 20)
+#define HASHCHUNK 16
+
+struct hashjob {
+    const void **bufs;
+    const size_t *lens;
+    struct addr *as;
+    int n, next;
+    pthread_mutex_t lock;
+};
+
+static void *hashworker(struct hashjob *job)
+{
+    int i, e;
+    
+    while(1) {
+	pthread_mutex_lock(&job->lock);
+	i = job->next;
+	job->next += HASHCHUNK;
+	pthread_mutex_unlock(&job->lock);
+	if(i >= job->n)
+	    return(NULL);
+	for(e = min(i + HASHCHUNK, job->n); i < e; i++)
+	    hash(job->bufs[i], job->lens[i], &job->as[i]);
+    }
+}
+
+/*
+ * Computes the addresses of n blocks, on as many threads as there
+ * are processors when the batch is large enough to be worth it.
+ */
+void fstorehash(const void **bufs, const size_t *lens, struct addr *as, int n)
+{
+    struct hashjob job;
+    pthread_t *th;
+    size_t tot;
+    int i, nth;
+    
+    for(i = 0, tot = 0; i < n; i++)
+	tot += lens[i];
+    if((nth = sysconf(_SC_NPROCESSORS_ONLN)) < 1)
+	nth = 1;
+    nth = min(nth, min(tot / HASHTHRMIN, (n + HASHCHUNK - 1) / HASHCHUNK));
+    if(nth < 2) {
+	for(i = 0; i < n; i++)
+	    hash(bufs[i], lens[i], &as[i]);
+	return;
+    }
+    job.bufs = bufs;
+    job.lens = lens;
+    job.as = as;
+    job.n = n;
+    job.next = 0;
+    pthread_mutex_init(&job.lock, NULL);
+    /* The calling thread is one of the workers */
+    th = malloc(sizeof(*th) * (nth - 1));
+    for(i = 0; i < nth - 1; i++) {
+	if(pthread_create(&th[i], NULL, (void *(*)(void *))hashworker, &job))
+	    break;
+    }
+    nth = i;
+    hashworker(&job);
+    for(i = 0; i < nth; i++)
+	pthread_join(th[i], NULL);
+    free(th);
+    pthread_mutex_destroy(&job.lock);
+}
+
 static int getidx(struct fstore *fst, idx_t i, struct idxent *ie)
 {
     return(readall(fst->idxfd, ie, sizeof(*ie), sizeof(struct idxhdr) + i * sizeof(struct idxent)));
@@ -126,7 +826,6 @@ static idx_t newindex(struct fstore *fst)
     struct idxent ne;
     struct idxhdr ih;
     
-    /* XXX: Thread safety */
     ni = fst->idxsize++;
     newsize = sizeof(struct idxhdr) + fst->idxsize * sizeof(struct idxent);
     if(ftruncate(fst->idxfd, newsize))
@@ -139,188 +838,1788 @@ static idx_t newindex(struct fstore *fst)
     return(ni);
 }
 
-static int put(struct store *st, const void *buf, size_t len, struct addr *at)
+/* Links a new index entry for a into the tree below parent pi. */
+static int addindex(struct fstore *fst, struct addr *a, u_int64_t off, idx_t pi)
 {
-    struct fstore *fst;
-    struct addr pa;
-    idx_t i, pi;
+    idx_t i;
     struct idxent ie;
-    loff_t leoff;
     int c;
-    struct logent le;
     
-    if(len > STORE_MAXBLSZ) {
-	errno = E2BIG;
+    if((i = newindex(fst)) < 0)
 	return(-1);
-    }
-
-    fst = st->pdata;
-    hash(buf, len, &pa);
-    if(at != NULL)
-	memcpy(at->hash, pa.hash, 32);
-    
-    if(lookup(fst, &pa, &pi) != -1)
-	return(0);
-    
-    memcpy(le.magic, LOGENTMAGIC, 4);
-    le.name = pa;
-    le.len = len;
-    le.fl = 0;
-    /* XXX: Thread safety { */
-    leoff = fst->logsize;
-    fst->logsize += sizeof(le) + len;
-    /* } */
-    /* XXX: Handle data with embedded LOGENTMAGIC */
-    writeall(fst->logfd, &le, sizeof(le), leoff);
-    writeall(fst->logfd, buf, len, leoff + sizeof(le));
-
-    i = newindex(fst);
     assert(!getidx(fst, i, &ie));
-    ie.addr = pa;
-    ie.off = leoff;
+    ie.addr = *a;
+    ie.off = off;
     assert(!putidx(fst, i, &ie));
     if(pi != -1) {
 	assert(!getidx(fst, pi, &ie));
-	c = addrcmp(&pa, &ie.addr);
+	c = addrcmp(a, &ie.addr);
 	if(c < 0)
 	    ie.l = i;
 	else
 	    ie.r = i;
 	assert(!putidx(fst, pi, &ie));
     }
-    
     return(0);
 }
 
-#define min(a, b) (((b) < (a))?(b):(a))
-
-static ssize_t get(struct store *st, void *buf, size_t len, struct addr *at)
+static int idxentcmp(const struct idxent *a, const struct idxent *b)
 {
-    idx_t i;
-    struct idxent ie;
-    struct fstore *fst;
-    struct logent le;
-    struct addr v;
-    char tmpbuf[STORE_MAXBLSZ];
+    int c;
     
-    fst = st->pdata;
-    if((i = lookup(fst, at, NULL)) == -1) {
-	errno = ENOENT;
+    if((c = addrcmp((struct addr *)&a->addr, (struct addr *)&b->addr)) != 0)
+	return(c);
+    if(a->off < b->off)
 	return(-1);
+    if(a->off > b->off)
+	return(1);
+    return(0);
+}
+
+static void sortents(struct idxent *ents, size_t n)
+{
+    qsort(ents, n, sizeof(*ents), (int (*)(const void *, const void *))idxentcmp);
+}
+
+/*
+ * New indexes are written in one pass from a stream of entries sorted
+ * by address, laid out as an implicit complete binary tree with the
+ * children of entry k at 2k + 1 and 2k + 2. The root ends up at 0, as
+ * lookup() expects, and the top levels of the tree, which every
+ * lookup passes through, are packed together at the start of the
+ * file. An in-order walk of the tree visits the entries of each level
+ * from left to right, so every level is written sequentially through
+ * a buffer of its own.
+ */
+#define LVLBUFSZ 1024
+
+struct lvlbuf {
+    idx_t next;
+    int n;
+    struct idxent ents[LVLBUFSZ];
+};
+
+static int flushlvl(int fd, struct lvlbuf *lb)
+{
+    if(lb->n == 0)
+	return(0);
+    if(writeall(fd, lb->ents, sizeof(*lb->ents) * lb->n, sizeof(struct idxhdr) + (lb->next - lb->n) * sizeof(struct idxent)))
+	return(-1);
+    lb->n = 0;
+    return(0);
+}
+
+static int writeindex(struct fstore *fst, idx_t n, int (*next)(struct idxent *ent, void *pdata), void *pdata)
+{
+    char tbuf[1024], nbuf[1024];
+    struct idxhdr ih;
+    struct lvlbuf *lvls[64], *lb;
+    idx_t stack[64], k;
+    int fd, sp, l, nl, ret;
+    
+    snprintf(nbuf, sizeof(nbuf), "%s/index.new", fst->dir);
+    if((fd = open(nbuf, O_RDWR | O_CREAT | O_TRUNC | O_LARGEFILE, 0600)) < 0) {
+	flog(LOG_ERR, "could not create index %s: %s", nbuf, strerror(errno));
+	return(-1);
+    }
+    for(nl = 0; ((idx_t)1 << nl) - 1 < n; nl++) {
+	lvls[nl] = malloc(sizeof(*lvls[nl]));
+	lvls[nl]->next = ((idx_t)1 << nl) - 1;
+	lvls[nl]->n = 0;
+    }
+    ret = -1;
+    k = 0;
+    sp = 0;
+    while(1) {
+	for(; k < n; k = 2 * k + 1)
+	    stack[sp++] = k;
+	if(sp == 0)
+	    break;
+	k = stack[--sp];
+	for(l = 0; ((idx_t)2 << l) - 1 <= k; l++);
+	lb = lvls[l];
+	if(next(&lb->ents[lb->n], pdata) != 1) {
+	    flog(LOG_ERR, "index entries ran out while writing index");
+	    errno = EIO;
+	    goto out;
+	}
+	lb->ents[lb->n].l = (2 * k + 1 < n)?(2 * k + 1):0;
+	lb->ents[lb->n].r = (2 * k + 2 < n)?(2 * k + 2):0;
+	lb->n++;
+	lb->next++;
+	if((lb->n == LVLBUFSZ) && flushlvl(fd, lb))
+	    goto fail;
+	k = 2 * k + 2;
+    }
+    for(l = 0; l < nl; l++) {
+	if(flushlvl(fd, lvls[l]))
+	    goto fail;
+    }
+    memcpy(ih.magic, IDXMAGIC, sizeof(IDXMAGIC));
+    ih.size = n;
+    if(writeall(fd, &ih, sizeof(ih), 0) || fsync(fd))
+	goto fail;
+    snprintf(tbuf, sizeof(tbuf), "%s/index", fst->dir);
+    if(rename(nbuf, tbuf)) {
+	flog(LOG_ERR, "could not replace index: %s", strerror(errno));
+	goto out;
+    }
+    if(fst->idxfd >= 0)
+	close(fst->idxfd);
+    fst->idxfd = fd;
+    fst->idxsize = n;
+    fd = -1;
+    ret = 0;
+    goto out;
+    
+fail:
+    flog(LOG_ERR, "could not write index: %s", strerror(errno));
+out:
+    for(l = 0; l < nl; l++)
+	free(lvls[l]);
+    if(fd >= 0)
+	close(fd);
+    return(ret);
+}
+
+struct arraysrc {
+    struct idxent *ents;
+    idx_t n, i;
+};
+
+static int arraynext(struct idxent *ent, struct arraysrc *src)
+{
+    if(src->i >= src->n)
+	return(0);
+    *ent = src->ents[src->i++];
+    return(1);
+}
+
+/*
+ * In bulk mode, put() appends to the log as usual, but instead of
+ * being linked into the index one at a time, new entries are
+ * collected in memory. When BULKRUNSZ of them have been collected,
+ * they are sorted and spilled to a run file. When bulk mode ends, the
+ * existing index and all runs are merged into a completely new
+ * index. Pending entries are found by hash and spilled ones by binary
+ * search in their runs, so blocks put in bulk mode can be read back
+ * and deduplicated at once.
+ *
+ * Other processes do not see bulk-loaded blocks until the merge, so
+ * they may append and index some of the same blocks meanwhile; the
+ * merge keeps one entry per address. Runs are private to the loading
+ * process and are unlinked as soon as they are created.
+ *
+ * Every bulk load holds an exclusive flock() on a "bulk.XXXXXX"
+ * marker of its own in the store directory for as long as it is in
+ * progress. A marker that nobody holds a lock on was left by an
+ * interrupted load, whose entries are missing from the index;
+ * openfstore() with FST_RECOVER then rebuilds it from the log.
+ */
+#define BULKRUNSZ (1 << 20)
+#define BULKHSZ (BULKRUNSZ * 2)
+
+static size_t bulkhash(struct addr *a)
+{
+    size_t h;
+    
+    memcpy(&h, a->hash, sizeof(h));
+    return(h & (BULKHSZ - 1));
+}
+
+/*
+ * Counts the markers of interrupted bulk loads in dir, removing them
+ * if rm is set. Must be called under the append lock, under which
+ * markers are created.
+ */
+static int stalebulk(char *dir, int rm)
+{
+    DIR *d;
+    struct dirent *de;
+    char tbuf[1024];
+    int fd, n;
+    
+    if((d = opendir(dir)) == NULL) {
+	flog(LOG_ERR, "could not read %s: %s", dir, strerror(errno));
+	return(-1);
+    }
+    n = 0;
+    while((de = readdir(d)) != NULL) {
+	if(strncmp(de->d_name, "bulk", 4))
+	    continue;
+	snprintf(tbuf, sizeof(tbuf), "%s/%s", dir, de->d_name);
+	if((fd = open(tbuf, O_RDONLY)) < 0)
+	    continue;
+	if(!flock(fd, LOCK_EX | LOCK_NB)) {
+	    n++;
+	    if(rm)
+		unlink(tbuf);
+	}
+	close(fd);
+    }
+    closedir(d);
+    return(n);
+}
+
+static int bulkfind(struct fstore *fst, struct addr *a, u_int64_t *off)
+{
+    struct bulk *b;
+    struct idxent ie;
+    idx_t h, l, r, m;
+    int i, c;
+    
+    b = fst->bulk;
+    for(h = bulkhash(a); b->htab[h] != 0; h = (h + 1) & (BULKHSZ - 1)) {
+	if(!addrcmp(&b->pend[b->htab[h] - 1].addr, a)) {
+	    *off = b->pend[b->htab[h] - 1].off;
+	    return(1);
+	}
+    }
+    for(i = 0; i < b->nruns; i++) {
+	l = 0;
+	r = b->runs[i].n;
+	while(l < r) {
+	    m = l + ((r - l) / 2);
+	    assert(!readall(b->runs[i].fd, &ie, sizeof(ie), m * sizeof(ie)));
+	    if((c = addrcmp(a, &ie.addr)) == 0) {
+		*off = ie.off;
+		return(1);
+	    }
+	    if(c < 0)
+		r = m;
+	    else
+		l = m + 1;
+	}
+    }
+    return(0);
+}
+
+static int spillrun(struct fstore *fst, struct idxent *ents, idx_t n)
+{
+    struct bulk *b;
+    char tbuf[1024];
+    int fd;
+    
+    b = fst->bulk;
+    snprintf(tbuf, sizeof(tbuf), "%s/index.run.XXXXXX", fst->dir);
+    if((fd = mkostemp(tbuf, O_LARGEFILE)) < 0) {
+	flog(LOG_ERR, "could not create index run in %s: %s", fst->dir, strerror(errno));
+	return(-1);
+    }
+    unlink(tbuf);
+    sortents(ents, n);
+    if(writeall(fd, ents, sizeof(*ents) * n, 0)) {
+	flog(LOG_ERR, "could not write index run: %s", strerror(errno));
+	close(fd);
+	return(-1);
+    }
+    b->runs = realloc(b->runs, sizeof(*b->runs) * (b->nruns + 1));
+    b->runs[b->nruns].fd = fd;
+    b->runs[b->nruns].n = n;
+    b->nruns++;
+    return(0);
+}
+
+static int bulkadd(struct fstore *fst, struct addr *a, u_int64_t off)
+{
+    struct bulk *b;
+    idx_t h;
+    
+    b = fst->bulk;
+    memset(&b->pend[b->npend], 0, sizeof(*b->pend));
+    b->pend[b->npend].addr = *a;
+    b->pend[b->npend].off = off;
+    for(h = bulkhash(a); b->htab[h] != 0; h = (h + 1) & (BULKHSZ - 1));
+    b->htab[h] = ++b->npend;
+    if(b->npend == BULKRUNSZ) {
+	if(spillrun(fst, b->pend, b->npend))
+	    return(-1);
+	b->npend = 0;
+	memset(b->htab, 0, sizeof(*b->htab) * BULKHSZ);
+    }
+    return(0);
+}
+
+static int bulkstart(struct fstore *fst)
+{
+    struct bulk *b;
+    char tbuf[1024];
+    int fd;
+    
+    if(fst->bulk != NULL)
+	return(0);
+    /* Lest an opener find the marker before it is locked */
+    if(lockstore(fst))
+	return(-1);
+    snprintf(tbuf, sizeof(tbuf), "%s/bulk.XXXXXX", fst->dir);
+    if((fd = mkstemp(tbuf)) < 0) {
+	flog(LOG_ERR, "could not create bulk marker in %s: %s", fst->dir, strerror(errno));
+	unlockstore(fst);
+	return(-1);
+    }
+    if(flock(fd, LOCK_EX | LOCK_NB)) {
+	flog(LOG_ERR, "could not lock bulk marker %s: %s", tbuf, strerror(errno));
+	unlink(tbuf);
+	close(fd);
+	unlockstore(fst);
+	return(-1);
+    }
+    fsync(fd);
+    unlockstore(fst);
+    b = calloc(1, sizeof(*b));
+    b->pend = malloc(sizeof(*b->pend) * BULKRUNSZ);
+    b->htab = calloc(BULKHSZ, sizeof(*b->htab));
+    b->mark = strdup(tbuf);
+    b->markfd = fd;
+    fst->bulk = b;
+    return(0);
+}
+
+struct runrd {
+    int fd;
+    idx_t n, pos;
+    struct idxent *buf;
+    int bn, bi;
+};
+
+struct mergesrc {
+    struct runrd *rd;
+    int nrd;
+    struct addr last;
+    int any;
+};
+
+#define RUNBUFSZ 4096
+
+static int runpeek(struct runrd *rd, struct idxent **ent)
+{
+    if(rd->bi == rd->bn) {
+	if(rd->pos >= rd->n)
+	    return(0);
+	rd->bn = (rd->n - rd->pos > RUNBUFSZ)?RUNBUFSZ:(rd->n - rd->pos);
+	if(readall(rd->fd, rd->buf, sizeof(*rd->buf) * rd->bn, rd->pos * sizeof(*rd->buf)))
+	    return(-1);
+	rd->pos += rd->bn;
+	rd->bi = 0;
+    }
+    *ent = &rd->buf[rd->bi];
+    return(1);
+}
+
+/* Yields the first of every run of entries with the same address. */
+static int mergenext(struct idxent *ent, struct mergesrc *src)
+{
+    struct idxent *cur, *min;
+    int i, mi, ret;
+    
+    while(1) {
+	min = NULL;
+	mi = -1;
+	for(i = 0; i < src->nrd; i++) {
+	    if((ret = runpeek(&src->rd[i], &cur)) < 0)
+		return(-1);
+	    if(ret == 0)
+		continue;
+	    if((min == NULL) || (idxentcmp(cur, min) < 0)) {
+		min = cur;
+		mi = i;
+	    }
+	}
+	if(min == NULL)
+	    return(0);
+	src->rd[mi].bi++;
+	if(src->any && !addrcmp(&min->addr, &src->last))
+	    continue;
+	src->last = min->addr;
+	src->any = 1;
+	*ent = *min;
+	return(1);
+    }
+}
+
+/* Drops all but the first of each run of sorted entries with one address. */
+static idx_t uniqents(struct idxent *ents, idx_t n)
+{
+    idx_t i, o;
+    
+    for(i = 0, o = 0; i < n; i++) {
+	if((o > 0) && !addrcmp(&ents[i].addr, &ents[o - 1].addr))
+	    continue;
+	ents[o++] = ents[i];
+    }
+    return(o);
+}
+
+/*
+ * Ends bulk mode, writing a new index from the current one merged
+ * with everything put since bulk mode was started. The append lock
+ * is held for the merge only, so that nothing can be indexed in the
+ * meantime and be lost when the new index replaces the old.
+ */
+static int bulkend(struct fstore *fst)
+{
+    struct bulk *b;
+    struct arraysrc asrc;
+    struct mergesrc msrc;
+    struct idxent ie;
+    idx_t i, n, c;
+    int ret;
+    
+    if((b = fst->bulk) == NULL)
+	return(0);
+    if(lockstore(fst))
+	return(-1);
+    ret = -1;
+    n = fst->idxsize + b->npend;
+    if((b->nruns == 0) && (n <= BULKRUNSZ)) {
+	if(readall(fst->idxfd, b->pend + b->npend, sizeof(*b->pend) * fst->idxsize, sizeof(struct idxhdr))) {
+	    flog(LOG_ERR, "could not read index: %s", strerror(errno));
+	    goto out;
+	}
+	sortents(b->pend, n);
+	asrc.ents = b->pend;
+	asrc.n = uniqents(b->pend, n);
+	asrc.i = 0;
+	ret = writeindex(fst, asrc.n, (int (*)(struct idxent *, void *))arraynext, &asrc);
+	goto out;
+    }
+    if(b->npend > 0) {
+	if(spillrun(fst, b->pend, b->npend))
+	    goto out;
+	b->npend = 0;
+	memset(b->htab, 0, sizeof(*b->htab) * BULKHSZ);
+    }
+    for(i = 0; i < fst->idxsize; i += c) {
+	c = (fst->idxsize - i > BULKRUNSZ)?BULKRUNSZ:(fst->idxsize - i);
+	if(readall(fst->idxfd, b->pend, sizeof(*b->pend) * c, sizeof(struct idxhdr) + i * sizeof(struct idxent))) {
+	    flog(LOG_ERR, "could not read index: %s", strerror(errno));
+	    goto out;
+	}
+	if(spillrun(fst, b->pend, c))
+	    goto out;
+    }
+    memset(&msrc, 0, sizeof(msrc));
+    msrc.nrd = b->nruns;
+    msrc.rd = calloc(b->nruns, sizeof(*msrc.rd));
+    for(i = 0; i < b->nruns; i++) {
+	msrc.rd[i].fd = b->runs[i].fd;
+	msrc.rd[i].n = b->runs[i].n;
+	msrc.rd[i].buf = malloc(sizeof(*msrc.rd[i].buf) * RUNBUFSZ);
+    }
+    /* Duplicates are only known once merged, so count them first */
+    for(n = 0; (c = mergenext(&ie, &msrc)) > 0; n++);
+    if(c < 0) {
+	flog(LOG_ERR, "could not read index run: %s", strerror(errno));
+    } else {
+	for(i = 0; i < b->nruns; i++)
+	    msrc.rd[i].pos = msrc.rd[i].bn = msrc.rd[i].bi = 0;
+	msrc.any = 0;
+	ret = writeindex(fst, n, (int (*)(struct idxent *, void *))mergenext, &msrc);
+    }
+    for(i = 0; i < b->nruns; i++)
+	free(msrc.rd[i].buf);
+    free(msrc.rd);
+    
+out:
+    unlockstore(fst);
+    if(!ret) {
+	for(i = 0; i < b->nruns; i++)
+	    close(b->runs[i].fd);
+	unlink(b->mark);
+	close(b->markfd);
+	free(b->mark);
+	if(b->runs != NULL)
+	    free(b->runs);
+	free(b->pend);
+	free(b->htab);
+	free(b);
+	fst->bulk = NULL;
+    }
+    return(ret);
+}
+
+static int bulk(struct store *st, int on)
+{
+    if(on)
+	return(bulkstart(st->pdata));
+    else
+	return(bulkend(st->pdata));
+}
+
+/* A log entry made ready for appending, its data compressed if need be. */
+struct newent {
+    struct entinfo ei;
+    char hbuf[sizeof(struct logent) + sizeof(u_int32_t)];
+    const void *data;
+    char *zbuf;
+};
+
+static void mkent(struct fstore *fst, const void *buf, size_t len, struct addr *pa, struct newent *ne)
+{
+    struct entinfo *ei;
+    u_int16_t rlen;
+    u_int32_t lrlen;
+    size_t plen;
+    uLongf zlen;
+    
+    ei = &ne->ei;
+    memset(ei, 0, sizeof(*ei));
+    memcpy(ei->le.magic, LOGENTMAGIC, 4);
+    ei->le.name = *pa;
+    ei->len = len;
+    ne->data = buf;
+    ne->zbuf = NULL;
+    plen = (len > SHORTMAX)?sizeof(lrlen):sizeof(rlen);
+    if((fst->flags & FST_COMPRESS) && (len > plen)) {
+	ne->zbuf = malloc(len);
+	zlen = len - plen - 1;
+	if(compress((Bytef *)ne->zbuf + plen, &zlen, buf, len) == Z_OK) {
+	    if(plen == sizeof(lrlen)) {
+		lrlen = len;
+		memcpy(ne->zbuf, &lrlen, sizeof(lrlen));
+	    } else {
+		rlen = len;
+		memcpy(ne->zbuf, &rlen, sizeof(rlen));
+	    }
+	    ne->data = ne->zbuf;
+	    len = ei->len = zlen + plen;
+	    ei->le.fl |= LOGENT_DEFLATE;
+	}
+    }
+    /* The raw length prefix decides the kind of a compressed entry. */
+    if((plen == sizeof(lrlen)) || (len > SHORTMAX)) {
+	ei->le.fl |= LOGENT_LONG;
+	ei->le.len = 0;
+	ei->hlen = sizeof(ei->le) + sizeof(lrlen);
+	lrlen = len;
+	memcpy(ne->hbuf + sizeof(ei->le), &lrlen, sizeof(lrlen));
+    } else {
+	ei->le.len = len;
+	ei->hlen = sizeof(ei->le);
+    }
+    if(fst->flags & FST_ALIGN)
+	ei->le.fl |= LOGENT_ALIGNED;
+    memcpy(ne->hbuf, &ei->le, sizeof(ei->le));
+}
+
+/* Writes an entry to the end of the log. The store must be locked. */
+static int writeent(struct fstore *fst, struct newent *ne, u_int64_t *off)
+{
+    loff_t leoff;
+    struct entinfo *ei;
+    struct logseg *seg;
+    static char pad[LOGALIGN];
+    loff_t next;
+    int err;
+    
+    ei = &ne->ei;
+    /* XXX: Thread safety { */
+    seg = &fst->segs[fst->nsegs - 1];
+    if((seg->size > sizeof(struct loghdr)) && (seg->size + ei->hlen + ei->len > LOGSEGSIZE)) {
+	if(newseg(fst))
+	    return(-1);
+	seg = &fst->segs[fst->nsegs - 1];
+    }
+    leoff = seg->size;
+    seg->size = next = entnext(leoff, ei);
+    /* } */
+    /* XXX: Handle data with embedded LOGENTMAGIC */
+    if(writeall(seg->fd, ne->hbuf, ei->hlen, leoff) ||
+       writeall(seg->fd, ne->data, ei->len, leoff + ei->hlen) ||
+       ((next > leoff + ei->hlen + ei->len) &&
+	writeall(seg->fd, pad, next - (leoff + ei->hlen + ei->len), leoff + ei->hlen + ei->len))) {
+	err = errno;
+	flog(LOG_ERR, "could not write log entry at %i:%lli: %s", fst->nsegs - 1, (long long)leoff, strerror(err));
+	/* Leave no partial entry for the next append to follow */
+	seg->size = leoff;
+	ftruncate(seg->fd, leoff);
+	errno = err;
+	return(-1);
+    }
+    if((seg->dfd >= 0) && (seg->size - seg->dropped >= DIODROP)) {
+	sync_file_range(seg->fd, seg->dropped, seg->size - seg->dropped, SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+	posix_fadvise(seg->fd, seg->dropped, seg->size - seg->dropped, POSIX_FADV_DONTNEED);
+	seg->dropped = seg->size;
+    }
+    *off = SEGOFF(fst->nsegs - 1, leoff);
+    return(0);
+}
+
+/* Appends an entry to the log and indexes it. The store must be locked. */
+static int appendent(struct fstore *fst, struct newent *ne)
+{
+    idx_t pi;
+    u_int64_t off;
+    struct addr *a;
+    
+    a = &ne->ei.le.name;
+    /* Another process may have put it while it was being compressed */
+    if(lookup(fst, a, &pi) != -1)
+	return(0);
+    if((fst->bulk != NULL) && bulkfind(fst, a, &off))
+	return(0);
+    if(writeent(fst, ne, &off))
+	return(-1);
+    if(fst->bulk != NULL)
+	return(bulkadd(fst, a, off));
+    return(addindex(fst, a, off, pi));
+}
+
+/*
+ * Puts blocks that have been hashed into pas. They are compressed
+ * before the store is locked, and appended PUTCHUNK at a time under
+ * the lock, so that other writers are held up as little as possible.
+ */
+#define PUTCHUNK 64
+
+static int puthashed(struct fstore *fst, const void **bufs, const size_t *lens, struct addr *pas, int n)
+{
+    struct newent ents[PUTCHUNK];
+    u_int64_t off;
+    int i, k, m, e, ret;
+    
+    ret = 0;
+    for(i = 0; (i < n) && !ret; i = e) {
+	for(e = i, m = 0; (e < n) && (m < PUTCHUNK); e++) {
+	    if(lookup(fst, &pas[e], NULL) != -1)
+		continue;
+	    if((fst->bulk != NULL) && bulkfind(fst, &pas[e], &off))
+		continue;
+	    mkent(fst, bufs[e], lens[e], &pas[e], &ents[m++]);
+	}
+	if((m > 0) && !(ret = lockstore(fst))) {
+	    for(k = 0; k < m; k++) {
+		if(appendent(fst, &ents[k])) {
+		    ret = -1;
+		    break;
+		}
+	    }
+	    unlockstore(fst);
+	}
+	for(k = 0; k < m; k++) {
+	    if(ents[k].zbuf != NULL)
+		free(ents[k].zbuf);
+	}
+    }
+    return(ret);
+}
+
+static int put(struct store *st, const void *buf, size_t len, struct addr *at)
+{
+    struct addr pa;
+    
+    if(len > STORE_MAXBLSZ) {
+	errno = E2BIG;
+	return(-1);
+    }
+    hash(buf, len, &pa);
+    if(at != NULL)
+	memcpy(at->hash, pa.hash, 32);
+    return(puthashed(st->pdata, &buf, &len, &pa, 1));
+}
+
+/*
+ * Puts n blocks whose addresses in ats have already been computed by
+ * fstorehash(), bypassing the store cache. This lets a store
+ * composed of filestores route blocks by address without hashing
+ * them twice.
+ */
+int fstoreputhashed(struct store *st, const void **bufs, const size_t *lens, struct addr *ats, int n)
+{
+    int i;
+    
+    for(i = 0; i < n; i++) {
+	if(lens[i] > STORE_MAXBLSZ) {
+	    errno = E2BIG;
+	    return(-1);
+	}
+    }
+    return(puthashed(st->pdata, bufs, lens, ats, n));
+}
+
+/*
+ * Replaces the log entry of a block that has been found corrupt with
+ * a new one holding buf, a good copy from elsewhere, and points the
+ * index at it. A block missing altogether is simply put.
+ */
+int fstorerepair(struct store *st, const void *buf, size_t len, struct addr *a)
+{
+    struct fstore *fst;
+    struct newent ne;
+    struct idxent ie;
+    struct addr v;
+    u_int64_t off;
+    idx_t i;
+    int ret;
+    
+    fst = st->pdata;
+    hash(buf, len, &v);
+    if((len > STORE_MAXBLSZ) || addrcmp(&v, a)) {
+	errno = EINVAL;
+	return(-1);
+    }
+    /* Bulk-loaded entries cannot be repointed before the merge */
+    if(fst->bulk != NULL) {
+	errno = EBUSY;
+	return(-1);
+    }
+    mkent(fst, buf, len, a, &ne);
+    if(lockstore(fst)) {
+	ret = -1;
+    } else {
+	if((i = lookup(fst, a, NULL)) == -1) {
+	    ret = appendent(fst, &ne);
+	} else if(!(ret = writeent(fst, &ne, &off))) {
+	    assert(!getidx(fst, i, &ie));
+	    ie.off = off;
+	    assert(!putidx(fst, i, &ie));
+	    flog(LOG_NOTICE, "repaired block %s in %s", formataddr(a), fst->dir);
+	}
+	unlockstore(fst);
+    }
+    if(ne.zbuf != NULL)
+	free(ne.zbuf);
+    return(ret);
+}
+
+static int putmany(struct store *st, const void **bufs, const size_t *lens, struct addr *ats, int n)
+{
+    int i;
+    
+    for(i = 0; i < n; i++) {
+	if(lens[i] > STORE_MAXBLSZ) {
+	    errno = E2BIG;
+	    return(-1);
+	}
+    }
+    fstorehash(bufs, lens, ats, n);
+    return(fstoreputhashed(st, bufs, lens, ats, n));
+}
+
+/*
+ * By default, get() checks every block it reads against its
+ * hash. With FST_VERIFYONCE, a log entry is only checked the first
+ * time this process reads it, as recorded in a bitmap per segment
+ * with one bit for every 32 bytes of log; log entries are always
+ * longer than that. Segments that have been scrubbed as a whole, by
+ * fstorescrub() or by the background scrubber started by FST_SCRUB,
+ * then count as checked in their entirety.
+ */
+#define VMAPSHIFT 5
+
+static int isverified(struct fstore *fst, u_int64_t off)
+{
+    struct logseg *seg;
+    u_int64_t bit;
+    
+    if(!(fst->flags & FST_VERIFYONCE))
+	return(0);
+    seg = &fst->segs[OFFSEG(off)];
+    if(seg->verified)
+	return(1);
+    bit = OFFOFF(off) >> VMAPSHIFT;
+    if((seg->vmap == NULL) || (bit >= seg->vmapsz * 8))
+	return(0);
+    return((seg->vmap[bit >> 3] & (1 << (bit & 7))) != 0);
+}
+
+static void markverified(struct fstore *fst, u_int64_t off)
+{
+    struct logseg *seg;
+    u_int64_t bit;
+    
+    if(!(fst->flags & FST_VERIFYONCE))
+	return;
+    seg = &fst->segs[OFFSEG(off)];
+    bit = OFFOFF(off) >> VMAPSHIFT;
+    if(seg->vmap == NULL) {
+	seg->vmapsz = (((seg->size > LOGSEGSIZE)?seg->size:LOGSEGSIZE) >> (VMAPSHIFT + 3)) + 1;
+	seg->vmap = calloc(seg->vmapsz, 1);
+    }
+    if(bit < seg->vmapsz * 8)
+	seg->vmap[bit >> 3] |= 1 << (bit & 7);
+}
+
+/* Finds the log offset of a block, returning zero if it is not found. */
+static int findblock(struct fstore *fst, struct addr *a, u_int64_t *off)
+{
+    idx_t i;
+    struct idxent ie;
+    
+    if((i = lookup(fst, a, NULL)) != -1) {
+	assert(!getidx(fst, i, &ie));
+	*off = ie.off;
+	return(1);
+    }
+    if((fst->bulk != NULL) && bulkfind(fst, a, off))
+	return(1);
+    return(0);
+}
+
+/* Checks a block read from the log at off according to the verification policy. */
+static int checkblock(struct fstore *fst, u_int64_t off, struct logent *le, const void *data, size_t sz, struct addr *at)
+{
+    struct addr v;
+    
+    if(addrcmp(&le->name, at)) {
+	flog(LOG_CRIT, "did not receive correct block from log");
+	errno = EIO;
+	return(-1);
+    }
+    if(!isverified(fst, off)) {
+	hash(data, sz, &v);
+	if(addrcmp(&v, &le->name)) {
+	    flog(LOG_CRIT, "log data did not verify against hash");
+	    errno = EIO;
+	    return(-1);
+	}
+	markverified(fst, off);
+    }
+    return(0);
+}
+
+static ssize_t get(struct store *st, void *buf, size_t len, struct addr *at)
+{
+    struct fstore *fst;
+    struct entinfo ei;
+    struct entbuf eb;
+    ssize_t sz;
+    u_int64_t off;
+    
+    fst = st->pdata;
+    if(!findblock(fst, at, &off) && ((syncindex(fst) <= 0) || !findblock(fst, at, &off))) {
+	errno = ENOENT;
+	return(-1);
+    }
+    eb.buf = buf;
+    eb.sz = (buf == NULL)?0:len;
+    eb.own = 0;
+    if(((sz = readent(fst, OFFSEG(off), OFFOFF(off), &ei, &eb)) < 0) ||
+       checkblock(fst, off, &ei.le, eb.buf, sz, at)) {
+	entbuffree(&eb);
+	return(-1);
+    }
+    if((buf != NULL) && (eb.buf != buf))
+	memcpy(buf, eb.buf, min(len, sz));
+    entbuffree(&eb);
+    return(sz);
+}
+
+/*
+ * Reads many blocks, in log order. In segments that are not mapped,
+ * reads of entries lying close together are merged into one read of
+ * the whole span, which contains every short entry in it, since the
+ * entry at the end is followed by at most SHORTMAX bytes of data.
+ * Long entries running past the span are read on their own. With an
+ * io_uring (FST_URING), the index lookups of all blocks proceed a
+ * tree level per round of parallel reads, and the spans are read
+ * GETWINDOW at a time in parallel.
+ */
+#define GETMERGEGAP 65536
+#define GETMAXSPAN (1 << 20)
+#define GETWINDOW 16
+
+struct getreq {
+    u_int64_t off;
+    int i;
+};
+
+struct getspan {
+    int seg, i, e;
+    loff_t base, end;
+    char *buf;
+    ssize_t res;
+};
+
+struct ringlookup {
+    struct idxent ie;
+    idx_t cur;
+    int active;
+    ssize_t res;
+};
+
+static int getreqcmp(const struct getreq *a, const struct getreq *b)
+{
+    if(a->off < b->off)
+	return(-1);
+    if(a->off > b->off)
+	return(1);
+    return(0);
+}
+
+static void ringdone(ssize_t ret, ssize_t *res)
+{
+    *res = ret;
+}
+
+static int ringfind(struct fstore *fst, struct addr *ats, int n, u_int64_t *offs, int *found)
+{
+    struct ringlookup *lr;
+    idx_t next;
+    int i, c, act, ret;
+    
+    lr = malloc(sizeof(*lr) * n);
+    for(i = 0; i < n; i++) {
+	found[i] = 0;
+	lr[i].cur = 0;
+	lr[i].active = fst->idxsize > 0;
+    }
+    ret = -1;
+    while(1) {
+	for(i = 0, act = 0; i < n; i++) {
+	    if(!lr[i].active)
+		continue;
+	    if(uringread(fst->ring, fst->idxfd, &lr[i].ie, sizeof(lr[i].ie), sizeof(struct idxhdr) + lr[i].cur * sizeof(struct idxent), (uringcb)ringdone, &lr[i].res))
+		goto out;
+	    act++;
+	}
+	if(act == 0)
+	    break;
+	if(uringwait(fst->ring))
+	    goto out;
+	for(i = 0; i < n; i++) {
+	    if(!lr[i].active)
+		continue;
+	    if(lr[i].res != sizeof(lr[i].ie)) {
+		errno = (lr[i].res < 0)?-lr[i].res:ENODATA;
+		flog(LOG_CRIT, "could not read index: %s", strerror(errno));
+		errno = EIO;
+		goto out;
+	    }
+	    if((c = addrcmp(&ats[i], &lr[i].ie.addr)) == 0) {
+		found[i] = 1;
+		offs[i] = lr[i].ie.off;
+		lr[i].active = 0;
+	    } else if((next = (c < 0)?lr[i].ie.l:lr[i].ie.r) == 0) {
+		lr[i].active = 0;
+	    } else {
+		lr[i].cur = next;
+	    }
+	}
+    }
+    ret = 0;
+    
+out:
+    /* Nothing may be left writing into lr */
+    if(ret && uringdrain(fst->ring)) {
+	flog(LOG_CRIT, "could not drain io_uring: %s", strerror(errno));
+	return(ret);
+    }
+    free(lr);
+    return(ret);
+}
+
+/* Reads whatever part of a span that was not read asynchronously. */
+static int fillspan(struct getspan *sp, struct logseg *lseg)
+{
+    if(sp->res < 0) {
+	errno = -sp->res;
+	return(-1);
+    }
+    if(sp->base + sp->res < sp->end)
+	return(readall(lseg->fd, sp->buf + sp->res, sp->end - sp->base - sp->res, sp->base + sp->res));
+    return(0);
+}
+
+static int getspan(struct fstore *fst, struct getspan *sp, struct getreq *reqs, void **bufs, const size_t *lens, struct addr *ats, ssize_t *szs)
+{
+    struct logseg *lseg, span;
+    struct entinfo ei;
+    struct entbuf eb;
+    loff_t off;
+    ssize_t sz;
+    int k, r;
+    
+    lseg = &fst->segs[sp->seg];
+    if(sp->buf != NULL) {
+	if(fillspan(sp, lseg)) {
+	    flog(LOG_CRIT, "could not read log at %i:%lli: %s", sp->seg, (long long)sp->base, strerror(errno));
+	    errno = EIO;
+	    return(-1);
+	}
+	memset(&span, 0, sizeof(span));
+	span.map = sp->buf;
+	span.size = sp->end - sp->base;
+    }
+    for(k = sp->i; k < sp->e; k++) {
+	r = reqs[k].i;
+	off = OFFOFF(reqs[k].off);
+	eb.buf = bufs[r];
+	eb.sz = (bufs[r] == NULL)?0:lens[r];
+	eb.own = 0;
+	if((sp->buf != NULL) && (off < sp->end) && !parsehdr(sp->buf + (off - sp->base), sp->end - off, &ei) && (off + ei.hlen + ei.len <= sp->end))
+	    sz = readsegent(&span, sp->seg, sp->base, off, &ei, &eb);
+	else
+	    sz = readsegent(lseg, sp->seg, 0, off, &ei, &eb);
+	if((sz < 0) || checkblock(fst, reqs[k].off, &ei.le, eb.buf, sz, &ats[r])) {
+	    entbuffree(&eb);
+	    return(-1);
+	}
+	if((bufs[r] != NULL) && (eb.buf != bufs[r]))
+	    memcpy(bufs[r], eb.buf, min(lens[r], sz));
+	entbuffree(&eb);
+	szs[r] = sz;
+    }
+    return(0);
+}
+
+static int getmany(struct store *st, void **bufs, const size_t *lens, struct addr *ats, ssize_t *szs, int n)
+{
+    struct fstore *fst;
+    struct getreq *reqs;
+    struct getspan *spans, *sp;
+    u_int64_t *offs;
+    int *found;
+    int i, e, w, we, nr, ns, seg, ret;
+    
+    fst = st->pdata;
+    offs = malloc(sizeof(*offs) * n);
+    found = malloc(sizeof(*found) * n);
+    reqs = malloc(sizeof(*reqs) * n);
+    spans = malloc(sizeof(*spans) * n);
+    ret = -1;
+    if(fst->ring != NULL) {
+	if(ringfind(fst, ats, n, offs, found))
+	    goto out;
+    } else {
+	for(i = 0; i < n; i++)
+	    found[i] = findblock(fst, &ats[i], &offs[i]);
     }
-    assert(!getidx(fst, i, &ie));
+    for(i = 0; (i < n) && found[i]; i++);
+    if((i < n) && (syncindex(fst) > 0)) {
+	for(; i < n; i++) {
+	    if(!found[i])
+		found[i] = findblock(fst, &ats[i], &offs[i]);
+	}
+    }
+    for(i = 0, nr = 0; i < n; i++) {
+	if(!found[i] && (fst->bulk != NULL))
+	    found[i] = bulkfind(fst, &ats[i], &offs[i]);
+	if(found[i]) {
+	    reqs[nr].off = offs[i];
+	    reqs[nr++].i = i;
+	} else {
+	    szs[i] = -1;
+	}
+    }
+    qsort(reqs, nr, sizeof(*reqs), (int (*)(const void *, const void *))getreqcmp);
+    /* Blocks that other processes have put past the known end of the log */
+    if((nr > 0) && ((seg = OFFSEG(reqs[nr - 1].off)) >= fst->nsegs - 1) &&
+       ((seg >= fst->nsegs) || (OFFOFF(reqs[nr - 1].off) >= fst->segs[seg].size)))
+	syncsegs(fst);
+    for(i = 0, ns = 0; i < nr; i = e) {
+	if((seg = OFFSEG(reqs[i].off)) >= fst->nsegs) {
+	    flog(LOG_CRIT, "invalid log segment %i", seg);
+	    errno = EIO;
+	    goto out;
+	}
+	for(e = i + 1; e < nr; e++) {
+	    if((OFFSEG(reqs[e].off) != seg) ||
+	       (OFFOFF(reqs[e].off) - OFFOFF(reqs[e - 1].off) > GETMERGEGAP) ||
+	       (OFFOFF(reqs[e].off) - OFFOFF(reqs[i].off) > GETMAXSPAN))
+		break;
+	}
+	sp = &spans[ns++];
+	sp->seg = seg;
+	sp->i = i;
+	sp->e = e;
+	sp->base = OFFOFF(reqs[i].off);
+	sp->end = OFFOFF(reqs[e - 1].off) + sizeof(struct logent) + SHORTMAX;
+	if(sp->end > fst->segs[seg].size)
+	    sp->end = fst->segs[seg].size;
+	sp->buf = NULL;
+	sp->res = 0;
+    }
+    for(w = 0; w < ns; w = we) {
+	we = min(w + GETWINDOW, ns);
+	for(i = w; i < we; i++) {
+	    sp = &spans[i];
+	    if((fst->segs[sp->seg].map != NULL) || (fst->segs[sp->seg].dfd >= 0) || (sp->end <= sp->base))
+		continue;
+	    sp->buf = malloc(sp->end - sp->base);
+	    if((fst->ring != NULL) && uringread(fst->ring, fst->segs[sp->seg].fd, sp->buf, sp->end - sp->base, sp->base, (uringcb)ringdone, &sp->res))
+		sp->res = 0;
+	}
+	if((fst->ring != NULL) && uringwait(fst->ring))
+	    goto freewin;
+	for(i = w; i < we; i++) {
+	    if(getspan(fst, &spans[i], reqs, bufs, lens, ats, szs))
+		goto freewin;
+	}
+	for(i = w; i < we; i++) {
+	    if(spans[i].buf != NULL)
+		free(spans[i].buf);
+	}
+    }
+    ret = 0;
+    goto out;
     
-    if(readall(fst->logfd, &le, sizeof(le), ie.off)) {
-	flog(LOG_CRIT, "could not read log entry: %s", strerror(errno));
-	errno = EIO;
+freewin:
+    /* Nothing may be left reading into the window or into spans */
+    if((fst->ring != NULL) && uringdrain(fst->ring)) {
+	flog(LOG_CRIT, "could not drain io_uring: %s", strerror(errno));
+	spans = NULL;
+	goto out;
+    }
+    for(i = w; i < we; i++) {
+	if(spans[i].buf != NULL)
+	    free(spans[i].buf);
+    }
+out:
+    free(offs);
+    free(found);
+    free(reqs);
+    free(spans);
+    return(ret);
+}
+
+/*
+ * Calls fn for every block in the log, in log order, so that the
+ * whole store can be read sequentially. Every block is verified
+ * against its hash before being passed on. If fn returns non-zero,
+ * the scan is aborted and that value is returned.
+ */
+int fstorescan(struct store *st, int (*fn)(struct addr *a, const void *buf, size_t len, void *pdata), void *pdata)
+{
+    struct fstore *fst;
+    struct entinfo ei;
+    struct entbuf eb;
+    struct addr v;
+    loff_t off;
+    int seg, ret;
+    ssize_t sz;
+    
+    fst = st->pdata;
+    memset(&eb, 0, sizeof(eb));
+    ret = 0;
+    for(seg = 0; (seg < fst->nsegs) && !ret; seg++) {
+	for(off = sizeof(struct loghdr); off < fst->segs[seg].size; off = entnext(off, &ei)) {
+	    if((sz = readent(fst, seg, off, &ei, &eb)) < 0) {
+		ret = -1;
+		break;
+	    }
+	    hash(eb.buf, sz, &v);
+	    if(addrcmp(&v, &ei.le.name)) {
+		flog(LOG_CRIT, "log data at %i:%lli did not verify against hash", seg, (long long)off);
+		errno = EIO;
+		ret = -1;
+		break;
+	    }
+	    if((ret = fn(&ei.le.name, eb.buf, sz, pdata)) != 0)
+		break;
+	}
+    }
+    entbuffree(&eb);
+    return(ret);
+}
+
+/*
+ * Checks every entry of a log segment against its hash, marking the
+ * segment verified if it is sealed and found intact. Returns the
+ * number of bad entries, or -1 if the segment could not be read
+ * through or stop was raised.
+ */
+static int scrubseg(struct fstore *fst, int segn, volatile int *stop)
+{
+    struct logseg seg;
+    struct entinfo ei;
+    struct entbuf eb;
+    struct addr v;
+    loff_t off;
+    ssize_t sz;
+    int bad;
+    
+    pthread_mutex_lock(&fst->seglock);
+    seg = fst->segs[segn];
+    pthread_mutex_unlock(&fst->seglock);
+    memset(&eb, 0, sizeof(eb));
+    bad = 0;
+    for(off = sizeof(struct loghdr); off < seg.size; off = entnext(off, &ei)) {
+	if((stop != NULL) && *stop) {
+	    bad = -1;
+	    break;
+	}
+	if((sz = readsegent(&seg, segn, 0, off, &ei, &eb)) < 0) {
+	    bad = -1;
+	    break;
+	}
+	hash(eb.buf, sz, &v);
+	if(addrcmp(&v, &ei.le.name)) {
+	    flog(LOG_CRIT, "log data at %i:%lli did not verify against hash", segn, (long long)off);
+	    bad++;
+	}
+    }
+    entbuffree(&eb);
+    if((bad == 0) && seg.sealed) {
+	pthread_mutex_lock(&fst->seglock);
+	fst->segs[segn].verified = 1;
+	pthread_mutex_unlock(&fst->seglock);
+    }
+    return(bad);
+}
+
+/*
+ * Verifies every block in the log. Returns the number of blocks that
+ * did not verify, or -1 if the log could not be read through.
+ */
+int fstorescrub(struct store *st)
+{
+    struct fstore *fst;
+    int i, ret, bad;
+    
+    fst = st->pdata;
+    bad = 0;
+    for(i = 0; i < fst->nsegs; i++) {
+	if((ret = scrubseg(fst, i, NULL)) < 0)
+	    return(-1);
+	bad += ret;
+    }
+    return(bad);
+}
+
+/*
+ * The background scrubber only looks at sealed segments, which never
+ * change, and at the segment table under seglock. Only the segments
+ * that were sealed when the store was opened are scrubbed.
+ */
+static void *scrubworker(struct fstore *fst)
+{
+    int i, n, sealed;
+    
+    pthread_mutex_lock(&fst->seglock);
+    n = fst->nsegs;
+    pthread_mutex_unlock(&fst->seglock);
+    for(i = 0; (i < n) && !fst->scrubstop; i++) {
+	pthread_mutex_lock(&fst->seglock);
+	sealed = fst->segs[i].sealed && !fst->segs[i].verified;
+	pthread_mutex_unlock(&fst->seglock);
+	if(sealed && (scrubseg(fst, i, &fst->scrubstop) > 0))
+	    flog(LOG_CRIT, "scrubbing found bad blocks in log segment %i of %s", i, fst->dir);
+    }
+    return(NULL);
+}
+
+static struct storeops fstops = {
+    .release = releaseg,
+    .put = put,
+    .get = get,
+    .bulk = bulk,
+    .putmany = putmany,
+    .getmany = getmany,
+};
+
+static int openindex(struct fstore *fst)
+{
+    char tbuf[1024];
+    struct idxhdr ih;
+    struct stat64 sb;
+    
+    snprintf(tbuf, sizeof(tbuf), "%s/index", fst->dir);
+    if((fst->idxfd = open(tbuf, O_RDWR | O_LARGEFILE)) < 0) {
+	flog(LOG_ERR, "could not open index %s: %s", tbuf, strerror(errno));
 	return(-1);
     }
-    if(memcmp(le.magic, LOGENTMAGIC, 4)) {
-	flog(LOG_CRIT, "invalid magic in log");
-	errno = EIO;
+    if(fstat64(fst->idxfd, &sb)) {
+	flog(LOG_ERR, "could not stat index: %s", strerror(errno));
 	return(-1);
     }
-    if(addrcmp(&le.name, at)) {
-	flog(LOG_CRIT, "did not receive correct block from log");
-	errno = EIO;
+    if(readall(fst->idxfd, &ih, sizeof(ih), 0)) {
+	flog(LOG_ERR, "could not read index header: %s", strerror(errno));
 	return(-1);
     }
-    if(readall(fst->logfd, tmpbuf, le.len, ie.off + sizeof(le))) {
-	flog(LOG_CRIT, "could not read log data: %s", strerror(errno));
-	errno = EIO;
+    if(memcmp(ih.magic, IDXMAGIC, sizeof(IDXMAGIC))) {
+	flog(LOG_ERR, "invalid index magic");
 	return(-1);
     }
-    hash(tmpbuf, le.len, &v);
-    if(addrcmp(&v, &le.name)) {
-	flog(LOG_CRIT, "log data did not verify against hash");
-	errno = EIO;
+    if(sb.st_size != (sizeof(struct idxhdr) + ih.size * sizeof(struct idxent))) {
+	flog(LOG_ERR, "invalid index size");
 	return(-1);
     }
-    if(buf != NULL)
-	memcpy(buf, tmpbuf, min(len, le.len));
-    return(le.len);
+    fst->idxsize = ih.size;
+    return(0);
 }
 
-static struct storeops fstops = {
-    .release = releaseg,
-    .put = put,
-    .get = get,
+/*
+ * Index recovery. Every segment is scanned on a thread of its own,
+ * walking its entries through a mapping of the segment and verifying
+ * each of them against its hash. Where an entry doesn't check out,
+ * the scan resynchronizes on the next LOGENTMAGIC that starts a good
+ * entry, so that a corrupt entry costs only itself, and not the good
+ * copies that repairs have since appended. Only if no good entry
+ * follows an entry that runs past the end of the last segment is it
+ * taken to be the torn tail of an interrupted put(), and the segment
+ * truncated there.
+ */
+struct scanjob {
+    struct fstore *fst;
+    int seg;
+    loff_t end;
+    struct idxent *ents;
+    size_t n, sz, nbad;
+    int err;
+};
+
+struct scanpool {
+    pthread_mutex_t lock;
+    struct scanjob *jobs;
+    int njobs, next;
 };
 
+#define ENTOK 0
+#define ENTTORN 1
+#define ENTBAD 2
+
+/* Checks the entry at off of a mapped segment of size bytes. */
+static int checkent(const char *map, loff_t size, loff_t off, struct entinfo *ei, struct entbuf *eb)
+{
+    struct addr v;
+    const void *data;
+    ssize_t sz;
+    
+    if(size - off < sizeof(ei->le) + sizeof(u_int32_t)) {
+	if(parsehdr(map + off, size - off, ei))
+	    return((memcmp(map + off, LOGENTMAGIC, min(4, size - off)))?ENTBAD:ENTTORN);
+    } else if(parsehdr(map + off, size - off, ei)) {
+	return(ENTBAD);
+    }
+    if(off + ei->hlen + ei->len > size)
+	return(ENTTORN);
+    data = map + off + ei->hlen;
+    sz = ei->len;
+    if(ei->le.fl & LOGENT_DEFLATE) {
+	if((sz = inflateent(ei, data, eb)) < 0)
+	    return(ENTBAD);
+	data = eb->buf;
+    }
+    hash(data, sz, &v);
+    if(addrcmp(&v, &ei->le.name))
+	return(ENTBAD);
+    return(ENTOK);
+}
+
+static void scanseg(struct scanjob *job)
+{
+    struct logseg *seg;
+    struct entinfo ei;
+    struct entbuf eb;
+    const char *p;
+    char *map;
+    loff_t off, next;
+    int r;
+    
+    seg = &job->fst->segs[job->seg];
+    if((map = seg->map) == NULL) {
+	if((map = mmap(NULL, seg->size, PROT_READ, MAP_SHARED, seg->fd, 0)) == MAP_FAILED) {
+	    flog(LOG_ERR, "could not map log segment %i: %s", job->seg, strerror(errno));
+	    job->err = 1;
+	    return;
+	}
+    }
+    memset(&eb, 0, sizeof(eb));
+    job->end = seg->size;
+    for(off = sizeof(struct loghdr); off < seg->size; off = next) {
+	if((r = checkent(map, seg->size, off, &ei, &eb)) == ENTOK) {
+	    if(job->n == job->sz) {
+		job->sz = (job->sz == 0)?1024:(job->sz * 2);
+		job->ents = realloc(job->ents, sizeof(*job->ents) * job->sz);
+	    }
+	    memset(&job->ents[job->n], 0, sizeof(*job->ents));
+	    job->ents[job->n].addr = ei.le.name;
+	    job->ents[job->n].off = SEGOFF(job->seg, off);
+	    job->n++;
+	    next = entnext(off, &ei);
+	    continue;
+	}
+	/* Resynchronize on the next good entry */
+	for(next = off + 1; next < seg->size; next = (p - map) + 1) {
+	    if((p = memmem(map + next, seg->size - next, LOGENTMAGIC, 4)) == NULL) {
+		next = seg->size;
+		break;
+	    }
+	    if(checkent(map, seg->size, p - map, &ei, &eb) == ENTOK) {
+		next = p - map;
+		break;
+	    }
+	}
+	if((next >= seg->size) && (r == ENTTORN)) {
+	    job->end = off;
+	    break;
+	}
+	flog(LOG_CRIT, "skipping corrupt log data at %i:%lli-%lli", job->seg, (long long)off, (long long)next);
+	job->nbad++;
+    }
+    entbuffree(&eb);
+    if(map != seg->map)
+	munmap(map, seg->size);
+}
+
+static void *scanworker(struct scanpool *pool)
+{
+    int i;
+    
+    while(1) {
+	pthread_mutex_lock(&pool->lock);
+	i = pool->next++;
+	pthread_mutex_unlock(&pool->lock);
+	if(i >= pool->njobs)
+	    return(NULL);
+	scanseg(&pool->jobs[i]);
+    }
+}
+
+static void runscan(struct scanjob *jobs, int njobs)
+{
+    struct scanpool pool;
+    pthread_t *th;
+    int i, nth;
+    
+    pool.jobs = jobs;
+    pool.njobs = njobs;
+    pool.next = 0;
+    pthread_mutex_init(&pool.lock, NULL);
+    if((nth = sysconf(_SC_NPROCESSORS_ONLN)) < 1)
+	nth = 1;
+    if(nth > njobs)
+	nth = njobs;
+    th = malloc(sizeof(*th) * nth);
+    for(i = 0; i < nth; i++) {
+	if(pthread_create(&th[i], NULL, (void *(*)(void *))scanworker, &pool))
+	    break;
+    }
+    nth = i;
+    /* Do the work ourselves if no threads could be started */
+    if(nth == 0)
+	scanworker(&pool);
+    for(i = 0; i < nth; i++)
+	pthread_join(th[i], NULL);
+    free(th);
+    pthread_mutex_destroy(&pool.lock);
+}
+
+/* Checks how far a scan got, truncating the torn tail if allowed. */
+static int scanend(struct fstore *fst, struct scanjob *job)
+{
+    struct logseg *seg;
+    
+    if(job->err)
+	return(-1);
+    seg = &fst->segs[job->seg];
+    if(job->end >= seg->size)
+	return(0);
+    if(job->seg != fst->nsegs - 1) {
+	/* Sealed segments are never appended to, so it can stay */
+	flog(LOG_CRIT, "incomplete log entry in sealed segment at %i:%lli", job->seg, (long long)job->end);
+	return(0);
+    }
+    flog(LOG_WARNING, "truncating torn log tail at %i:%lli", job->seg, (long long)job->end);
+    if(ftruncate(seg->fd, job->end)) {
+	flog(LOG_ERR, "could not truncate log: %s", strerror(errno));
+	return(-1);
+    }
+    seg->size = job->end;
+    return(0);
+}
+
+/* Rebuilds the whole index from a scan of all segments. */
+static int rebuildindex(struct fstore *fst)
+{
+    struct scanjob *jobs;
+    struct idxent *ents;
+    struct arraysrc src;
+    size_t i, n, o;
+    int seg, ret;
+    
+    jobs = calloc(fst->nsegs, sizeof(*jobs));
+    for(seg = 0; seg < fst->nsegs; seg++) {
+	jobs[seg].fst = fst;
+	jobs[seg].seg = seg;
+    }
+    runscan(jobs, fst->nsegs);
+    ret = 0;
+    for(seg = 0, n = 0; seg < fst->nsegs; n += jobs[seg++].n) {
+	if(scanend(fst, &jobs[seg]))
+	    ret = -1;
+    }
+    ents = NULL;
+    if(!ret) {
+	ents = malloc(sizeof(*ents) * (n + 1));
+	for(seg = 0, n = 0; seg < fst->nsegs; n += jobs[seg++].n)
+	    memcpy(ents + n, jobs[seg].ents, sizeof(*ents) * jobs[seg].n);
+	sortents(ents, n);
+	/* Keep only the first copy of blocks written more than once */
+	for(i = 0, o = 0; i < n; i++) {
+	    if((o > 0) && !addrcmp(&ents[o - 1].addr, &ents[i].addr))
+		continue;
+	    ents[o++] = ents[i];
+	}
+	flog(LOG_NOTICE, "rebuilt index with %zu entries", o);
+	src.ents = ents;
+	src.n = o;
+	src.i = 0;
+	ret = writeindex(fst, o, (int (*)(struct idxent *, void *))arraynext, &src);
+	free(ents);
+    }
+    for(seg = 0; seg < fst->nsegs; seg++) {
+	if(jobs[seg].ents != NULL)
+	    free(jobs[seg].ents);
+    }
+    free(jobs);
+    return(ret);
+}
+
+/*
+ * Indexes any entries at the end of the log that an interrupted
+ * put() left unindexed, and truncates a torn tail. Since older
+ * segments are synced before they are sealed, only the last segment
+ * needs to be checked.
+ */
+static int recovertail(struct fstore *fst)
+{
+    struct scanjob job;
+    size_t i, n;
+    idx_t pi;
+    int ret;
+    
+    memset(&job, 0, sizeof(job));
+    job.fst = fst;
+    job.seg = fst->nsegs - 1;
+    scanseg(&job);
+    ret = -1;
+    if(scanend(fst, &job))
+	goto out;
+    for(i = 0, n = 0; i < job.n; i++) {
+	if(lookup(fst, &job.ents[i].addr, &pi) != -1)
+	    continue;
+	if(addindex(fst, &job.ents[i].addr, job.ents[i].off, pi))
+	    goto out;
+	n++;
+    }
+    if(n > 0)
+	flog(LOG_NOTICE, "indexed %zu unindexed log entries", n);
+    ret = 0;
+    
+out:
+    if(job.ents != NULL)
+	free(job.ents);
+    return(ret);
+}
+
+/*
+ * Carries out the move recorded in the MOVEFILE of to, which names
+ * the number of segments to move and the directory they are in,
+ * relative to to unless absolute. Whatever has already been moved is
+ * skipped, so it can be run again after being interrupted.
+ */
+static int finishmove(char *to)
+{
+    char mbuf[1024], lbuf[1024], from[1100], fbuf[1200], tbuf[1200], *p;
+    FILE *mf;
+    int seg, n;
+    
+    snprintf(mbuf, sizeof(mbuf), "%s/%s", to, MOVEFILE);
+    if((mf = fopen(mbuf, "r")) == NULL) {
+	flog(LOG_ERR, "could not open %s: %s", mbuf, strerror(errno));
+	return(-1);
+    }
+    if((fscanf(mf, "%d\n", &n) != 1) || (fgets(lbuf, sizeof(lbuf), mf) == NULL)) {
+	flog(LOG_ERR, "%s is corrupt", mbuf);
+	fclose(mf);
+	errno = EINVAL;
+	return(-1);
+    }
+    fclose(mf);
+    if((p = strchr(lbuf, '\n')) != NULL)
+	*p = 0;
+    if(lbuf[0] == '/')
+	snprintf(from, sizeof(from), "%s", lbuf);
+    else
+	snprintf(from, sizeof(from), "%s/%s", to, lbuf);
+    for(seg = 0; seg < n; seg++) {
+	segname(from, seg, fbuf, sizeof(fbuf));
+	if(access(fbuf, F_OK))
+	    continue;
+	segname(to, seg, tbuf, sizeof(tbuf));
+	if(rename(fbuf, tbuf)) {
+	    flog(LOG_ERR, "could not move %s to %s: %s", fbuf, tbuf, strerror(errno));
+	    return(-1);
+	}
+    }
+    for(; ; seg++) {
+	segname(to, seg, tbuf, sizeof(tbuf));
+	if(unlink(tbuf))
+	    break;
+    }
+    snprintf(fbuf, sizeof(fbuf), "%s/index", from);
+    snprintf(tbuf, sizeof(tbuf), "%s/index", to);
+    if(!access(fbuf, F_OK) && rename(fbuf, tbuf)) {
+	flog(LOG_ERR, "could not move %s to %s: %s", fbuf, tbuf, strerror(errno));
+	return(-1);
+    }
+    snprintf(fbuf, sizeof(fbuf), "%s/lock", from);
+    unlink(fbuf);
+    snprintf(fbuf, sizeof(fbuf), "%s/users", from);
+    unlink(fbuf);
+    rmdir(from);
+    if(unlink(mbuf)) {
+	flog(LOG_ERR, "could not remove %s: %s", mbuf, strerror(errno));
+	return(-1);
+    }
+    return(0);
+}
+
 struct store *newfstore(char *dir)
+{
+    return(openfstore(dir, 0));
+}
+
+struct store *openfstore(char *dir, int flags)
 {
     struct store *st;
     struct fstore *fst;
     char tbuf[1024];
-    struct loghdr lh;
-    struct idxhdr ih;
-    struct stat64 sb;
+    int i, n;
     
     fst = calloc(1, sizeof(*fst));
-    fst->logfd = -1;
+    fst->dir = strdup(dir);
+    fst->flags = flags;
     fst->idxfd = -1;
+    fst->lockfd = -1;
+    fst->usersfd = -1;
+    pthread_mutex_init(&fst->seglock, NULL);
     
-    snprintf(tbuf, sizeof(tbuf), "%s/log", dir);
-    if((fst->logfd = open(tbuf, O_RDWR | O_LARGEFILE)) < 0) {
-	flog(LOG_ERR, "could not open log %s: %s", tbuf, strerror(errno));
-	release(fst);
-	return(NULL);
+    snprintf(tbuf, sizeof(tbuf), "%s/users", dir);
+    if((fst->usersfd = open(tbuf, O_RDWR | O_CREAT, 0600)) < 0) {
+	flog(LOG_WARNING, "could not open %s, the store cannot be used exclusively: %s", tbuf, strerror(errno));
+    } else {
+	while(flock(fst->usersfd, LOCK_SH)) {
+	    if(errno != EINTR) {
+		flog(LOG_ERR, "could not lock %s: %s", tbuf, strerror(errno));
+		release(fst);
+		return(NULL);
+	    }
+	}
     }
-    if(fstat64(fst->logfd, &sb)) {
-	flog(LOG_ERR, "could not stat log: %s", strerror(errno));
+    snprintf(tbuf, sizeof(tbuf), "%s/lock", dir);
+    if((fst->lockfd = open(tbuf, O_RDWR | O_CREAT, 0600)) < 0)
+	flog(LOG_WARNING, "could not open %s, other processes must not write to the store: %s", tbuf, strerror(errno));
+    /*
+     * The store is opened under the append lock, lest the index be
+     * read halfway through another process's append. Recovery must
+     * not run under another process's feet either, nor find a bulk
+     * marker not yet locked by its load.
+     */
+    if(lockstore(fst)) {
 	release(fst);
 	return(NULL);
     }
-    fst->logsize = sb.st_size;
-    if(readall(fst->logfd, &lh, sizeof(lh), 0)) {
-	flog(LOG_ERR, "could not read log header: %s", strerror(errno));
-	release(fst);
-	return(NULL);
+    
+    snprintf(tbuf, sizeof(tbuf), "%s/%s", dir, MOVEFILE);
+    if(!access(tbuf, F_OK)) {
+	flog(LOG_WARNING, "finishing interrupted move of a store into %s", dir);
+	if(finishmove(dir)) {
+	    release(fst);
+	    return(NULL);
+	}
     }
-    if(memcmp(lh.magic, LOGMAGIC, sizeof(LOGMAGIC))) {
-	flog(LOG_ERR, "invalid log magic");
+    for(n = 0; ; n++) {
+	segname(dir, n, tbuf, sizeof(tbuf));
+	if(access(tbuf, F_OK))
+	    break;
+    }
+    if(n == 0) {
+	flog(LOG_ERR, "could not open log in %s: %s", dir, strerror(errno));
 	release(fst);
 	return(NULL);
     }
+    for(i = 0; i < n; i++) {
+	if(openseg(fst, i < n - 1)) {
+	    release(fst);
+	    return(NULL);
+	}
+    }
     
-    snprintf(tbuf, sizeof(tbuf), "%s/index", dir);
-    if((fst->idxfd = open(tbuf, O_RDWR | O_LARGEFILE)) < 0) {
-	flog(LOG_ERR, "could not open index %s: %s", tbuf, strerror(errno));
+    if((n = stalebulk(dir, 0)) < 0) {
 	release(fst);
 	return(NULL);
     }
-    if(fstat64(fst->idxfd, &sb)) {
-	flog(LOG_ERR, "could not stat index: %s", strerror(errno));
-	release(fst);
-	return(NULL);
+    if(n > 0) {
+	if(!(flags & FST_RECOVER)) {
+	    flog(LOG_ERR, "%s has an interrupted bulk index load", dir);
+	    release(fst);
+	    return(NULL);
+	}
+	flog(LOG_WARNING, "rebuilding index of %s after interrupted bulk load", dir);
+	flags |= FST_REINDEX;
     }
-    if(readall(fst->idxfd, &ih, sizeof(ih), 0)) {
-	flog(LOG_ERR, "could not read index header: %s", strerror(errno));
-	release(fst);
-	return(NULL);
+    if(flags & FST_REINDEX) {
+	if(rebuildindex(fst)) {
+	    release(fst);
+	    return(NULL);
+	}
+	if(n > 0)
+	    stalebulk(dir, 1);
+    } else if(openindex(fst)) {
+	if(!(flags & FST_RECOVER)) {
+	    release(fst);
+	    return(NULL);
+	}
+	flog(LOG_WARNING, "rebuilding index of %s from log", dir);
+	if(rebuildindex(fst)) {
+	    release(fst);
+	    return(NULL);
+	}
+    } else if(flags & FST_RECOVER) {
+	if(recovertail(fst)) {
+	    release(fst);
+	    return(NULL);
+	}
     }
-    if(memcmp(ih.magic, IDXMAGIC, sizeof(IDXMAGIC))) {
-	flog(LOG_ERR, "invalid index magic");
-	release(fst);
-	return(NULL);
+    
+    if(flags & FST_URING) {
+	if((fst->ring = newuring(URINGDEPTH)) == NULL)
+	    flog(LOG_WARNING, "could not set up io_uring for %s, using blocking I/O: %s", dir, strerror(errno));
     }
-    if(sb.st_size != (sizeof(struct idxhdr) + ih.size * sizeof(struct idxent))) {
-	flog(LOG_ERR, "invalid index size");
-	release(fst);
-	return(NULL);
+    if(flags & FST_SCRUB) {
+	if(pthread_create(&fst->scrubth, NULL, (void *(*)(void *))scrubworker, fst))
+	    flog(LOG_WARNING, "could not start scrubbing %s: %s", dir, strerror(errno));
+	else
+	    fst->scrubbing = 1;
     }
-    fst->idxsize = ih.size;
+    if(fst->locks > 0)
+	unlockstore(fst);
     
     st = newstore(&fstops);
     st->pdata = fst;
     return(st);
 }
 
+/*
+ * Makes sure that no other process has the store open, and keeps
+ * any from opening it or appending to it until it is released.
+ * Fails with EBUSY if the store is in use.
+ */
+int fstoreexclusive(struct store *st)
+{
+    struct fstore *fst;
+    
+    fst = st->pdata;
+    if(fst->usersfd < 0) {
+	errno = EBADF;
+	return(-1);
+    }
+    if(flock(fst->usersfd, LOCK_EX | LOCK_NB)) {
+	if(errno == EWOULDBLOCK)
+	    errno = EBUSY;
+	return(-1);
+    }
+    /* Held until the store is released */
+    return(lockstore(fst));
+}
+
 int mkfstore(char *dir)
 {
     char tbuf[1024];
     int fd;
-    struct loghdr lh;
     struct idxhdr ih;
     
     if(access(dir, F_OK)) {
@@ -330,17 +2629,9 @@ int mkfstore(char *dir)
 	}
     }
     
-    snprintf(tbuf, sizeof(tbuf), "%s/log", dir);
-    if((fd = open(tbuf, O_WRONLY | O_CREAT | O_EXCL, 0600)) < 0) {
-	flog(LOG_ERR, "could not create log %s: %s", tbuf, strerror(errno));
-	return(-1);
-    }
-    memcpy(lh.magic, LOGMAGIC, sizeof(LOGMAGIC));
-    if(writeall(fd, &lh, sizeof(lh), 0)) {
-	flog(LOG_ERR, "could not write log header: %s", strerror(errno));
-	close(fd);
+    segname(dir, 0, tbuf, sizeof(tbuf));
+    if((fd = mkseg(tbuf)) < 0)
 	return(-1);
-    }
     close(fd);
     
     snprintf(tbuf, sizeof(tbuf), "%s/index", dir);
@@ -358,3 +2649,76 @@ int mkfstore(char *dir)
     close(fd);
     return(0);
 }
+
+/*
+ * Removes the store in dir, which must not be in use, such as one
+ * left behind by an interrupted vcgc or migration. Only the files a
+ * filestore consists of are removed, so that the directory itself is
+ * left alone if it holds anything else.
+ */
+int rmfstore(char *dir)
+{
+    DIR *d;
+    struct dirent *de;
+    char tbuf[1024];
+    
+    if((d = opendir(dir)) == NULL)
+	return((errno == ENOENT)?0:-1);
+    while((de = readdir(d)) != NULL) {
+	if(strncmp(de->d_name, "log", 3) && strncmp(de->d_name, "index", 5) &&
+	   strncmp(de->d_name, "bulk", 4) && strcmp(de->d_name, "lock") && strcmp(de->d_name, "users"))
+	    continue;
+	snprintf(tbuf, sizeof(tbuf), "%s/%s", dir, de->d_name);
+	unlink(tbuf);
+    }
+    closedir(d);
+    if(rmdir(dir)) {
+	flog(LOG_ERR, "could not remove %s: %s", dir, strerror(errno));
+	return(-1);
+    }
+    return(0);
+}
+
+/*
+ * Moves the store in the directory from over the one in to, which
+ * must not be in use. Any surplus log segments of the old store are
+ * removed. The move is recorded in the MOVEFILE of to before
+ * anything is renamed, and if it is interrupted, the next
+ * openfstore() of to finishes it, so that the segments and index of
+ * the two stores are never left mixed.
+ */
+int mvfstore(char *from, char *to)
+{
+    char fbuf[1024], tbuf[1024], *rel;
+    size_t tl;
+    FILE *mf;
+    int n;
+    
+    for(n = 0; ; n++) {
+	segname(from, n, fbuf, sizeof(fbuf));
+	if(access(fbuf, F_OK))
+	    break;
+    }
+    rel = from;
+    tl = strlen(to);
+    if(!strncmp(from, to, tl) && (from[tl] == '/'))
+	rel = from + tl + 1;
+    snprintf(tbuf, sizeof(tbuf), "%s/%s.new", to, MOVEFILE);
+    if((mf = fopen(tbuf, "w")) == NULL) {
+	flog(LOG_ERR, "could not create %s: %s", tbuf, strerror(errno));
+	return(-1);
+    }
+    fprintf(mf, "%d\n%s\n", n, rel);
+    if(fflush(mf) || fsync(fileno(mf)) || fclose(mf)) {
+	flog(LOG_ERR, "could not write %s: %s", tbuf, strerror(errno));
+	unlink(tbuf);
+	return(-1);
+    }
+    snprintf(fbuf, sizeof(fbuf), "%s/%s", to, MOVEFILE);
+    if(rename(tbuf, fbuf)) {
+	flog(LOG_ERR, "could not move %s to %s: %s", tbuf, fbuf, strerror(errno));
+	unlink(tbuf);
+	return(-1);
+    }
+    return(finishmove(to));
+}
@@ -0,0 +1,145 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <gcrypt.h>
+#include "store.h"
+
+/*
+ * A store that keeps all blocks in memory, for tests and scratch
+ * filesystems. Nothing is ever written anywhere, and everything is
+ * lost when the store is released.
+ */
+
+#define min(a, b) (((b) < (a))?(b):(a))
+
+struct memblock {
+    struct memblock *next;
+    struct addr a;
+    void *data;
+    size_t len;
+};
+
+struct mstore {
+    struct memblock **tab;
+    size_t n, sz;
+};
+
+static size_t mhash(struct mstore *ms, struct addr *a)
+{
+    size_t h;
+    
+    memcpy(&h, a->hash, sizeof(h));
+    return(h & (ms->sz - 1));
+}
+
+static struct memblock *mfind(struct mstore *ms, struct addr *a)
+{
+    struct memblock *b;
+    
+    for(b = ms->tab[mhash(ms, a)]; b != NULL; b = b->next) {
+	if(!addrcmp(&b->a, a))
+	    return(b);
+    }
+    return(NULL);
+}
+
+static void mgrow(struct mstore *ms)
+{
+    struct memblock **old, *b, *next;
+    size_t i, osz, h;
+    
+    old = ms->tab;
+    osz = ms->sz;
+    ms->sz = osz * 2;
+    ms->tab = calloc(ms->sz, sizeof(*ms->tab));
+    for(i = 0; i < osz; i++) {
+	for(b = old[i]; b != NULL; b = next) {
+	    next = b->next;
+	    h = mhash(ms, &b->a);
+	    b->next = ms->tab[h];
+	    ms->tab[h] = b;
+	}
+    }
+    free(old);
+}
+
+static int put(struct store *st, const void *buf, size_t len, struct addr *at)
+{
+    struct mstore *ms;
+    struct memblock *b;
+    size_t h;
+    
+    ms = st->pdata;
+    if(len > STORE_MAXBLSZ) {
+	errno = E2BIG;
+	return(-1);
+    }
+    gcry_md_hash_buffer(GCRY_MD_SHA256, at->hash, buf, len);
+    if(mfind(ms, at) != NULL)
+	return(0);
+    if(ms->n >= ms->sz)
+	mgrow(ms);
+    b = malloc(sizeof(*b));
+    b->a = *at;
+    b->len = len;
+    b->data = memcpy(malloc(len ? len : 1), buf, len);
+    h = mhash(ms, at);
+    b->next = ms->tab[h];
+    ms->tab[h] = b;
+    ms->n++;
+    return(0);
+}
+
+static ssize_t get(struct store *st, void *buf, size_t len, struct addr *at)
+{
+    struct memblock *b;
+    
+    if((b = mfind(st->pdata, at)) == NULL) {
+	errno = ENOENT;
+	return(-1);
+    }
+    if(buf != NULL)
+	memcpy(buf, b->data, min(len, b->len));
+    return(b->len);
+}
+
+static int release(struct store *st)
+{
+    struct mstore *ms;
+    struct memblock *b, *next;
+    size_t i;
+    
+    ms = st->pdata;
+    for(i = 0; i < ms->sz; i++) {
+	for(b = ms->tab[i]; b != NULL; b = next) {
+	    next = b->next;
+	    free(b->data);
+	    free(b);
+	}
+    }
+    free(ms->tab);
+    free(ms);
+    return(0);
+}
+
+static struct storeops ops = {
+    .put = put,
+    .get = get,
+    .release = release,
+};
+
+struct store *newmemstore(void)
+{
+    struct store *st;
+    struct mstore *ms;
+    
+    ms = malloc(sizeof(*ms));
+    ms->n = 0;
+    ms->sz = 1024;
+    ms->tab = calloc(ms->sz, sizeof(*ms->tab));
+    st = newstore(&ops);
+    /* Caching would only duplicate the blocks */
+    storenocache(st);
+    st->pdata = ms;
+    return(st);
+}
@@ -0,0 +1,652 @@
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include "store.h"
+#include "log.h"
+
+/*
+ * A mirrored store keeps a copy of every block in each of a number of
+ * filestores, which would normally be on disks of their own. The
+ * replica directories are listed, one per line, in the file "mirrors"
+ * in the store directory; relative paths are relative to the store
+ * directory. Each replica is served by a worker thread of its own.
+ *
+ * Puts go to all replicas in parallel, and fail if any of them fails.
+ * A get goes to the replica with the fewest jobs outstanding, and if
+ * it has not answered within MIRHEDGE milliseconds, to the next one
+ * as well, the first answer being used. A replica that fails a get is
+ * replaced by the next one. When a replica turns out to hold a
+ * corrupt copy of a block, or to lack a block that another one has,
+ * it is repaired from the good copy.
+ */
+
+#define MIRHEDGE 20
+
+#define min(a, b) (((b) < (a))?(b):(a))
+
+/*
+ * A job on one replica. The result of a get is read into buffers of
+ * the job's own, since a hedged job may finish after the caller has
+ * returned.
+ */
+struct mirjob {
+    struct mirjob *next, *qnext;
+    struct mirreq *rq;
+    int r;
+    char *data;
+    void **bufs;
+    ssize_t *szs;
+    int done, ret, err;
+};
+
+/* A put or get of n blocks, freed when its caller and all jobs are done */
+struct mirreq {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int refs, n;
+    const void **bufs;
+    size_t *lens;
+    struct addr *ats;
+    struct mirjob *jobs;
+};
+
+struct replica {
+    struct store *st;
+    pthread_t th;
+    /* Protects the job queue */
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct mirjob *queue, **lqueue;
+    /* Serializes all use of st */
+    pthread_mutex_t stlock;
+    volatile int load;
+    int running, stop;
+};
+
+struct mirstore {
+    struct replica *reps;
+    int n;
+    volatile unsigned int next;
+};
+
+static struct mirreq *newreq(const void **bufs, const size_t *lens, struct addr *ats, int n)
+{
+    struct mirreq *rq;
+    
+    rq = calloc(1, sizeof(*rq));
+    pthread_mutex_init(&rq->lock, NULL);
+    pthread_cond_init(&rq->cond, NULL);
+    rq->refs = 1;
+    rq->n = n;
+    rq->bufs = bufs;
+    rq->lens = memcpy(malloc(sizeof(*rq->lens) * n), lens, sizeof(*rq->lens) * n);
+    rq->ats = memcpy(malloc(sizeof(*rq->ats) * n), ats, sizeof(*rq->ats) * n);
+    return(rq);
+}
+
+static void freereq(struct mirreq *rq)
+{
+    struct mirjob *job;
+    
+    while((job = rq->jobs) != NULL) {
+	rq->jobs = job->next;
+	if(job->data != NULL)
+	    free(job->data);
+	if(job->bufs != NULL)
+	    free(job->bufs);
+	if(job->szs != NULL)
+	    free(job->szs);
+	free(job);
+    }
+    free(rq->lens);
+    free(rq->ats);
+    pthread_mutex_destroy(&rq->lock);
+    pthread_cond_destroy(&rq->cond);
+    free(rq);
+}
+
+static void putreq(struct mirreq *rq)
+{
+    int last;
+    
+    pthread_mutex_lock(&rq->lock);
+    last = --rq->refs == 0;
+    pthread_mutex_unlock(&rq->lock);
+    if(last)
+	freereq(rq);
+}
+
+static void runjob(struct replica *rp, struct mirjob *job)
+{
+    struct mirreq *rq;
+    int ret, err;
+    
+    rq = job->rq;
+    pthread_mutex_lock(&rp->stlock);
+    if(job->bufs == NULL)
+	ret = fstoreputhashed(rp->st, rq->bufs, rq->lens, rq->ats, rq->n);
+    else
+	ret = storegetmany(rp->st, job->bufs, rq->lens, rq->ats, job->szs, rq->n);
+    err = errno;
+    pthread_mutex_unlock(&rp->stlock);
+    pthread_mutex_lock(&rq->lock);
+    job->ret = ret;
+    job->err = err;
+    job->done = 1;
+    pthread_cond_broadcast(&rq->cond);
+    pthread_mutex_unlock(&rq->lock);
+    putreq(rq);
+}
+
+static void *mirworker(struct replica *rp)
+{
+    struct mirjob *job;
+    
+    pthread_mutex_lock(&rp->lock);
+    while(1) {
+	while((rp->queue == NULL) && !rp->stop)
+	    pthread_cond_wait(&rp->cond, &rp->lock);
+	if((job = rp->queue) == NULL)
+	    break;
+	if((rp->queue = job->qnext) == NULL)
+	    rp->lqueue = &rp->queue;
+	pthread_mutex_unlock(&rp->lock);
+	runjob(rp, job);
+	pthread_mutex_lock(&rp->lock);
+	rp->load--;
+    }
+    pthread_mutex_unlock(&rp->lock);
+    return(NULL);
+}
+
+/* Queues a job for the request on replica r. Called with rq->lock held. */
+static void addjob(struct mirstore *ms, struct mirreq *rq, int r, int get)
+{
+    struct replica *rp;
+    struct mirjob *job;
+    size_t tot;
+    int i;
+    
+    job = calloc(1, sizeof(*job));
+    job->rq = rq;
+    job->r = r;
+    if(get) {
+	for(i = 0, tot = 0; i < rq->n; i++)
+	    tot += rq->lens[i];
+	job->data = malloc(tot + 1);
+	job->bufs = malloc(sizeof(*job->bufs) * rq->n);
+	job->szs = malloc(sizeof(*job->szs) * rq->n);
+	for(i = 0, tot = 0; i < rq->n; i++) {
+	    job->bufs[i] = (rq->lens[i] > 0)?(job->data + tot):NULL;
+	    tot += rq->lens[i];
+	}
+    }
+    job->next = rq->jobs;
+    rq->jobs = job;
+    rq->refs++;
+    rp = &ms->reps[r];
+    pthread_mutex_lock(&rp->lock);
+    *rp->lqueue = job;
+    rp->lqueue = &job->qnext;
+    rp->load++;
+    pthread_cond_signal(&rp->cond);
+    pthread_mutex_unlock(&rp->lock);
+}
+
+/* Picks the least loaded replica not yet tried, or -1 if none is left. */
+static int pickrep(struct mirstore *ms, int *tried)
+{
+    int i, r, best;
+    
+    best = -1;
+    for(i = 0; i < ms->n; i++) {
+	r = (ms->next + i) % ms->n;
+	if(!tried[r] && ((best < 0) || (ms->reps[r].load < ms->reps[best].load)))
+	    best = r;
+    }
+    if(best >= 0) {
+	tried[best] = 1;
+	ms->next++;
+    }
+    return(best);
+}
+
+static void repair(struct mirstore *ms, int r, const void *buf, size_t len, struct addr *a)
+{
+    struct replica *rp;
+    
+    rp = &ms->reps[r];
+    pthread_mutex_lock(&rp->stlock);
+    if(fstorerepair(rp->st, buf, len, a))
+	flog(LOG_ERR, "could not repair block %s in mirror %i: %s", formataddr(a), r, strerror(errno));
+    pthread_mutex_unlock(&rp->stlock);
+}
+
+/*
+ * Checks the blocks read in full by a get against replica r, which
+ * failed it, and repairs the ones it cannot read.
+ */
+static void checkfailed(struct mirstore *ms, int r, void **bufs, const size_t *lens, struct addr *ats, ssize_t *szs, int n)
+{
+    struct replica *rp;
+    char *tmp;
+    ssize_t sz;
+    int i;
+    
+    rp = &ms->reps[r];
+    tmp = malloc(STORE_MAXBLSZ);
+    for(i = 0; i < n; i++) {
+	if((bufs[i] == NULL) || (szs[i] < 0) || (szs[i] > lens[i]))
+	    continue;
+	pthread_mutex_lock(&rp->stlock);
+	sz = storeget(rp->st, tmp, STORE_MAXBLSZ, &ats[i]);
+	pthread_mutex_unlock(&rp->stlock);
+	if((sz < 0) && (errno != ENOENT))
+	    repair(ms, r, bufs[i], szs[i], &ats[i]);
+    }
+    free(tmp);
+}
+
+/*
+ * Looks for the blocks that replica r lacked in the other replicas,
+ * one at a time, putting those found into the replicas that lacked
+ * them.
+ */
+static int findmissing(struct mirstore *ms, int r, void **bufs, const size_t *lens, struct addr *ats, ssize_t *szs, int n)
+{
+    struct replica *rp;
+    int *mi, *lacking, nl, i, m, k, o;
+    void **mbufs;
+    size_t *mlens;
+    struct addr *mats;
+    ssize_t *mszs;
+    int ret;
+    
+    for(i = 0, m = 0; i < n; i++) {
+	if(szs[i] < 0)
+	    m++;
+    }
+    if((m == 0) || (ms->n < 2))
+	return(0);
+    mi = malloc(sizeof(*mi) * m);
+    mbufs = malloc(sizeof(*mbufs) * m);
+    mlens = malloc(sizeof(*mlens) * m);
+    mats = malloc(sizeof(*mats) * m);
+    mszs = malloc(sizeof(*mszs) * m);
+    lacking = malloc(sizeof(*lacking) * ms->n);
+    lacking[0] = r;
+    nl = 1;
+    ret = 0;
+    for(o = 1; (o < ms->n) && (m > 0); o++) {
+	for(i = 0, m = 0; i < n; i++) {
+	    if(szs[i] >= 0)
+		continue;
+	    mi[m] = i;
+	    mbufs[m] = bufs[i];
+	    mlens[m] = lens[i];
+	    mats[m++] = ats[i];
+	}
+	rp = &ms->reps[(r + o) % ms->n];
+	pthread_mutex_lock(&rp->stlock);
+	ret = storegetmany(rp->st, mbufs, mlens, mats, mszs, m);
+	pthread_mutex_unlock(&rp->stlock);
+	if(ret)
+	    break;
+	for(i = 0; i < m; i++) {
+	    if((szs[mi[i]] = mszs[i]) < 0)
+		continue;
+	    if((mbufs[i] == NULL) || (mszs[i] > mlens[i]))
+		continue;
+	    for(k = 0; k < nl; k++)
+		repair(ms, lacking[k], mbufs[i], mszs[i], &mats[i]);
+	}
+	lacking[nl++] = (r + o) % ms->n;
+    }
+    free(mi);
+    free(mbufs);
+    free(mlens);
+    free(mats);
+    free(mszs);
+    free(lacking);
+    return(ret);
+}
+
+static void deadline(struct timespec *ts)
+{
+    clock_gettime(CLOCK_REALTIME, ts);
+    ts->tv_nsec += MIRHEDGE * 1000000L;
+    if(ts->tv_nsec >= 1000000000L) {
+	ts->tv_sec++;
+	ts->tv_nsec -= 1000000000L;
+    }
+}
+
+static int mirget(struct mirstore *ms, void **bufs, const size_t *lens, struct addr *ats, ssize_t *szs, int n)
+{
+    struct mirreq *rq;
+    struct mirjob *job, *win;
+    struct timespec ts;
+    size_t *glens;
+    int *tried, *failed;
+    int i, r, pend, hedged, expired, err;
+    
+    glens = malloc(sizeof(*glens) * n);
+    for(i = 0; i < n; i++)
+	glens[i] = (bufs[i] == NULL)?0:min(lens[i], STORE_MAXBLSZ);
+    rq = newreq(NULL, glens, ats, n);
+    free(glens);
+    tried = calloc(ms->n, sizeof(*tried));
+    failed = calloc(ms->n, sizeof(*failed));
+    err = EIO;
+    r = -1;
+    pthread_mutex_lock(&rq->lock);
+    addjob(ms, rq, pickrep(ms, tried), 1);
+    deadline(&ts);
+    hedged = expired = 0;
+    while(1) {
+	win = NULL;
+	for(job = rq->jobs, pend = 0; job != NULL; job = job->next) {
+	    if(!job->done) {
+		pend++;
+	    } else if(!job->ret) {
+		win = job;
+	    } else if(!failed[job->r]) {
+		failed[job->r] = 1;
+		err = job->err;
+	    }
+	}
+	if(win != NULL)
+	    break;
+	if((pend == 0) || (!hedged && expired)) {
+	    if((r = pickrep(ms, tried)) >= 0) {
+		addjob(ms, rq, r, 1);
+		if(pend > 0) {
+		    hedged = 1;
+		} else {
+		    deadline(&ts);
+		    expired = 0;
+		}
+		continue;
+	    }
+	    if(pend == 0)
+		break;
+	    hedged = 1;
+	}
+	if(hedged || expired)
+	    pthread_cond_wait(&rq->cond, &rq->lock);
+	else if(pthread_cond_timedwait(&rq->cond, &rq->lock, &ts) == ETIMEDOUT)
+	    expired = 1;
+    }
+    if(win != NULL) {
+	for(i = 0; i < n; i++) {
+	    if(((szs[i] = win->szs[i]) > 0) && (bufs[i] != NULL))
+		memcpy(bufs[i], win->bufs[i], min(szs[i], rq->lens[i]));
+	}
+	r = win->r;
+    }
+    pthread_mutex_unlock(&rq->lock);
+    putreq(rq);
+    if(win == NULL) {
+	free(tried);
+	free(failed);
+	errno = err;
+	return(-1);
+    }
+    for(i = 0; i < ms->n; i++) {
+	if(failed[i] && (i != r))
+	    checkfailed(ms, i, bufs, lens, ats, szs, n);
+    }
+    free(tried);
+    free(failed);
+    return(findmissing(ms, r, bufs, lens, ats, szs, n));
+}
+
+static int mirput(struct mirstore *ms, const void **bufs, const size_t *lens, struct addr *ats, int n)
+{
+    struct mirreq *rq;
+    struct mirjob *job;
+    int r, pend, err;
+    
+    rq = newreq(bufs, lens, ats, n);
+    pthread_mutex_lock(&rq->lock);
+    for(r = 0; r < ms->n; r++)
+	addjob(ms, rq, r, 0);
+    while(1) {
+	err = 0;
+	for(job = rq->jobs, pend = 0; job != NULL; job = job->next) {
+	    if(!job->done)
+		pend++;
+	    else if(job->ret)
+		err = job->err;
+	}
+	if(pend == 0)
+	    break;
+	pthread_cond_wait(&rq->cond, &rq->lock);
+    }
+    pthread_mutex_unlock(&rq->lock);
+    putreq(rq);
+    if(err) {
+	errno = err;
+	return(-1);
+    }
+    return(0);
+}
+
+static int put(struct store *st, const void *buf, size_t len, struct addr *at)
+{
+    if(len > STORE_MAXBLSZ) {
+	errno = E2BIG;
+	return(-1);
+    }
+    fstorehash(&buf, &len, at, 1);
+    return(mirput(st->pdata, &buf, &len, at, 1));
+}
+
+static ssize_t get(struct store *st, void *buf, size_t len, struct addr *at)
+{
+    ssize_t sz;
+    
+    if(mirget(st->pdata, &buf, &len, at, &sz, 1))
+	return(-1);
+    if(sz < 0) {
+	errno = ENOENT;
+	return(-1);
+    }
+    return(sz);
+}
+
+static int putmany(struct store *st, const void **bufs, const size_t *lens, struct addr *ats, int n)
+{
+    int i;
+    
+    for(i = 0; i < n; i++) {
+	if(lens[i] > STORE_MAXBLSZ) {
+	    errno = E2BIG;
+	    return(-1);
+	}
+    }
+    fstorehash(bufs, lens, ats, n);
+    return(mirput(st->pdata, bufs, lens, ats, n));
+}
+
+static int getmany(struct store *st, void **bufs, const size_t *lens, struct addr *ats, ssize_t *szs, int n)
+{
+    return(mirget(st->pdata, bufs, lens, ats, szs, n));
+}
+
+static int bulk(struct store *st, int on)
+{
+    struct mirstore *ms;
+    struct replica *rp;
+    int i, ret;
+    
+    ms = st->pdata;
+    ret = 0;
+    for(i = 0; i < ms->n; i++) {
+	rp = &ms->reps[i];
+	pthread_mutex_lock(&rp->stlock);
+	if(storebulk(rp->st, on))
+	    ret = -1;
+	pthread_mutex_unlock(&rp->stlock);
+    }
+    return(ret);
+}
+
+static void freereps(struct mirstore *ms)
+{
+    struct replica *rp;
+    int i;
+    
+    for(i = 0; i < ms->n; i++) {
+	rp = &ms->reps[i];
+	if(rp->running) {
+	    /* Hedged jobs left behind are run before the worker stops */
+	    pthread_mutex_lock(&rp->lock);
+	    rp->stop = 1;
+	    pthread_cond_signal(&rp->cond);
+	    pthread_mutex_unlock(&rp->lock);
+	    pthread_join(rp->th, NULL);
+	}
+	if(rp->st != NULL)
+	    releasestore(rp->st);
+	pthread_mutex_destroy(&rp->lock);
+	pthread_cond_destroy(&rp->cond);
+	pthread_mutex_destroy(&rp->stlock);
+    }
+    free(ms->reps);
+    free(ms);
+}
+
+static int release(struct store *st)
+{
+    freereps(st->pdata);
+    return(0);
+}
+
+static struct storeops ops = {
+    .put = put,
+    .get = get,
+    .release = release,
+    .bulk = bulk,
+    .putmany = putmany,
+    .getmany = getmany,
+};
+
+static void mirpath(char *dir, char *mirror, char *buf, size_t bufsize)
+{
+    if(mirror[0] == '/')
+	snprintf(buf, bufsize, "%s", mirror);
+    else
+	snprintf(buf, bufsize, "%s/%s", dir, mirror);
+}
+
+struct store *openmirstore(char *dir, int flags)
+{
+    struct store *st;
+    struct mirstore *ms;
+    struct replica *rp;
+    FILE *mf;
+    char tbuf[1024], line[1024], *p, **paths;
+    int i, n;
+    
+    snprintf(tbuf, sizeof(tbuf), "%s/mirrors", dir);
+    if((mf = fopen(tbuf, "r")) == NULL) {
+	flog(LOG_ERR, "could not open %s: %s", tbuf, strerror(errno));
+	return(NULL);
+    }
+    paths = NULL;
+    n = 0;
+    while(fgets(line, sizeof(line), mf) != NULL) {
+	if((p = strchr(line, '\n')) != NULL)
+	    *p = 0;
+	if(!line[0])
+	    continue;
+	paths = realloc(paths, sizeof(*paths) * (n + 1));
+	paths[n++] = strdup(line);
+    }
+    fclose(mf);
+    if(n == 0) {
+	flog(LOG_ERR, "mirrored store %s has no mirrors", dir);
+	errno = EINVAL;
+	return(NULL);
+    }
+    ms = calloc(1, sizeof(*ms));
+    ms->reps = calloc(n, sizeof(*ms->reps));
+    ms->n = n;
+    for(i = 0; i < n; i++) {
+	rp = &ms->reps[i];
+	pthread_mutex_init(&rp->lock, NULL);
+	pthread_cond_init(&rp->cond, NULL);
+	pthread_mutex_init(&rp->stlock, NULL);
+	rp->lqueue = &rp->queue;
+    }
+    for(i = 0; i < n; i++) {
+	mirpath(dir, paths[i], tbuf, sizeof(tbuf));
+	if((ms->reps[i].st = openfstore(tbuf, flags)) == NULL)
+	    break;
+	/* The replicas are only reached through this store's cache */
+	storenocache(ms->reps[i].st);
+    }
+    for(i = 0; i < n; i++)
+	free(paths[i]);
+    free(paths);
+    for(i = 0; i < n; i++) {
+	rp = &ms->reps[i];
+	if(rp->st == NULL) {
+	    freereps(ms);
+	    return(NULL);
+	}
+	if(pthread_create(&rp->th, NULL, (void *(*)(void *))mirworker, rp)) {
+	    flog(LOG_ERR, "could not start mirror worker: %s", strerror(errno));
+	    freereps(ms);
+	    return(NULL);
+	}
+	rp->running = 1;
+    }
+    
+    st = newstore(&ops);
+    st->pdata = ms;
+    return(st);
+}
+
+/*
+ * Creates a mirrored store in dir over the given replica directories,
+ * creating a filestore in each of them.
+ */
+int mkmirstore(char *dir, char **mirrors, int n)
+{
+    char tbuf[1024];
+    FILE *mf;
+    int i, fd;
+    
+    if(access(dir, F_OK)) {
+	if(mkdir(dir, 0700)) {
+	    flog(LOG_ERR, "could not create %s: %s", dir, strerror(errno));
+	    return(-1);
+	}
+    }
+    for(i = 0; i < n; i++) {
+	mirpath(dir, mirrors[i], tbuf, sizeof(tbuf));
+	if(mkfstore(tbuf))
+	    return(-1);
+    }
+    snprintf(tbuf, sizeof(tbuf), "%s/mirrors", dir);
+    if(((fd = open(tbuf, O_WRONLY | O_CREAT | O_EXCL, 0600)) < 0) || ((mf = fdopen(fd, "w")) == NULL)) {
+	flog(LOG_ERR, "could not create %s: %s", tbuf, strerror(errno));
+	return(-1);
+    }
+    for(i = 0; i < n; i++)
+	fprintf(mf, "%s\n", mirrors[i]);
+    if(fclose(mf)) {
+	flog(LOG_ERR, "could not write %s: %s", tbuf, strerror(errno));
+	return(-1);
+    }
+    return(0);
+}
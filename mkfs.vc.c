@@ -23,12 +23,17 @@ int main(int argc, char **argv)
     char tbuf[1024];
     
     if(argc < 2) {
-	fprintf(stderr, "usage; mkfs.vc DIR\n");
+	fprintf(stderr, "usage; mkfs.vc DIR [SHARDDIR...]\n");
 	exit(1);
     }
-    if(mkfstore(argv[1]))
-	exit(1);
-    if((st = newfstore(argv[1])) == NULL)
+    if(argc > 2) {
+	if(mkshstore(argv[1], argv + 2, argc - 2))
+	    exit(1);
+    } else {
+	if(mkfstore(argv[1]))
+	    exit(1);
+    }
+    if((st = openstore(argv[1], 0)) == NULL)
 	exit(1);
     
     now = time(NULL);
@@ -44,6 +49,7 @@ int main(int argc, char **argv)
     root.links = 2;
     root.data.d = 0;
     root.xattr.d = 0;
+    root.chunks.d = 0;
     strcpy(dots.name, ".");
     if(btput(st, &root.data, 0, &dots, sizeof(dots) - sizeof(dots.name) + 2, DIRBLSIZE)) {
 	fprintf(stderr, "mkfs.vc: could not create root directory entries: %s\n", strerror(errno));
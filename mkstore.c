@@ -1,15 +1,53 @@
 #include <stdlib.h>
+#include <unistd.h>
 #include <stdio.h>
 
 #include "store.h"
 
+static void usage(FILE *out)
+{
+    fprintf(out, "usage: mkstore [-h] DIR [SHARDDIR...]\n");
+    fprintf(out, "       mkstore -m DIR MIRRORDIR...\n");
+    fprintf(out, "       mkstore -t DIR FASTDIR SLOWDIR\n");
+}
+
 int main(int argc, char **argv)
 {
-    if(argc < 2) {
-	fprintf(stderr, "usage: mkstore DIR\n");
-	exit(1);
+    int c, tiered, mirrored;
+    
+    tiered = mirrored = 0;
+    while((c = getopt(argc, argv, "htm")) >= 0) {
+	switch(c) {
+	case 't':
+	    tiered = 1;
+	    break;
+	case 'm':
+	    mirrored = 1;
+	    break;
+	case 'h':
+	    usage(stdout);
+	    exit(0);
+	default:
+	    usage(stderr);
+	    exit(1);
+	}
     }
-    if(mkfstore(argv[1]))
+    if((argc - optind < 1) || (tiered && (argc - optind != 3)) || (mirrored && (argc - optind < 2))) {
+	usage(stderr);
 	exit(1);
+    }
+    if(tiered) {
+	if(mktierstore(argv[optind], argv[optind + 1], argv[optind + 2]))
+	    exit(1);
+    } else if(mirrored) {
+	if(mkmirstore(argv[optind], argv + optind + 1, argc - optind - 1))
+	    exit(1);
+    } else if(argc - optind > 1) {
+	if(mkshstore(argv[optind], argv + optind + 1, argc - optind - 1))
+	    exit(1);
+    } else {
+	if(mkfstore(argv[optind]))
+	    exit(1);
+    }
     return(0);
 }
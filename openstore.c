@@ -0,0 +1,31 @@
+#include <stdio.h>
+#include <unistd.h>
+#include "store.h"
+#include "storeproto.h"
+
+/*
+ * Opens the store in dir, whichever kind it is. If a storesrv is
+ * serving it, the store is reached through the server. Otherwise, it
+ * is a tiered store if it has a "tiers" file, a sharded store if it
+ * has a "shards" file, a mirrored store if it has a "mirrors" file,
+ * and a plain filestore otherwise.
+ */
+struct store *openstore(char *dir, int flags)
+{
+    struct store *st;
+    char tbuf[1024];
+    
+    snprintf(tbuf, sizeof(tbuf), "%s/%s", dir, SP_SOCKNAME);
+    if(!access(tbuf, F_OK) && ((st = opensockstore(tbuf)) != NULL))
+	return(st);
+    snprintf(tbuf, sizeof(tbuf), "%s/tiers", dir);
+    if(!access(tbuf, F_OK))
+	return(opentierstore(dir, flags));
+    snprintf(tbuf, sizeof(tbuf), "%s/shards", dir);
+    if(!access(tbuf, F_OK))
+	return(openshstore(dir, flags));
+    snprintf(tbuf, sizeof(tbuf), "%s/mirrors", dir);
+    if(!access(tbuf, F_OK))
+	return(openmirstore(dir, flags));
+    return(openfstore(dir, flags));
+}
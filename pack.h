@@ -0,0 +1,31 @@
+#ifndef _PACK_H
+#define _PACK_H
+
+#include <sys/types.h>
+#include "store.h"
+#include "vcfs.h"
+
+/*
+ * A pack holds the blocks of a revision that are not reachable from
+ * a base revision, or all of them if there is none, as written by
+ * vcpack and read by vcunpack. It starts with a packhdr, which is
+ * followed by the blocks, each as a packrec followed by len bytes of
+ * data, with parents before their children. A packrec with a nil
+ * address ends the blocks, and is followed by the revrec of the
+ * packed revision. Integers are in host byte order.
+ */
+
+#define PACK_MAGIC "vcpack1\n"
+
+struct packhdr {
+    char magic[8];
+    /* The root of the base revision, or d = 0 if there is none */
+    struct revrec base;
+};
+
+struct packrec {
+    struct addr a;
+    u_int32_t len;
+};
+
+#endif
@@ -0,0 +1,228 @@
+#define _LARGEFILE64_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+
+#include "utils.h"
+#include "log.h"
+#include "revs.h"
+
+/*
+ * The revision database is mapped in chunks larger than the file
+ * itself, so that appending revisions only rarely needs a remap. Only
+ * records that actually exist in the file are ever touched through
+ * the map.
+ */
+#define REVMAPCHUNK (1 << 20)
+
+static int revmap(struct revdb *db)
+{
+    size_t sz;
+    void *map;
+    
+    sz = (db->n * sizeof(struct revrec) + REVMAPCHUNK) & ~(size_t)(REVMAPCHUNK - 1);
+    if((db->map != NULL) && (sz <= db->mapsz))
+	return(0);
+    if((map = mmap(NULL, sz, PROT_READ, MAP_SHARED, db->fd, 0)) == MAP_FAILED)
+	return(-1);
+    if(db->map != NULL)
+	munmap(db->map, db->mapsz);
+    db->map = map;
+    db->mapsz = sz;
+    return(0);
+}
+
+/*
+ * Picks up revisions that other processes have appended since the
+ * database was opened.
+ */
+static int revsync(struct revdb *db)
+{
+    struct stat64 sb;
+    vc_rev_t n;
+    
+    if(fstat64(db->fd, &sb))
+	return(-1);
+    if((n = sb.st_size / sizeof(struct revrec)) <= db->n)
+	return(0);
+    db->n = n;
+    if(revmap(db)) {
+	flog(LOG_CRIT, "could not remap revision database: %s", strerror(errno));
+	return(-1);
+    }
+    return(0);
+}
+
+struct revdb *openrevdb(char *dir, int wr)
+{
+    struct revdb *db;
+    char tbuf[1024];
+    struct stat64 sb;
+    
+    db = calloc(1, sizeof(*db));
+    db->wr = wr;
+    snprintf(tbuf, sizeof(tbuf), "%s/revs", dir);
+    if((db->fd = open(tbuf, (wr?O_RDWR:O_RDONLY) | O_LARGEFILE)) < 0) {
+	flog(LOG_ERR, "could not open revision database: %s", strerror(errno));
+	free(db);
+	return(NULL);
+    }
+    if(fstat64(db->fd, &sb)) {
+	flog(LOG_ERR, "could not stat revision database: %s", strerror(errno));
+	closerevdb(db);
+	return(NULL);
+    }
+    if((sb.st_size == 0) || (sb.st_size % sizeof(struct revrec) != 0)) {
+	flog(LOG_ERR, "revision database has illegal size");
+	closerevdb(db);
+	return(NULL);
+    }
+    db->n = sb.st_size / sizeof(struct revrec);
+    if(revmap(db)) {
+	flog(LOG_ERR, "could not map revision database: %s", strerror(errno));
+	closerevdb(db);
+	return(NULL);
+    }
+    return(db);
+}
+
+void closerevdb(struct revdb *db)
+{
+    if(db->map != NULL)
+	munmap(db->map, db->mapsz);
+    if(db->wr)
+	fsync(db->fd);
+    close(db->fd);
+    free(db);
+}
+
+int revget(struct revdb *db, vc_rev_t rev, struct revrec *rr)
+{
+    if((rev < 0) || (rev >= db->n) || (db->map[rev].root.d == 0)) {
+	errno = ENOENT;
+	return(-1);
+    }
+    *rr = db->map[rev];
+    return(0);
+}
+
+/*
+ * Marks a revision as no longer available, once the blocks it refers
+ * to may have been garbage collected. The record itself is kept with
+ * its commit time, so that revision numbers stay stable and
+ * revbytime() still works.
+ */
+int revexpunge(struct revdb *db, vc_rev_t rev)
+{
+    struct revrec rr;
+    
+    if((rev < 0) || (rev >= db->n)) {
+	errno = ENOENT;
+	return(-1);
+    }
+    rr = db->map[rev];
+    memset(&rr.root, 0, sizeof(rr.root));
+    return(writeall(db->fd, &rr, sizeof(rr), rev * sizeof(struct revrec)));
+}
+
+/*
+ * Returns the latest revision committed at or before t. Commit times
+ * are assumed to be non-decreasing through the file, which holds as
+ * long as the clock of the committing host doesn't step backwards.
+ */
+vc_rev_t revbytime(struct revdb *db, time_t t)
+{
+    vc_rev_t l, r, m;
+    
+    if(revsync(db))
+	return(-1);
+    l = 0;
+    r = db->n;
+    while(l < r) {
+	m = l + ((r - l) / 2);
+	if(db->map[m].ct <= t)
+	    l = m + 1;
+	else
+	    r = m;
+    }
+    if(l == 0) {
+	errno = ENOENT;
+	return(-1);
+    }
+    return(l - 1);
+}
+
+/*
+ * Appends under an exclusive lock on the file, at its actual end, so
+ * that concurrent committers each get their own revision number. The
+ * commit time is raised to that of the last revision if it is older,
+ * to keep revbytime() working.
+ */
+vc_rev_t revappend(struct revdb *db, struct revrec *rr)
+{
+    struct stat64 sb;
+    vc_rev_t rev;
+    
+    if(flock(db->fd, LOCK_EX))
+	return(-1);
+    if(fstat64(db->fd, &sb)) {
+	flock(db->fd, LOCK_UN);
+	return(-1);
+    }
+    rev = sb.st_size / sizeof(struct revrec);
+    if(rev > db->n) {
+	db->n = rev;
+	if(revmap(db)) {
+	    flock(db->fd, LOCK_UN);
+	    return(-1);
+	}
+    }
+    if((rev > 0) && (rr->ct < db->map[rev - 1].ct))
+	rr->ct = db->map[rev - 1].ct;
+    if(writeall(db->fd, rr, sizeof(*rr), rev * sizeof(struct revrec))) {
+	flock(db->fd, LOCK_UN);
+	return(-1);
+    }
+    flock(db->fd, LOCK_UN);
+    db->n = rev + 1;
+    if(revmap(db)) {
+	flog(LOG_CRIT, "could not remap revision database: %s", strerror(errno));
+	return(-1);
+    }
+    return(rev);
+}
+
+/*
+ * Parses a revision specification, which is either a revision
+ * number or "@T" for the latest revision as of the Unix time T.
+ */
+vc_rev_t parserev(struct revdb *db, const char *spec)
+{
+    long long v;
+    char *e;
+    
+    if(*spec == '@') {
+	v = strtoll(spec + 1, &e, 10);
+	if(!spec[1] || *e || (v < 0)) {
+	    errno = EINVAL;
+	    return(-1);
+	}
+	return(revbytime(db, v));
+    }
+    v = strtoll(spec, &e, 10);
+    if(!*spec || *e || (v < 0)) {
+	errno = EINVAL;
+	return(-1);
+    }
+    if((v >= db->n) && (revsync(db) || (v >= db->n))) {
+	errno = ENOENT;
+	return(-1);
+    }
+    return(v);
+}
@@ -0,0 +1,24 @@
+#ifndef _REVS_H
+#define _REVS_H
+
+#include <time.h>
+
+#include "vcfs.h"
+
+struct revdb {
+    int fd;
+    int wr;
+    struct revrec *map;
+    size_t mapsz;
+    vc_rev_t n;
+};
+
+struct revdb *openrevdb(char *dir, int wr);
+void closerevdb(struct revdb *db);
+int revget(struct revdb *db, vc_rev_t rev, struct revrec *rr);
+vc_rev_t revbytime(struct revdb *db, time_t t);
+vc_rev_t revappend(struct revdb *db, struct revrec *rr);
+int revexpunge(struct revdb *db, vc_rev_t rev);
+vc_rev_t parserev(struct revdb *db, const char *spec);
+
+#endif
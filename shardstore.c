@@ -0,0 +1,408 @@
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include "store.h"
+#include "log.h"
+
+/*
+ * A sharded store spreads blocks over a number of filestores, each
+ * of which would normally be on a disk of its own, by a prefix of
+ * their addresses. The shard directories are listed, one per line,
+ * in the file "shards" in the store directory; relative paths are
+ * relative to the store directory. Each shard is served by a worker
+ * thread of its own, so that the parts of a batched put or get that
+ * fall on different shards proceed in parallel. Single puts and gets
+ * are done by the calling thread, which only holds the lock of the
+ * one shard involved.
+ */
+
+#define SHARDOF(ss, a) (((((a)->hash[0]) << 8) | (a)->hash[1]) % (ss)->n)
+
+struct shbatch {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int left, err;
+};
+
+/* The part of a batch falling on one shard */
+struct shjob {
+    struct shjob *next;
+    struct shbatch *b;
+    int n;
+    const void **bufs;
+    void **rbufs;
+    size_t *lens;
+    struct addr *ats;
+    ssize_t *szs;
+    int *idx;
+};
+
+struct shard {
+    struct store *st;
+    pthread_t th;
+    /* Serializes all use of st, as well as the job queue */
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct shjob *jobs, **ljob;
+    int running, stop;
+};
+
+struct shstore {
+    struct shard *shards;
+    int n;
+};
+
+static int runjob(struct shard *sh, struct shjob *job)
+{
+    int i;
+    
+    if(job->rbufs == NULL)
+	return(fstoreputhashed(sh->st, job->bufs, job->lens, job->ats, job->n));
+    if(sh->st->ops->getmany != NULL)
+	return(sh->st->ops->getmany(sh->st, job->rbufs, job->lens, job->ats, job->szs, job->n));
+    for(i = 0; i < job->n; i++) {
+	if(((job->szs[i] = sh->st->ops->get(sh->st, job->rbufs[i], job->lens[i], &job->ats[i])) < 0) && (errno != ENOENT))
+	    return(-1);
+    }
+    return(0);
+}
+
+static void *shworker(struct shard *sh)
+{
+    struct shjob *job;
+    int ret, err;
+    
+    pthread_mutex_lock(&sh->lock);
+    while(1) {
+	while((sh->jobs == NULL) && !sh->stop)
+	    pthread_cond_wait(&sh->cond, &sh->lock);
+	if((job = sh->jobs) == NULL)
+	    break;
+	if((sh->jobs = job->next) == NULL)
+	    sh->ljob = &sh->jobs;
+	ret = runjob(sh, job);
+	err = errno;
+	pthread_mutex_lock(&job->b->lock);
+	if(ret && !job->b->err)
+	    job->b->err = err;
+	if(--job->b->left == 0)
+	    pthread_cond_signal(&job->b->cond);
+	pthread_mutex_unlock(&job->b->lock);
+    }
+    pthread_mutex_unlock(&sh->lock);
+    return(NULL);
+}
+
+/*
+ * Splits a batch of puts (rbufs == NULL) or gets by shard, and waits
+ * for the shard workers to carry out their parts. The addresses must
+ * be known beforehand in both cases.
+ */
+static int runbatch(struct shstore *ss, const void **bufs, void **rbufs, const size_t *lens, struct addr *ats, ssize_t *szs, int n)
+{
+    struct shjob *jobs, *job;
+    struct shbatch b;
+    struct shard *sh;
+    int *sel;
+    int i, k, s;
+    
+    jobs = calloc(ss->n, sizeof(*jobs));
+    sel = malloc(sizeof(*sel) * n);
+    for(i = 0; i < n; i++)
+	jobs[sel[i] = SHARDOF(ss, &ats[i])].n++;
+    pthread_mutex_init(&b.lock, NULL);
+    pthread_cond_init(&b.cond, NULL);
+    b.left = b.err = 0;
+    for(s = 0; s < ss->n; s++) {
+	job = &jobs[s];
+	if(job->n == 0)
+	    continue;
+	job->b = &b;
+	if(rbufs == NULL) {
+	    job->bufs = malloc(sizeof(*job->bufs) * job->n);
+	} else {
+	    job->rbufs = malloc(sizeof(*job->rbufs) * job->n);
+	    job->szs = malloc(sizeof(*job->szs) * job->n);
+	}
+	job->lens = malloc(sizeof(*job->lens) * job->n);
+	job->ats = malloc(sizeof(*job->ats) * job->n);
+	job->idx = malloc(sizeof(*job->idx) * job->n);
+	job->n = 0;
+	b.left++;
+    }
+    for(i = 0; i < n; i++) {
+	job = &jobs[sel[i]];
+	k = job->n++;
+	if(rbufs == NULL)
+	    job->bufs[k] = bufs[i];
+	else
+	    job->rbufs[k] = rbufs[i];
+	job->lens[k] = lens[i];
+	job->ats[k] = ats[i];
+	job->idx[k] = i;
+    }
+    for(s = 0; s < ss->n; s++) {
+	if(jobs[s].n == 0)
+	    continue;
+	sh = &ss->shards[s];
+	pthread_mutex_lock(&sh->lock);
+	*sh->ljob = &jobs[s];
+	sh->ljob = &jobs[s].next;
+	pthread_cond_signal(&sh->cond);
+	pthread_mutex_unlock(&sh->lock);
+    }
+    pthread_mutex_lock(&b.lock);
+    while(b.left > 0)
+	pthread_cond_wait(&b.cond, &b.lock);
+    pthread_mutex_unlock(&b.lock);
+    for(s = 0; s < ss->n; s++) {
+	job = &jobs[s];
+	if(job->n == 0)
+	    continue;
+	if(rbufs == NULL) {
+	    free(job->bufs);
+	} else {
+	    for(k = 0; k < job->n; k++)
+		szs[job->idx[k]] = job->szs[k];
+	    free(job->rbufs);
+	    free(job->szs);
+	}
+	free(job->lens);
+	free(job->ats);
+	free(job->idx);
+    }
+    free(jobs);
+    free(sel);
+    pthread_mutex_destroy(&b.lock);
+    pthread_cond_destroy(&b.cond);
+    if(b.err) {
+	errno = b.err;
+	return(-1);
+    }
+    return(0);
+}
+
+static int put(struct store *st, const void *buf, size_t len, struct addr *at)
+{
+    struct shstore *ss;
+    struct shard *sh;
+    int ret;
+    
+    ss = st->pdata;
+    if(len > STORE_MAXBLSZ) {
+	errno = E2BIG;
+	return(-1);
+    }
+    fstorehash(&buf, &len, at, 1);
+    sh = &ss->shards[SHARDOF(ss, at)];
+    pthread_mutex_lock(&sh->lock);
+    ret = fstoreputhashed(sh->st, &buf, &len, at, 1);
+    pthread_mutex_unlock(&sh->lock);
+    return(ret);
+}
+
+static ssize_t get(struct store *st, void *buf, size_t len, struct addr *at)
+{
+    struct shstore *ss;
+    struct shard *sh;
+    ssize_t ret;
+    
+    ss = st->pdata;
+    sh = &ss->shards[SHARDOF(ss, at)];
+    pthread_mutex_lock(&sh->lock);
+    ret = sh->st->ops->get(sh->st, buf, len, at);
+    pthread_mutex_unlock(&sh->lock);
+    return(ret);
+}
+
+static int putmany(struct store *st, const void **bufs, const size_t *lens, struct addr *ats, int n)
+{
+    int i;
+    
+    for(i = 0; i < n; i++) {
+	if(lens[i] > STORE_MAXBLSZ) {
+	    errno = E2BIG;
+	    return(-1);
+	}
+    }
+    fstorehash(bufs, lens, ats, n);
+    return(runbatch(st->pdata, bufs, NULL, lens, ats, NULL, n));
+}
+
+static int getmany(struct store *st, void **bufs, const size_t *lens, struct addr *ats, ssize_t *szs, int n)
+{
+    return(runbatch(st->pdata, NULL, bufs, lens, ats, szs, n));
+}
+
+static int bulk(struct store *st, int on)
+{
+    struct shstore *ss;
+    struct shard *sh;
+    int i, ret;
+    
+    ss = st->pdata;
+    ret = 0;
+    for(i = 0; i < ss->n; i++) {
+	sh = &ss->shards[i];
+	pthread_mutex_lock(&sh->lock);
+	if(storebulk(sh->st, on))
+	    ret = -1;
+	pthread_mutex_unlock(&sh->lock);
+    }
+    return(ret);
+}
+
+static void freeshards(struct shstore *ss)
+{
+    struct shard *sh;
+    int i;
+    
+    for(i = 0; i < ss->n; i++) {
+	sh = &ss->shards[i];
+	if(sh->running) {
+	    pthread_mutex_lock(&sh->lock);
+	    sh->stop = 1;
+	    pthread_cond_signal(&sh->cond);
+	    pthread_mutex_unlock(&sh->lock);
+	    pthread_join(sh->th, NULL);
+	}
+	if(sh->st != NULL)
+	    releasestore(sh->st);
+	pthread_mutex_destroy(&sh->lock);
+	pthread_cond_destroy(&sh->cond);
+    }
+    free(ss->shards);
+    free(ss);
+}
+
+static int release(struct store *st)
+{
+    freeshards(st->pdata);
+    return(0);
+}
+
+static struct storeops ops = {
+    .put = put,
+    .get = get,
+    .release = release,
+    .bulk = bulk,
+    .putmany = putmany,
+    .getmany = getmany,
+};
+
+static void shardpath(char *dir, char *shard, char *buf, size_t bufsize)
+{
+    if(shard[0] == '/')
+	snprintf(buf, bufsize, "%s", shard);
+    else
+	snprintf(buf, bufsize, "%s/%s", dir, shard);
+}
+
+struct store *openshstore(char *dir, int flags)
+{
+    struct store *st;
+    struct shstore *ss;
+    struct shard *sh;
+    FILE *sf;
+    char tbuf[1024], line[1024], *p, **paths;
+    int i, n;
+    
+    snprintf(tbuf, sizeof(tbuf), "%s/shards", dir);
+    if((sf = fopen(tbuf, "r")) == NULL) {
+	flog(LOG_ERR, "could not open %s: %s", tbuf, strerror(errno));
+	return(NULL);
+    }
+    paths = NULL;
+    n = 0;
+    while(fgets(line, sizeof(line), sf) != NULL) {
+	if((p = strchr(line, '\n')) != NULL)
+	    *p = 0;
+	if(!line[0])
+	    continue;
+	paths = realloc(paths, sizeof(*paths) * (n + 1));
+	paths[n++] = strdup(line);
+    }
+    fclose(sf);
+    if(n == 0) {
+	flog(LOG_ERR, "sharded store %s has no shards", dir);
+	errno = EINVAL;
+	return(NULL);
+    }
+    ss = malloc(sizeof(*ss));
+    ss->shards = calloc(n, sizeof(*ss->shards));
+    ss->n = n;
+    for(i = 0; i < n; i++) {
+	sh = &ss->shards[i];
+	pthread_mutex_init(&sh->lock, NULL);
+	pthread_cond_init(&sh->cond, NULL);
+	sh->ljob = &sh->jobs;
+    }
+    for(i = 0; i < n; i++) {
+	shardpath(dir, paths[i], tbuf, sizeof(tbuf));
+	if((ss->shards[i].st = openfstore(tbuf, flags)) == NULL)
+	    break;
+	/* The shards are used through their ops, bypassing the cache */
+	storenocache(ss->shards[i].st);
+    }
+    for(i = 0; i < n; i++)
+	free(paths[i]);
+    free(paths);
+    for(i = 0; i < n; i++) {
+	sh = &ss->shards[i];
+	if(sh->st == NULL) {
+	    freeshards(ss);
+	    return(NULL);
+	}
+	if(pthread_create(&sh->th, NULL, (void *(*)(void *))shworker, sh)) {
+	    flog(LOG_ERR, "could not start shard worker: %s", strerror(errno));
+	    freeshards(ss);
+	    return(NULL);
+	}
+	sh->running = 1;
+    }
+    
+    st = newstore(&ops);
+    st->pdata = ss;
+    return(st);
+}
+
+/*
+ * Creates a sharded store in dir over the given shard directories,
+ * creating a filestore in each of them.
+ */
+int mkshstore(char *dir, char **shards, int n)
+{
+    char tbuf[1024];
+    FILE *sf;
+    int i, fd;
+    
+    if(access(dir, F_OK)) {
+	if(mkdir(dir, 0700)) {
+	    flog(LOG_ERR, "could not create %s: %s", dir, strerror(errno));
+	    return(-1);
+	}
+    }
+    for(i = 0; i < n; i++) {
+	shardpath(dir, shards[i], tbuf, sizeof(tbuf));
+	if(mkfstore(tbuf))
+	    return(-1);
+    }
+    snprintf(tbuf, sizeof(tbuf), "%s/shards", dir);
+    if(((fd = open(tbuf, O_WRONLY | O_CREAT | O_EXCL, 0600)) < 0) || ((sf = fdopen(fd, "w")) == NULL)) {
+	flog(LOG_ERR, "could not create %s: %s", tbuf, strerror(errno));
+	return(-1);
+    }
+    for(i = 0; i < n; i++)
+	fprintf(sf, "%s\n", shards[i]);
+    if(fclose(sf)) {
+	flog(LOG_ERR, "could not write %s: %s", tbuf, strerror(errno));
+	return(-1);
+    }
+    return(0);
+}
@@ -0,0 +1,255 @@
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "store.h"
+#include "storeproto.h"
+#include "log.h"
+
+/*
+ * A store served by storesrv over a Unix socket. Batched puts and
+ * gets keep up to SPWINDOW requests in flight at a time. Blocks are
+ * not cached here, since the server caches for all of its clients,
+ * and a cached miss could otherwise hide a block that another client
+ * puts later.
+ */
+
+#define SPWINDOW 64
+#define SPBUFSZ 65536
+
+#define min(a, b) (((b) < (a))?(b):(a))
+
+struct sockstore {
+    FILE *in, *out;
+    u_int32_t tag;
+};
+
+/*
+ * Sends the n requests in reqs, with data[i] following request i if
+ * it is a PUT, and reads the replies into resps, storing the data of
+ * reply i in bufs[i]. Individual requests may fail with their err
+ * set; -1 is only returned when the connection itself fails, in
+ * which case the store is unusable.
+ */
+static int transact(struct sockstore *ss, struct spreq *reqs, const void **data, int n, struct spresp *resps, void **bufs)
+{
+    int sent, recvd;
+    char skip[1024];
+    size_t left;
+    
+    for(sent = recvd = 0; recvd < n; ) {
+	if(sent - recvd <= SPWINDOW / 2) {
+	    for(; (sent < n) && (sent - recvd < SPWINDOW); sent++) {
+		reqs[sent].tag = ss->tag++;
+		if(fwrite(&reqs[sent], sizeof(reqs[sent]), 1, ss->out) != 1)
+		    goto ioerr;
+		if((reqs[sent].op == SP_PUT) && (reqs[sent].len > 0) &&
+		   (fwrite(data[sent], reqs[sent].len, 1, ss->out) != 1))
+		    goto ioerr;
+	    }
+	    if(fflush(ss->out))
+		goto ioerr;
+	}
+	if(fread(&resps[recvd], sizeof(resps[recvd]), 1, ss->in) != 1)
+	    goto ioerr;
+	if((resps[recvd].tag != reqs[recvd].tag) || (resps[recvd].dlen > reqs[recvd].len)) {
+	    flog(LOG_ERR, "store server sent a reply out of order");
+	    errno = EPROTO;
+	    return(-1);
+	}
+	if(resps[recvd].dlen > 0) {
+	    if(bufs[recvd] != NULL) {
+		if(fread(bufs[recvd], resps[recvd].dlen, 1, ss->in) != 1)
+		    goto ioerr;
+	    } else {
+		for(left = resps[recvd].dlen; left > 0; left -= min(left, sizeof(skip))) {
+		    if(fread(skip, min(left, sizeof(skip)), 1, ss->in) != 1)
+			goto ioerr;
+		}
+	    }
+	}
+	recvd++;
+    }
+    return(0);
+    
+ioerr:
+    if(feof(ss->in))
+	errno = ECONNRESET;
+    flog(LOG_ERR, "lost connection to store server: %s", strerror(errno));
+    return(-1);
+}
+
+static int putmany(struct store *st, const void **bufs, const size_t *lens, struct addr *ats, int n)
+{
+    struct spreq *reqs;
+    struct spresp *resps;
+    void **nobufs;
+    int i, ret;
+    
+    for(i = 0; i < n; i++) {
+	if(lens[i] > STORE_MAXBLSZ) {
+	    errno = E2BIG;
+	    return(-1);
+	}
+    }
+    reqs = calloc(n, sizeof(*reqs));
+    resps = malloc(sizeof(*resps) * n);
+    nobufs = calloc(n, sizeof(*nobufs));
+    for(i = 0; i < n; i++) {
+	reqs[i].op = SP_PUT;
+	reqs[i].len = lens[i];
+    }
+    ret = -1;
+    if(transact(st->pdata, reqs, bufs, n, resps, nobufs))
+	goto out;
+    for(i = 0; i < n; i++) {
+	if(resps[i].err) {
+	    errno = resps[i].err;
+	    goto out;
+	}
+	ats[i] = resps[i].a;
+    }
+    ret = 0;
+    
+out:
+    free(reqs);
+    free(resps);
+    free(nobufs);
+    return(ret);
+}
+
+static int getmany(struct store *st, void **bufs, const size_t *lens, struct addr *ats, ssize_t *szs, int n)
+{
+    struct spreq *reqs;
+    struct spresp *resps;
+    int i, ret;
+    
+    reqs = calloc(n, sizeof(*reqs));
+    resps = malloc(sizeof(*resps) * n);
+    for(i = 0; i < n; i++) {
+	reqs[i].a = ats[i];
+	if(bufs[i] == NULL) {
+	    reqs[i].op = SP_HAS;
+	} else {
+	    reqs[i].op = SP_GET;
+	    reqs[i].len = min(lens[i], STORE_MAXBLSZ);
+	}
+    }
+    ret = -1;
+    if(transact(st->pdata, reqs, NULL, n, resps, bufs))
+	goto out;
+    for(i = 0; i < n; i++) {
+	if(resps[i].err == ENOENT) {
+	    szs[i] = -1;
+	} else if(resps[i].err) {
+	    errno = resps[i].err;
+	    goto out;
+	} else {
+	    szs[i] = resps[i].len;
+	}
+    }
+    ret = 0;
+    
+out:
+    free(reqs);
+    free(resps);
+    return(ret);
+}
+
+static int put(struct store *st, const void *buf, size_t len, struct addr *at)
+{
+    return(putmany(st, &buf, &len, at, 1));
+}
+
+static ssize_t get(struct store *st, void *buf, size_t len, struct addr *at)
+{
+    ssize_t sz;
+    
+    if(getmany(st, &buf, &len, at, &sz, 1))
+	return(-1);
+    if(sz < 0) {
+	errno = ENOENT;
+	return(-1);
+    }
+    return(sz);
+}
+
+static int bulk(struct store *st, int on)
+{
+    struct spreq req;
+    struct spresp resp;
+    void *nobuf;
+    
+    memset(&req, 0, sizeof(req));
+    req.op = SP_BULK;
+    req.len = on;
+    nobuf = NULL;
+    if(transact(st->pdata, &req, NULL, 1, &resp, &nobuf))
+	return(-1);
+    if(resp.err) {
+	errno = resp.err;
+	return(-1);
+    }
+    return(0);
+}
+
+static int release(struct store *st)
+{
+    struct sockstore *ss;
+    
+    ss = st->pdata;
+    fclose(ss->in);
+    fclose(ss->out);
+    free(ss);
+    return(0);
+}
+
+static struct storeops ops = {
+    .put = put,
+    .get = get,
+    .release = release,
+    .bulk = bulk,
+    .putmany = putmany,
+    .getmany = getmany,
+};
+
+/* Connects to the store server listening on the socket at path. */
+struct store *opensockstore(char *path)
+{
+    struct store *st;
+    struct sockstore *ss;
+    struct sockaddr_un sun;
+    int fd, fd2;
+    
+    memset(&sun, 0, sizeof(sun));
+    sun.sun_family = AF_UNIX;
+    if(strlen(path) >= sizeof(sun.sun_path)) {
+	errno = ENAMETOOLONG;
+	return(NULL);
+    }
+    strcpy(sun.sun_path, path);
+    if((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+	return(NULL);
+    if(connect(fd, (struct sockaddr *)&sun, sizeof(sun))) {
+	close(fd);
+	return(NULL);
+    }
+    if((fd2 = dup(fd)) < 0) {
+	close(fd);
+	return(NULL);
+    }
+    ss = malloc(sizeof(*ss));
+    ss->in = fdopen(fd, "r");
+    ss->out = fdopen(fd2, "w");
+    setvbuf(ss->in, NULL, _IOFBF, SPBUFSZ);
+    setvbuf(ss->out, NULL, _IOFBF, SPBUFSZ);
+    ss->tag = 0;
+    st = newstore(&ops);
+    storenocache(st);
+    st->pdata = ss;
+    return(st);
+}
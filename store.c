@@ -2,6 +2,7 @@
 #include <string.h>
 #include <stdio.h>
 #include <errno.h>
+#include <unistd.h>
 
 #include "store.h"
 
@@ -22,6 +23,8 @@ static ssize_t cacheget(struct store *st, struct addr *a, void *buf, size_t len)
 {
     int he, i;
 
+    if(st->cache == NULL)
+	return(-2);
     he = a->hash[0] | ((a->hash[1] & 0x0f) << 8);
     for(i = 0; i < 4; i++) {
 	if(!addrcmp(&st->cache[he * 4 + i].a, a))
@@ -34,11 +37,19 @@ static ssize_t cacheget(struct store *st, struct addr *a, void *buf, size_t len)
     return(st->cache[he * 4 + i].dlen);
 }
 
+/*
+ * Blocks larger than a file block are left out of the cache, so that
+ * a few huge blocks cannot make it hold gigabytes.
+ */
+#define CACHEMAXBLSZ 65536
+
 static void cacheput(struct store *st, struct addr *a, const void *data, ssize_t len)
 {
     int he, i;
     struct storecache tmp;
     
+    if((st->cache == NULL) || (len > CACHEMAXBLSZ))
+	return;
     he = a->hash[0] | ((a->hash[1] & 0x0f) << 8);
     for(i = 0; i < 4; i++) {
 	if(!addrcmp(&st->cache[he * 4 + i].a, a))
@@ -76,6 +87,29 @@ int storeput(struct store *st, const void *buf, size_t len, struct addr *at)
     return(ret);
 }
 
+/*
+ * Puts a batch of blocks, letting the store hash them all at once if
+ * it knows how. The addresses are returned in ats, which is
+ * mandatory.
+ */
+int storeputmany(struct store *st, const void **bufs, const size_t *lens, struct addr *ats, int n)
+{
+    int i;
+    
+    if(st->ops->putmany == NULL) {
+	for(i = 0; i < n; i++) {
+	    if(storeput(st, bufs[i], lens[i], &ats[i]))
+		return(-1);
+	}
+	return(0);
+    }
+    if(st->ops->putmany(st, bufs, lens, ats, n))
+	return(-1);
+    for(i = 0; i < n; i++)
+	cacheput(st, &ats[i], bufs[i], lens[i]);
+    return(0);
+}
+
 ssize_t storeget(struct store *st, void *buf, size_t len, struct addr *at)
 {
     ssize_t sz;
@@ -91,21 +125,238 @@ ssize_t storeget(struct store *st, void *buf, size_t len, struct addr *at)
     sz = st->ops->get(st, buf, len, &at2);
     if((sz < 0) && (errno == ENOENT))
 	cacheput(st, &at2, NULL, -1);
-    else if(sz >= 0)
+    else if((sz >= 0) && (sz <= len))
 	cacheput(st, &at2, buf, sz);
     return(sz);
 }
 
+/*
+ * Gets many blocks at once, letting the store order and merge its
+ * reads of those that are not cached. The length of each block is
+ * returned in szs, or -1 if it does not exist. Any other error fails
+ * the whole call.
+ */
+int storegetmany(struct store *st, void **bufs, const size_t *lens, struct addr *ats, ssize_t *szs, int n)
+{
+    void **mbufs;
+    size_t *mlens;
+    struct addr *mats;
+    ssize_t *mszs;
+    int i, m, *mi, ret;
+    
+    mi = malloc(sizeof(*mi) * n);
+    for(i = 0, m = 0; i < n; i++) {
+	if((szs[i] = cacheget(st, &ats[i], bufs[i], lens[i])) == -2)
+	    mi[m++] = i;
+    }
+    ret = 0;
+    if((m > 0) && (st->ops->getmany == NULL)) {
+	for(i = 0; i < m; i++) {
+	    if((szs[mi[i]] = storeget(st, bufs[mi[i]], lens[mi[i]], &ats[mi[i]])) < 0) {
+		if(errno != ENOENT) {
+		    ret = -1;
+		    break;
+		}
+	    }
+	}
+    } else if(m > 0) {
+	mbufs = malloc(sizeof(*mbufs) * m);
+	mlens = malloc(sizeof(*mlens) * m);
+	mats = malloc(sizeof(*mats) * m);
+	mszs = malloc(sizeof(*mszs) * m);
+	for(i = 0; i < m; i++) {
+	    mbufs[i] = bufs[mi[i]];
+	    mlens[i] = lens[mi[i]];
+	    mats[i] = ats[mi[i]];
+	}
+	if(st->ops->getmany(st, mbufs, mlens, mats, mszs, m)) {
+	    ret = -1;
+	} else {
+	    for(i = 0; i < m; i++) {
+		szs[mi[i]] = mszs[i];
+		if(mszs[i] < 0)
+		    cacheput(st, &mats[i], NULL, -1);
+		else if(mszs[i] <= mlens[i])
+		    cacheput(st, &mats[i], mbufs[i], mszs[i]);
+	    }
+	}
+	free(mbufs);
+	free(mlens);
+	free(mats);
+	free(mszs);
+    }
+    free(mi);
+    return(ret);
+}
+
+/*
+ * Turns off the block cache of a store, for stores used underneath
+ * another store that does its own caching.
+ */
+void storenocache(struct store *st)
+{
+    int i;
+    
+    if(st->cache == NULL)
+	return;
+    for(i = 0; i < 4096 * 4; i++) {
+	if(st->cache[i].data != NULL)
+	    free(st->cache[i].data);
+    }
+    free(st->cache);
+    st->cache = NULL;
+}
+
 int releasestore(struct store *st)
 {
     int err;
     
     if((err = st->ops->release(st)) != 0)
 	return(err);
+    storenocache(st);
     free(st);
     return(0);
 }
 
+/*
+ * Hints that many blocks are about to be put, so that the store may
+ * defer work, such as index maintenance, until bulk mode is turned
+ * off again. Stores without a notion of bulk loading ignore it.
+ */
+int storebulk(struct store *st, int on)
+{
+    if(st->ops->bulk == NULL)
+	return(0);
+    return(st->ops->bulk(st, on));
+}
+
+/*
+ * Returns the addresses of up to max of the most recently used blocks
+ * in the cache of st, hottest first, for saving as a manifest that
+ * storewarm() can load the cache from after a restart. Stores that
+ * cache blocks themselves provide the hot op instead.
+ */
+int storehot(struct store *st, struct addr *as, int max)
+{
+    struct storecache *ce;
+    int i, w, n;
+    
+    if(st->cache == NULL) {
+	if(st->ops->hot == NULL)
+	    return(0);
+	return(st->ops->hot(st, as, max));
+    }
+    n = 0;
+    for(w = 0; w < 4; w++) {
+	for(i = 0; (i < 4096) && (n < max); i++) {
+	    ce = &st->cache[i * 4 + w];
+	    if((ce->dlen >= 0) && !niladdr(&ce->a))
+		as[n++] = ce->a;
+	}
+    }
+    return(n);
+}
+
+#define HOTMAGIC "Dolda/Hot-1"
+
+/* Writes a manifest of the n blocks in as to path, replacing it atomically. */
+int storewritehot(char *path, struct addr *as, int n)
+{
+    char tbuf[1024];
+    FILE *fp;
+    
+    snprintf(tbuf, sizeof(tbuf), "%s.new", path);
+    if((fp = fopen(tbuf, "w")) == NULL)
+	return(-1);
+    fwrite(HOTMAGIC, sizeof(HOTMAGIC), 1, fp);
+    fwrite(as, sizeof(*as), n, fp);
+    if(fclose(fp) || rename(tbuf, path)) {
+	unlink(tbuf);
+	return(-1);
+    }
+    return(0);
+}
+
+/* Writes the manifest of the hottest blocks of st to path. */
+int storesavehot(struct store *st, char *path, int max)
+{
+    struct addr *as;
+    int ret;
+    
+    as = malloc(sizeof(*as) * max);
+    ret = storewritehot(path, as, storehot(st, as, max));
+    free(as);
+    return(ret);
+}
+
+/* Reads a manifest written by storewritehot(). */
+struct addr *storeloadhot(char *path, int *n)
+{
+    struct addr *as;
+    char magic[sizeof(HOTMAGIC)];
+    FILE *fp;
+    int sz;
+    
+    if((fp = fopen(path, "r")) == NULL)
+	return(NULL);
+    if((fread(magic, sizeof(magic), 1, fp) != 1) || memcmp(magic, HOTMAGIC, sizeof(magic))) {
+	fclose(fp);
+	errno = EINVAL;
+	return(NULL);
+    }
+    as = NULL;
+    *n = sz = 0;
+    while(1) {
+	if(*n == sz)
+	    as = realloc(as, sizeof(*as) * (sz = (sz == 0)?1024:(sz * 2)));
+	if(fread(&as[*n], sizeof(*as), 1, fp) != 1)
+	    break;
+	(*n)++;
+    }
+    fclose(fp);
+    return(as);
+}
+
+#define WARMBATCH 256
+#define WARMBLSZ 65536
+
+/*
+ * Reads the blocks in as through st, in batches that the store can
+ * read in log order, so that they land in its cache and in whatever
+ * caches lie below it. Blocks larger than WARMBLSZ are read on their
+ * own afterwards. Missing blocks are skipped.
+ */
+int storewarm(struct store *st, struct addr *as, int n)
+{
+    void *bufs[WARMBATCH];
+    size_t lens[WARMBATCH];
+    ssize_t szs[WARMBATCH];
+    char *data, *big;
+    int i, b, m;
+    
+    data = malloc(WARMBATCH * WARMBLSZ);
+    for(i = 0; i < WARMBATCH; i++) {
+	bufs[i] = data + (i * WARMBLSZ);
+	lens[i] = WARMBLSZ;
+    }
+    for(b = 0; b < n; b += m) {
+	m = min(n - b, WARMBATCH);
+	if(storegetmany(st, bufs, lens, as + b, szs, m)) {
+	    free(data);
+	    return(-1);
+	}
+	for(i = 0; i < m; i++) {
+	    if(szs[i] > WARMBLSZ) {
+		big = malloc(szs[i]);
+		storeget(st, big, szs[i], &as[b + i]);
+		free(big);
+	    }
+	}
+    }
+    free(data);
+    return(0);
+}
+
 int addrcmp(struct addr *a1, struct addr *a2)
 {
     return(memcmp(a1->hash, a2->hash, 32));
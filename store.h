@@ -3,7 +3,7 @@
 
 #include <sys/types.h>
 
-#define STORE_MAXBLSZ 65535
+#define STORE_MAXBLSZ (4 << 20)
 
 struct addr {
     unsigned char hash[32];
@@ -25,18 +25,67 @@ struct storeops {
     int (*put)(struct store *st, const void *buf, size_t len, struct addr *at);
     ssize_t (*get)(struct store *st, void *buf, size_t len, struct addr *at);
     int (*release)(struct store *st);
+    int (*bulk)(struct store *st, int on);
+    int (*putmany)(struct store *st, const void **bufs, const size_t *lens, struct addr *ats, int n);
+    int (*getmany)(struct store *st, void **bufs, const size_t *lens, struct addr *ats, ssize_t *szs, int n);
+    int (*hot)(struct store *st, struct addr *as, int max);
 };
 
 struct store *newstore(struct storeops *ops);
 int storeput(struct store *st, const void *buf, size_t len, struct addr *at);
+int storeputmany(struct store *st, const void **bufs, const size_t *lens, struct addr *ats, int n);
 ssize_t storeget(struct store *st, void *buf, size_t len, struct addr *at);
+int storegetmany(struct store *st, void **bufs, const size_t *lens, struct addr *ats, ssize_t *szs, int n);
 int releasestore(struct store *st);
+void storenocache(struct store *st);
+int storebulk(struct store *st, int on);
+int storehot(struct store *st, struct addr *as, int max);
+int storewritehot(char *path, struct addr *as, int n);
+int storesavehot(struct store *st, char *path, int max);
+struct addr *storeloadhot(char *path, int *n);
+int storewarm(struct store *st, struct addr *as, int n);
 int addrcmp(struct addr *a1, struct addr *a2);
 char *formataddr(struct addr *a);
 int parseaddr(char *buf, struct addr *a);
 int niladdr(struct addr *a);
 
+/* Flags for openfstore() */
+#define FST_COMPRESS 1		/* Compress new blocks written to the log */
+#define FST_RECOVER 2		/* Repair the index and log tail after a crash */
+#define FST_REINDEX 4		/* Rebuild the entire index from the log */
+#define FST_VERIFYONCE 8	/* Verify each block only when first read */
+#define FST_SCRUB 16		/* Verify sealed log segments in the background */
+#define FST_URING 32		/* Use io_uring for batched reads, if available */
+#define FST_ALIGN 64		/* Start new log entries on sector boundaries */
+#define FST_DIRECT 128		/* Read the log with O_DIRECT, bypassing the page cache */
+
 struct store *newfstore(char *dir);
+struct store *openfstore(char *dir, int flags);
 int mkfstore(char *dir);
+int mvfstore(char *from, char *to);
+int rmfstore(char *dir);
+int fstorescrub(struct store *st);
+int fstoreexclusive(struct store *st);
+int fstorescan(struct store *st, int (*fn)(struct addr *a, const void *buf, size_t len, void *pdata), void *pdata);
+void fstorehash(const void **bufs, const size_t *lens, struct addr *as, int n);
+int fstoreputhashed(struct store *st, const void **bufs, const size_t *lens, struct addr *ats, int n);
+int fstorerepair(struct store *st, const void *buf, size_t len, struct addr *a);
+
+struct store *openshstore(char *dir, int flags);
+int mkshstore(char *dir, char **shards, int n);
+
+struct store *openmirstore(char *dir, int flags);
+int mkmirstore(char *dir, char **mirrors, int n);
+
+struct store *newmemstore(void);
+struct store *newcachestore(struct store *back, size_t maxsize);
+struct store *newtierstore(struct store *fast, struct store *slow);
+struct store *opentierstore(char *dir, int flags);
+int mktierstore(char *dir, char *fast, char *slow);
+int tierstoremigrate(struct store *st);
+
+struct store *opensockstore(char *path);
+
+struct store *openstore(char *dir, int flags);
 
 #endif
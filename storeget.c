@@ -17,7 +17,7 @@ int main(int argc, char **argv)
 	fprintf(stderr, "usage: storeget DIR HASH\n");
 	exit(1);
     }
-    if((st = newfstore(argv[1])) == NULL)
+    if((st = openstore(argv[1], 0)) == NULL)
 	exit(1);
     parseaddr(argv[2], &a);
     if((ret = storeget(st, buf, STORE_MAXBLSZ, &a)) < 0) {
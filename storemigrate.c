@@ -0,0 +1,54 @@
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#include "store.h"
+
+/*
+ * Moves the cold blocks of a tiered store from its fast tier to its
+ * slow one. The store must not be in use meanwhile, and this refuses
+ * to run if it is.
+ */
+
+static void usage(FILE *out)
+{
+    fprintf(out, "usage: storemigrate [-hz] DIR\n");
+}
+
+int main(int argc, char **argv)
+{
+    struct store *st;
+    int c, flags;
+    
+    flags = 0;
+    while((c = getopt(argc, argv, "hz")) >= 0) {
+	switch(c) {
+	case 'z':
+	    flags |= FST_COMPRESS;
+	    break;
+	case 'h':
+	    usage(stdout);
+	    exit(0);
+	default:
+	    usage(stderr);
+	    exit(1);
+	}
+    }
+    if(argc - optind < 1) {
+	usage(stderr);
+	exit(1);
+    }
+    if((st = opentierstore(argv[optind], flags)) == NULL)
+	exit(1);
+    if(tierstoremigrate(st)) {
+	if(errno == EBUSY)
+	    fprintf(stderr, "storemigrate: %s is in use by another process\n", argv[optind]);
+	else
+	    fprintf(stderr, "storemigrate: could not migrate %s: %s\n", argv[optind], strerror(errno));
+	exit(1);
+    }
+    releasestore(st);
+    return(0);
+}
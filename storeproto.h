@@ -0,0 +1,42 @@
+#ifndef _STOREPROTO_H
+#define _STOREPROTO_H
+
+#include <sys/types.h>
+#include "store.h"
+
+/*
+ * Protocol between storesrv and sockstore clients over a Unix
+ * socket. A client sends requests without waiting for the replies,
+ * each of which carries the tag of its request; replies come in the
+ * order the requests were sent. A PUT request is followed by len
+ * bytes of block data; a GET reply by dlen bytes of it, at most the
+ * len of its request. HAS is a GET that returns no data. BULK turns
+ * bulk loading of the server's store on or off, as len says. The
+ * err field of a reply is an errno value, or zero on success.
+ */
+
+#define SP_PUT 1
+#define SP_GET 2
+#define SP_HAS 3
+#define SP_BULK 4
+
+/* The socket of a store served from a directory */
+#define SP_SOCKNAME "sock"
+
+struct spreq {
+    struct addr a;
+    u_int32_t tag;
+    u_int32_t len;
+    u_int8_t op;
+    u_int8_t pad[3];
+};
+
+struct spresp {
+    struct addr a;
+    u_int32_t tag;
+    int32_t err;
+    u_int32_t len;
+    u_int32_t dlen;
+};
+
+#endif
@@ -18,9 +18,9 @@ int main(int argc, char **argv)
 	exit(1);
     }
     for(o = 0; (ret = read(0, buf + o, STORE_MAXBLSZ - o)) > 0; o += ret);
-    if((st = newfstore(argv[1])) == NULL)
+    if((st = openstore(argv[1], 0)) == NULL)
 	exit(1);
-    if((ret = storeput(st, buf, STORE_MAXBLSZ, &a)) < 0) {
+    if((ret = storeput(st, buf, o, &a)) < 0) {
 	perror(argv[2]);
 	exit(1);
     }
@@ -0,0 +1,51 @@
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdio.h>
+
+#include "store.h"
+
+static void usage(FILE *out)
+{
+    fprintf(out, "usage: storerecover [-has] DIR\n");
+}
+
+int main(int argc, char **argv)
+{
+    struct store *st;
+    int c, flags, scrub, bad;
+    
+    flags = FST_RECOVER;
+    scrub = 0;
+    while((c = getopt(argc, argv, "has")) >= 0) {
+	switch(c) {
+	case 'a':
+	    flags |= FST_REINDEX;
+	    break;
+	case 's':
+	    scrub = 1;
+	    break;
+	case 'h':
+	    usage(stdout);
+	    exit(0);
+	default:
+	    usage(stderr);
+	    exit(1);
+	}
+    }
+    if(argc - optind < 1) {
+	usage(stderr);
+	exit(1);
+    }
+    if((st = openfstore(argv[optind], flags)) == NULL)
+	exit(1);
+    if(scrub) {
+	if((bad = fstorescrub(st)) < 0)
+	    exit(1);
+	if(bad > 0) {
+	    fprintf(stderr, "storerecover: %i blocks did not verify\n", bad);
+	    exit(1);
+	}
+    }
+    releasestore(st);
+    return(0);
+}
@@ -0,0 +1,385 @@
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <signal.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "store.h"
+#include "storeproto.h"
+#include "log.h"
+
+/*
+ * storesrv owns the store in a directory and serves it to any number
+ * of sockstore clients over the socket SP_SOCKNAME in it, so that
+ * several vcfs mounts and tools can share one store and one cache.
+ * It is a single thread polling all connections, so the store never
+ * sees two requests at once. Runs of PUT or GET requests that have
+ * arrived on a connection are carried out as one storeputmany() or
+ * storegetmany() call.
+ */
+
+#define SRVBATCH 64
+/* Stop reading from a client with this much unsent reply data */
+#define SRVOUTMAX (8 << 20)
+
+struct conn {
+    int fd;
+    char *ibuf, *obuf;
+    size_t ilen, isz;
+    size_t olen, ooff, osz;
+    int bulk;
+};
+
+static volatile int quit = 0;
+/* Connections that have bulk mode on; the store's is on while any do */
+static int nbulk = 0;
+
+static void sighandler(int sig)
+{
+    quit = 1;
+}
+
+static void oappend(struct conn *c, const void *data, size_t len)
+{
+    if(c->olen + len > c->osz) {
+	if(c->ooff > 0) {
+	    memmove(c->obuf, c->obuf + c->ooff, c->olen - c->ooff);
+	    c->olen -= c->ooff;
+	    c->ooff = 0;
+	}
+	while(c->olen + len > c->osz)
+	    c->osz = (c->osz == 0)?65536:(c->osz * 2);
+	c->obuf = realloc(c->obuf, c->osz);
+    }
+    memcpy(c->obuf + c->olen, data, len);
+    c->olen += len;
+}
+
+static size_t reqsize(struct spreq *req)
+{
+    return(sizeof(*req) + ((req->op == SP_PUT)?req->len:0));
+}
+
+static void doputs(struct store *st, struct conn *c, struct spreq *reqs, char **data, int n)
+{
+    const void *bufs[SRVBATCH];
+    size_t lens[SRVBATCH];
+    struct addr ats[SRVBATCH];
+    struct spresp resp;
+    int i, err;
+    
+    for(i = 0; i < n; i++) {
+	bufs[i] = data[i];
+	lens[i] = reqs[i].len;
+    }
+    err = storeputmany(st, bufs, lens, ats, n)?errno:0;
+    for(i = 0; i < n; i++) {
+	memset(&resp, 0, sizeof(resp));
+	resp.tag = reqs[i].tag;
+	if(!(resp.err = err))
+	    resp.a = ats[i];
+	oappend(c, &resp, sizeof(resp));
+    }
+}
+
+static void dogets(struct store *st, struct conn *c, struct spreq *reqs, int n)
+{
+    void *bufs[SRVBATCH];
+    size_t lens[SRVBATCH];
+    struct addr ats[SRVBATCH];
+    ssize_t szs[SRVBATCH];
+    struct spresp resp;
+    int i, err;
+    
+    for(i = 0; i < n; i++) {
+	lens[i] = (reqs[i].op == SP_GET)?reqs[i].len:0;
+	bufs[i] = (lens[i] > 0)?malloc(lens[i]):NULL;
+	ats[i] = reqs[i].a;
+    }
+    err = storegetmany(st, bufs, lens, ats, szs, n)?errno:0;
+    for(i = 0; i < n; i++) {
+	memset(&resp, 0, sizeof(resp));
+	resp.tag = reqs[i].tag;
+	if(err) {
+	    resp.err = err;
+	} else if(szs[i] < 0) {
+	    resp.err = ENOENT;
+	} else {
+	    resp.len = szs[i];
+	    resp.dlen = (szs[i] < lens[i])?szs[i]:lens[i];
+	}
+	oappend(c, &resp, sizeof(resp));
+	if(resp.dlen > 0)
+	    oappend(c, bufs[i], resp.dlen);
+	if(bufs[i] != NULL)
+	    free(bufs[i]);
+    }
+}
+
+/* Turns bulk mode on or off for c, and for the store as needed. */
+static int setbulk(struct store *st, struct conn *c, int on)
+{
+    if(!on == !c->bulk)
+	return(0);
+    if(on) {
+	if((nbulk == 0) && storebulk(st, 1))
+	    return(-1);
+	nbulk++;
+    } else {
+	if((--nbulk == 0) && storebulk(st, 0)) {
+	    c->bulk = 0;
+	    return(-1);
+	}
+    }
+    c->bulk = on;
+    return(0);
+}
+
+/*
+ * Carries out the complete requests in the input buffer of c, as
+ * long as its replies are not piling up, in batches of PUTs, of GETs
+ * and HASes, or of a single BULK. Returns -1 if the client violated
+ * the protocol.
+ */
+static int serve(struct store *st, struct conn *c)
+{
+    struct spreq reqs[SRVBATCH], *req;
+    struct spresp resp;
+    char *data[SRVBATCH];
+    size_t off;
+    int n;
+    
+    off = 0;
+    while(c->olen - c->ooff < SRVOUTMAX) {
+	for(n = 0; n < SRVBATCH; n++) {
+	    if(c->ilen - off < sizeof(*req))
+		break;
+	    /* The buffer is not aligned for anything after a PUT */
+	    req = &reqs[n];
+	    memcpy(req, c->ibuf + off, sizeof(*req));
+	    if(((req->op == SP_PUT) && (req->len > STORE_MAXBLSZ)) ||
+	       ((req->op != SP_PUT) && (req->op != SP_GET) && (req->op != SP_HAS) && (req->op != SP_BULK)))
+		return(-1);
+	    if((req->op == SP_GET) && (req->len > STORE_MAXBLSZ))
+		req->len = STORE_MAXBLSZ;
+	    if(c->ilen - off < reqsize(req))
+		break;
+	    if((n > 0) && ((req->op == SP_BULK) || (reqs[0].op == SP_BULK) || ((req->op == SP_PUT) != (reqs[0].op == SP_PUT))))
+		break;
+	    data[n] = c->ibuf + off + sizeof(*req);
+	    off += reqsize(req);
+	}
+	if(n == 0)
+	    break;
+	if(reqs[0].op == SP_BULK) {
+	    memset(&resp, 0, sizeof(resp));
+	    resp.tag = reqs[0].tag;
+	    resp.err = setbulk(st, c, reqs[0].len)?errno:0;
+	    oappend(c, &resp, sizeof(resp));
+	} else if(reqs[0].op == SP_PUT) {
+	    doputs(st, c, reqs, data, n);
+	} else {
+	    dogets(st, c, reqs, n);
+	}
+    }
+    memmove(c->ibuf, c->ibuf + off, c->ilen - off);
+    c->ilen -= off;
+    return(0);
+}
+
+static void closeconn(struct store *st, struct conn *c)
+{
+    /* Don't leave the store in bulk mode for a client that is gone */
+    if(c->bulk && setbulk(st, c, 0))
+	fprintf(stderr, "storesrv: could not end bulk mode: %s\n", strerror(errno));
+    close(c->fd);
+    if(c->ibuf != NULL)
+	free(c->ibuf);
+    if(c->obuf != NULL)
+	free(c->obuf);
+    free(c);
+}
+
+static int srvloop(struct store *st, int lfd)
+{
+    struct conn **conns, *c;
+    struct pollfd *pfds;
+    int i, n, nconns, fd;
+    ssize_t ret;
+    
+    conns = NULL;
+    pfds = NULL;
+    nconns = 0;
+    while(!quit) {
+	pfds = realloc(pfds, sizeof(*pfds) * (nconns + 1));
+	pfds[0].fd = lfd;
+	pfds[0].events = POLLIN;
+	for(i = 0; i < nconns; i++) {
+	    c = conns[i];
+	    pfds[i + 1].fd = c->fd;
+	    pfds[i + 1].events = 0;
+	    if(c->olen - c->ooff < SRVOUTMAX)
+		pfds[i + 1].events |= POLLIN;
+	    if(c->olen > c->ooff)
+		pfds[i + 1].events |= POLLOUT;
+	}
+	if(poll(pfds, nconns + 1, -1) < 0) {
+	    if(errno == EINTR)
+		continue;
+	    flog(LOG_ERR, "poll: %s", strerror(errno));
+	    return(-1);
+	}
+	for(i = 0, n = nconns; i < n; i++) {
+	    c = conns[i];
+	    if(pfds[i + 1].revents & (POLLIN | POLLHUP | POLLERR)) {
+		if(c->isz - c->ilen < 65536) {
+		    c->isz = (c->isz == 0)?(sizeof(struct spreq) + STORE_MAXBLSZ):(c->isz * 2);
+		    c->ibuf = realloc(c->ibuf, c->isz);
+		}
+		if((ret = read(c->fd, c->ibuf + c->ilen, c->isz - c->ilen)) <= 0) {
+		    if((ret == 0) || ((errno != EAGAIN) && (errno != EINTR))) {
+			closeconn(st, c);
+			conns[i] = NULL;
+			continue;
+		    }
+		} else {
+		    c->ilen += ret;
+		}
+		if(serve(st, c)) {
+		    flog(LOG_WARNING, "dropping client that sent an invalid request");
+		    closeconn(st, c);
+		    conns[i] = NULL;
+		    continue;
+		}
+	    }
+	    if(c->olen > c->ooff) {
+		if((ret = write(c->fd, c->obuf + c->ooff, c->olen - c->ooff)) < 0) {
+		    if((errno != EAGAIN) && (errno != EINTR)) {
+			closeconn(st, c);
+			conns[i] = NULL;
+			continue;
+		    }
+		} else {
+		    c->ooff += ret;
+		    if(c->ooff == c->olen)
+			c->ooff = c->olen = 0;
+		}
+		/* Requests held back by a full output buffer */
+		if((c->olen - c->ooff < SRVOUTMAX) && serve(st, c)) {
+		    closeconn(st, c);
+		    conns[i] = NULL;
+		    continue;
+		}
+	    }
+	}
+	for(i = 0, n = 0; i < nconns; i++) {
+	    if(conns[i] != NULL)
+		conns[n++] = conns[i];
+	}
+	nconns = n;
+	if(pfds[0].revents & POLLIN) {
+	    if((fd = accept(lfd, NULL, NULL)) < 0) {
+		if((errno != EAGAIN) && (errno != EINTR))
+		    flog(LOG_WARNING, "accept: %s", strerror(errno));
+		continue;
+	    }
+	    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+	    c = calloc(1, sizeof(*c));
+	    c->fd = fd;
+	    conns = realloc(conns, sizeof(*conns) * (nconns + 1));
+	    conns[nconns++] = c;
+	}
+    }
+    for(i = 0; i < nconns; i++)
+	closeconn(st, conns[i]);
+    if(conns != NULL)
+	free(conns);
+    free(pfds);
+    return(0);
+}
+
+static void usage(FILE *out)
+{
+    fprintf(out, "usage: storesrv [-hadz] [-c MIB] DIR\n");
+}
+
+int main(int argc, char **argv)
+{
+    struct store *st;
+    struct sockaddr_un sun;
+    struct sigaction sa;
+    int c, flags, lfd;
+    size_t cache;
+    
+    flags = 0;
+    cache = 0;
+    while((c = getopt(argc, argv, "hadzc:")) >= 0) {
+	switch(c) {
+	case 'z':
+	    flags |= FST_COMPRESS;
+	    break;
+	case 'a':
+	    flags |= FST_ALIGN;
+	    break;
+	case 'd':
+	    flags |= FST_DIRECT;
+	    break;
+	case 'c':
+	    cache = (size_t)atoi(optarg) << 20;
+	    break;
+	case 'h':
+	    usage(stdout);
+	    exit(0);
+	default:
+	    usage(stderr);
+	    exit(1);
+	}
+    }
+    if(argc - optind < 1) {
+	usage(stderr);
+	exit(1);
+    }
+    
+    memset(&sun, 0, sizeof(sun));
+    sun.sun_family = AF_UNIX;
+    if(snprintf(sun.sun_path, sizeof(sun.sun_path), "%s/%s", argv[optind], SP_SOCKNAME) >= sizeof(sun.sun_path)) {
+	fprintf(stderr, "storesrv: socket path too long\n");
+	exit(1);
+    }
+    if((st = opensockstore(sun.sun_path)) != NULL) {
+	fprintf(stderr, "storesrv: %s is already being served\n", argv[optind]);
+	exit(1);
+    }
+    unlink(sun.sun_path);
+    if((st = openstore(argv[optind], flags)) == NULL)
+	exit(1);
+    if(cache > 0)
+	st = newcachestore(st, cache);
+    if((lfd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+	perror("socket");
+	exit(1);
+    }
+    if(bind(lfd, (struct sockaddr *)&sun, sizeof(sun)) || listen(lfd, 16)) {
+	fprintf(stderr, "storesrv: %s: %s\n", sun.sun_path, strerror(errno));
+	exit(1);
+    }
+    fcntl(lfd, F_SETFL, fcntl(lfd, F_GETFL) | O_NONBLOCK);
+    
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = sighandler;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
+    
+    c = srvloop(st, lfd);
+    unlink(sun.sun_path);
+    close(lfd);
+    releasestore(st);
+    return(c?1:0);
+}
@@ -0,0 +1,433 @@
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include "store.h"
+#include "addrset.h"
+#include "log.h"
+
+/*
+ * A tiered store writes new blocks to a fast store, and reads from
+ * the slow store whatever the fast one does not have. The fast tier
+ * is emptied by tierstoremigrate(), which moves every block in it to
+ * the slow tier, except the ones that have been read from the fast
+ * tier since it was last migrated, which are kept. Each process
+ * remembers the blocks it has read in two generations of at most
+ * TIERHOTMAX blocks, and merges them into the manifest TIERHOTFILE
+ * in the store directory when it releases the store, so that a
+ * migration sees what every earlier user of the store has read.
+ *
+ * A tiered store in a directory has the fast and slow tier
+ * directories on the first and second lines of the file "tiers" in
+ * it, relative paths being relative to that directory. The fast tier
+ * is a plain filestore, whereas the slow one may be any store that
+ * openstore() can open. Migration needs the fast tier to be a
+ * filestore in a known directory, and so only works on stores opened
+ * that way. The tiers are owned by the tiered store, and are
+ * released with it.
+ */
+
+#define TIERHOTMAX (1 << 18)
+#define TIERHOTFILE "tierhot"
+
+struct tstore {
+    struct store *fast, *slow;
+    char *dir, *fastdir, *slowdir;
+    int flags;
+    struct addrset hot, ohot;
+};
+
+static void markhot(struct tstore *ts, struct addr *a)
+{
+    if(ts->hot.n >= TIERHOTMAX) {
+	addrsetfree(&ts->ohot);
+	ts->ohot = ts->hot;
+	memset(&ts->hot, 0, sizeof(ts->hot));
+    }
+    addrsetadd(&ts->hot, a);
+}
+
+static int ishot(struct tstore *ts, struct addr *a)
+{
+    return(addrsethas(&ts->hot, a) || addrsethas(&ts->ohot, a));
+}
+
+static void addhot(struct addrset *seen, struct addr *as, int *n, int max, struct addr *a)
+{
+    if((*n < max) && !addrsethas(seen, a)) {
+	addrsetadd(seen, a);
+	as[(*n)++] = *a;
+    }
+}
+
+/*
+ * Merges the blocks read by this process into the manifest, newest
+ * first, keeping at most twice TIERHOTMAX of them. The tiers file is
+ * locked meanwhile, so that processes releasing the store at the
+ * same time do not lose each other's blocks.
+ */
+static int savehot(struct tstore *ts)
+{
+    struct addrset seen;
+    struct addr *as, *old;
+    char tbuf[1024];
+    int fd, i, n, on, ret;
+    
+    if((ts->dir == NULL) || ((ts->hot.n == 0) && (ts->ohot.n == 0)))
+	return(0);
+    snprintf(tbuf, sizeof(tbuf), "%s/tiers", ts->dir);
+    if((fd = open(tbuf, O_RDONLY)) < 0)
+	return(-1);
+    flock(fd, LOCK_EX);
+    snprintf(tbuf, sizeof(tbuf), "%s/%s", ts->dir, TIERHOTFILE);
+    if((old = storeloadhot(tbuf, &on)) == NULL)
+	on = 0;
+    memset(&seen, 0, sizeof(seen));
+    as = malloc(sizeof(*as) * TIERHOTMAX * 2);
+    n = 0;
+    for(i = 0; i < ts->hot.sz; i++) {
+	if(!niladdr(&ts->hot.tab[i]))
+	    addhot(&seen, as, &n, TIERHOTMAX * 2, &ts->hot.tab[i]);
+    }
+    for(i = 0; i < ts->ohot.sz; i++) {
+	if(!niladdr(&ts->ohot.tab[i]))
+	    addhot(&seen, as, &n, TIERHOTMAX * 2, &ts->ohot.tab[i]);
+    }
+    for(i = 0; i < on; i++)
+	addhot(&seen, as, &n, TIERHOTMAX * 2, &old[i]);
+    if((ret = storewritehot(tbuf, as, n)) != 0)
+	flog(LOG_WARNING, "could not write %s: %s", tbuf, strerror(errno));
+    addrsetfree(&seen);
+    free(as);
+    if(old != NULL)
+	free(old);
+    close(fd);
+    return(ret);
+}
+
+static int put(struct store *st, const void *buf, size_t len, struct addr *at)
+{
+    struct tstore *ts;
+    
+    ts = st->pdata;
+    return(storeput(ts->fast, buf, len, at));
+}
+
+static ssize_t get(struct store *st, void *buf, size_t len, struct addr *at)
+{
+    struct tstore *ts;
+    ssize_t sz;
+    
+    ts = st->pdata;
+    if((sz = storeget(ts->fast, buf, len, at)) >= 0) {
+	markhot(ts, at);
+	return(sz);
+    }
+    if(errno != ENOENT)
+	return(-1);
+    return(storeget(ts->slow, buf, len, at));
+}
+
+static int putmany(struct store *st, const void **bufs, const size_t *lens, struct addr *ats, int n)
+{
+    struct tstore *ts;
+    
+    ts = st->pdata;
+    return(storeputmany(ts->fast, bufs, lens, ats, n));
+}
+
+static int getmany(struct store *st, void **bufs, const size_t *lens, struct addr *ats, ssize_t *szs, int n)
+{
+    struct tstore *ts;
+    void **mbufs;
+    size_t *mlens;
+    struct addr *mats;
+    ssize_t *mszs;
+    int i, m, *mi, ret;
+    
+    ts = st->pdata;
+    if(storegetmany(ts->fast, bufs, lens, ats, szs, n))
+	return(-1);
+    mi = malloc(sizeof(*mi) * n);
+    for(i = 0, m = 0; i < n; i++) {
+	if(szs[i] < 0)
+	    mi[m++] = i;
+	else
+	    markhot(ts, &ats[i]);
+    }
+    ret = 0;
+    if(m > 0) {
+	mbufs = malloc(sizeof(*mbufs) * m);
+	mlens = malloc(sizeof(*mlens) * m);
+	mats = malloc(sizeof(*mats) * m);
+	mszs = malloc(sizeof(*mszs) * m);
+	for(i = 0; i < m; i++) {
+	    mbufs[i] = bufs[mi[i]];
+	    mlens[i] = lens[mi[i]];
+	    mats[i] = ats[mi[i]];
+	}
+	if(storegetmany(ts->slow, mbufs, mlens, mats, mszs, m)) {
+	    ret = -1;
+	} else {
+	    for(i = 0; i < m; i++)
+		szs[mi[i]] = mszs[i];
+	}
+	free(mbufs);
+	free(mlens);
+	free(mats);
+	free(mszs);
+    }
+    free(mi);
+    return(ret);
+}
+
+static int bulk(struct store *st, int on)
+{
+    struct tstore *ts;
+    
+    ts = st->pdata;
+    return(storebulk(ts->fast, on));
+}
+
+static int release(struct store *st)
+{
+    struct tstore *ts;
+    int ret;
+    
+    ts = st->pdata;
+    ret = 0;
+    savehot(ts);
+    if((ts->fast != NULL) && releasestore(ts->fast))
+	ret = -1;
+    if((ts->slow != NULL) && releasestore(ts->slow))
+	ret = -1;
+    if(ts->dir != NULL)
+	free(ts->dir);
+    if(ts->fastdir != NULL)
+	free(ts->fastdir);
+    if(ts->slowdir != NULL)
+	free(ts->slowdir);
+    addrsetfree(&ts->hot);
+    addrsetfree(&ts->ohot);
+    free(ts);
+    return(ret);
+}
+
+static struct storeops ops = {
+    .put = put,
+    .get = get,
+    .release = release,
+    .bulk = bulk,
+    .putmany = putmany,
+    .getmany = getmany,
+};
+
+struct store *newtierstore(struct store *fast, struct store *slow)
+{
+    struct store *st;
+    struct tstore *ts;
+    
+    ts = calloc(1, sizeof(*ts));
+    ts->fast = fast;
+    ts->slow = slow;
+    /* The tiers are only reached through this store's cache */
+    storenocache(fast);
+    storenocache(slow);
+    st = newstore(&ops);
+    st->pdata = ts;
+    return(st);
+}
+
+static void tierpath(char *dir, char *tier, char *buf, size_t bufsize)
+{
+    if(tier[0] == '/')
+	snprintf(buf, bufsize, "%s", tier);
+    else
+	snprintf(buf, bufsize, "%s/%s", dir, tier);
+}
+
+struct store *opentierstore(char *dir, int flags)
+{
+    struct store *st, *fast, *slow;
+    struct tstore *ts;
+    FILE *tf;
+    char tbuf[1024], fbuf[1024], sbuf[1024], *p;
+    
+    snprintf(tbuf, sizeof(tbuf), "%s/tiers", dir);
+    if((tf = fopen(tbuf, "r")) == NULL) {
+	flog(LOG_ERR, "could not open %s: %s", tbuf, strerror(errno));
+	return(NULL);
+    }
+    if((fgets(fbuf, sizeof(fbuf), tf) == NULL) || (fgets(sbuf, sizeof(sbuf), tf) == NULL)) {
+	flog(LOG_ERR, "%s does not name two tiers", tbuf);
+	fclose(tf);
+	errno = EINVAL;
+	return(NULL);
+    }
+    fclose(tf);
+    if((p = strchr(fbuf, '\n')) != NULL)
+	*p = 0;
+    if((p = strchr(sbuf, '\n')) != NULL)
+	*p = 0;
+    tierpath(dir, fbuf, tbuf, sizeof(tbuf));
+    if((fast = openfstore(tbuf, flags)) == NULL)
+	return(NULL);
+    strcpy(fbuf, tbuf);
+    tierpath(dir, sbuf, tbuf, sizeof(tbuf));
+    if((slow = openstore(tbuf, flags)) == NULL) {
+	releasestore(fast);
+	return(NULL);
+    }
+    st = newtierstore(fast, slow);
+    ts = st->pdata;
+    ts->dir = strdup(dir);
+    ts->fastdir = strdup(fbuf);
+    ts->slowdir = strdup(tbuf);
+    ts->flags = flags;
+    return(st);
+}
+
+/*
+ * Creates a tiered store in dir, along with a filestore in fast. The
+ * slow tier is created as a filestore as well, unless its directory
+ * already exists, so that it can be made beforehand as any other
+ * kind of store.
+ */
+int mktierstore(char *dir, char *fast, char *slow)
+{
+    char tbuf[1024];
+    FILE *tf;
+    int fd;
+    
+    if(access(dir, F_OK)) {
+	if(mkdir(dir, 0700)) {
+	    flog(LOG_ERR, "could not create %s: %s", dir, strerror(errno));
+	    return(-1);
+	}
+    }
+    tierpath(dir, fast, tbuf, sizeof(tbuf));
+    if(mkfstore(tbuf))
+	return(-1);
+    tierpath(dir, slow, tbuf, sizeof(tbuf));
+    if(access(tbuf, F_OK) && mkfstore(tbuf))
+	return(-1);
+    snprintf(tbuf, sizeof(tbuf), "%s/tiers", dir);
+    if(((fd = open(tbuf, O_WRONLY | O_CREAT | O_EXCL, 0600)) < 0) || ((tf = fdopen(fd, "w")) == NULL)) {
+	flog(LOG_ERR, "could not create %s: %s", tbuf, strerror(errno));
+	return(-1);
+    }
+    fprintf(tf, "%s\n%s\n", fast, slow);
+    if(fclose(tf)) {
+	flog(LOG_ERR, "could not write %s: %s", tbuf, strerror(errno));
+	return(-1);
+    }
+    return(0);
+}
+
+struct migration {
+    struct tstore *ts;
+    struct addrset saved;
+    struct store *nfast;
+    size_t nkept, nmoved;
+};
+
+static int migrateblock(struct addr *a, const void *buf, size_t len, void *pdata)
+{
+    struct migration *mg;
+    
+    mg = pdata;
+    if(ishot(mg->ts, a) || addrsethas(&mg->saved, a)) {
+	mg->nkept++;
+	return(storeput(mg->nfast, buf, len, NULL));
+    }
+    mg->nmoved++;
+    return(storeput(mg->ts->slow, buf, len, NULL));
+}
+
+/*
+ * Moves the cold blocks of the fast tier to the slow one, and
+ * replaces the fast tier with a new filestore holding only the hot
+ * blocks, which are those read by this process and those in the
+ * manifest. The manifest is removed afterwards. The slow tier is
+ * closed and reopened to make sure that all blocks have reached it
+ * before the old fast tier is removed. The fast tier is held
+ * exclusively throughout, so this fails with EBUSY if anything else
+ * has it open, since whatever that process appended to it would be
+ * lost. A new tier left behind by an interrupted migration is
+ * discarded; the old one still holds all of its blocks.
+ */
+int tierstoremigrate(struct store *st)
+{
+    struct tstore *ts;
+    struct migration mg;
+    struct addr *as;
+    char nbuf[1024], hbuf[1024];
+    int i, n;
+    
+    ts = st->pdata;
+    if((st->ops != &ops) || (ts->fastdir == NULL)) {
+	errno = EINVAL;
+	return(-1);
+    }
+    if(fstoreexclusive(ts->fast))
+	return(-1);
+    memset(&mg, 0, sizeof(mg));
+    mg.ts = ts;
+    hbuf[0] = 0;
+    if(ts->dir != NULL) {
+	snprintf(hbuf, sizeof(hbuf), "%s/%s", ts->dir, TIERHOTFILE);
+	if((as = storeloadhot(hbuf, &n)) != NULL) {
+	    for(i = 0; i < n; i++)
+		addrsetadd(&mg.saved, &as[i]);
+	    free(as);
+	} else if(errno != ENOENT) {
+	    flog(LOG_WARNING, "could not read %s: %s", hbuf, strerror(errno));
+	}
+    }
+    snprintf(nbuf, sizeof(nbuf), "%s/tier.new", ts->fastdir);
+    if(rmfstore(nbuf) || mkfstore(nbuf) || ((mg.nfast = openfstore(nbuf, ts->flags)) == NULL)) {
+	addrsetfree(&mg.saved);
+	return(-1);
+    }
+    storenocache(mg.nfast);
+    if(storebulk(mg.nfast, 1) || storebulk(ts->slow, 1))
+	goto err;
+    if(fstorescan(ts->fast, migrateblock, &mg))
+	goto err;
+    if(storebulk(mg.nfast, 0) || storebulk(ts->slow, 0))
+	goto err;
+    releasestore(mg.nfast);
+    addrsetfree(&mg.saved);
+    if(releasestore(ts->slow)) {
+	ts->slow = NULL;
+	return(-1);
+    }
+    if((ts->slow = openstore(ts->slowdir, ts->flags)) == NULL)
+	return(-1);
+    storenocache(ts->slow);
+    /* Keep others out of the old fast tier until it is replaced */
+    if(mvfstore(nbuf, ts->fastdir))
+	return(-1);
+    releasestore(ts->fast);
+    ts->fast = NULL;
+    if((ts->fast = openfstore(ts->fastdir, ts->flags)) == NULL)
+	return(-1);
+    storenocache(ts->fast);
+    addrsetfree(&ts->hot);
+    addrsetfree(&ts->ohot);
+    if(hbuf[0])
+	unlink(hbuf);
+    flog(LOG_INFO, "migrated %zu blocks to the slow tier, kept %zu", mg.nmoved, mg.nkept);
+    return(0);
+    
+err:
+    storebulk(ts->slow, 0);
+    releasestore(mg.nfast);
+    addrsetfree(&mg.saved);
+    return(-1);
+}
@@ -0,0 +1,254 @@
+#define _LARGEFILE64_SOURCE
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include "uring.h"
+
+/*
+ * A minimal io_uring driver on top of the raw system calls. Requests
+ * are queued with uringread() and uringwrite(), and submitted in one
+ * go when the submission queue fills up or when uringwait() is
+ * called, which also waits until all of them have completed. The
+ * vectored opcodes are used since they are available on every kernel
+ * that has io_uring at all.
+ */
+
+struct uringslot {
+    uringcb cb;
+    void *pdata;
+    struct iovec iov;
+};
+
+struct uring {
+    int fd;
+    unsigned int sqents, sqmask, cqmask;
+    unsigned int *sqtail, *sqarray;
+    unsigned int *cqhead, *cqtail;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sqmap, *cqmap;
+    size_t sqmapsz, cqmapsz, sqesz;
+    unsigned int tail, queued, inflight;
+    struct uringslot *slots;
+    unsigned int *free, nfree;
+};
+
+#ifdef __NR_io_uring_setup
+
+struct uring *newuring(unsigned int entries)
+{
+    struct uring *r;
+    struct io_uring_params p;
+    unsigned int i;
+    
+    memset(&p, 0, sizeof(p));
+    r = calloc(1, sizeof(*r));
+    if((r->fd = syscall(__NR_io_uring_setup, entries, &p)) < 0) {
+	free(r);
+	return(NULL);
+    }
+    r->sqmapsz = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+    r->cqmapsz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if(p.features & IORING_FEAT_SINGLE_MMAP) {
+	if(r->cqmapsz > r->sqmapsz)
+	    r->sqmapsz = r->cqmapsz;
+	r->cqmapsz = 0;
+    }
+    r->sqesz = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqmap = mmap(NULL, r->sqmapsz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    if(r->sqmap == MAP_FAILED)
+	goto fail;
+    if(r->cqmapsz == 0) {
+	r->cqmap = r->sqmap;
+    } else if((r->cqmap = mmap(NULL, r->cqmapsz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING)) == MAP_FAILED) {
+	r->cqmap = NULL;
+	goto fail;
+    }
+    r->sqes = mmap(NULL, r->sqesz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if(r->sqes == MAP_FAILED) {
+	r->sqes = NULL;
+	goto fail;
+    }
+    r->sqents = p.sq_entries;
+    r->sqmask = *(unsigned int *)(r->sqmap + p.sq_off.ring_mask);
+    r->sqtail = r->sqmap + p.sq_off.tail;
+    r->sqarray = r->sqmap + p.sq_off.array;
+    r->cqmask = *(unsigned int *)(r->cqmap + p.cq_off.ring_mask);
+    r->cqhead = r->cqmap + p.cq_off.head;
+    r->cqtail = r->cqmap + p.cq_off.tail;
+    r->cqes = r->cqmap + p.cq_off.cqes;
+    r->tail = *r->sqtail;
+    /* Never more requests in flight than the submission queue
+     * holds, so the completion queue, which is larger, cannot
+     * overflow. */
+    r->slots = calloc(r->sqents, sizeof(*r->slots));
+    r->free = malloc(sizeof(*r->free) * r->sqents);
+    for(i = 0; i < r->sqents; i++)
+	r->free[i] = i;
+    r->nfree = r->sqents;
+    return(r);
+    
+fail:
+    if(r->sqmap == MAP_FAILED)
+	r->sqmap = NULL;
+    freeuring(r);
+    errno = ENOMEM;
+    return(NULL);
+}
+
+void freeuring(struct uring *r)
+{
+    if(r->sqes != NULL)
+	munmap(r->sqes, r->sqesz);
+    if((r->cqmap != NULL) && (r->cqmap != r->sqmap))
+	munmap(r->cqmap, r->cqmapsz);
+    if(r->sqmap != NULL)
+	munmap(r->sqmap, r->sqmapsz);
+    close(r->fd);
+    if(r->slots != NULL)
+	free(r->slots);
+    if(r->free != NULL)
+	free(r->free);
+    free(r);
+}
+
+/* Submits all queued requests and reaps completions, waiting for at least min of them. */
+static int reap(struct uring *r, unsigned int min)
+{
+    struct io_uring_cqe *cqe;
+    struct uringslot *slot;
+    unsigned int head, tail;
+    ssize_t res;
+    int ret;
+    
+    do {
+	ret = syscall(__NR_io_uring_enter, r->fd, r->queued, min, min?IORING_ENTER_GETEVENTS:0, NULL, 0);
+    } while((ret < 0) && (errno == EINTR));
+    if(ret < 0)
+	return(-1);
+    r->queued -= ret;
+    r->inflight += ret;
+    head = *r->cqhead;
+    while(head != (tail = __atomic_load_n(r->cqtail, __ATOMIC_ACQUIRE))) {
+	for(; head != tail; head++) {
+	    cqe = &r->cqes[head & r->cqmask];
+	    slot = &r->slots[cqe->user_data];
+	    res = cqe->res;
+	    __atomic_store_n(r->cqhead, head + 1, __ATOMIC_RELEASE);
+	    r->inflight--;
+	    r->free[r->nfree++] = slot - r->slots;
+	    /* The callback may queue new requests */
+	    slot->cb(res, slot->pdata);
+	}
+    }
+    return(0);
+}
+
+static int queue(struct uring *r, int op, int fd, void *buf, size_t len, loff_t off, uringcb cb, void *pdata)
+{
+    struct io_uring_sqe *sqe;
+    struct uringslot *slot;
+    unsigned int idx, s;
+    
+    while(r->nfree == 0) {
+	if(reap(r, 1))
+	    return(-1);
+    }
+    s = r->free[--r->nfree];
+    slot = &r->slots[s];
+    slot->cb = cb;
+    slot->pdata = pdata;
+    slot->iov.iov_base = buf;
+    slot->iov.iov_len = len;
+    idx = r->tail & r->sqmask;
+    sqe = &r->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = op;
+    sqe->fd = fd;
+    sqe->off = off;
+    sqe->addr = (unsigned long)&slot->iov;
+    sqe->len = 1;
+    sqe->user_data = s;
+    r->sqarray[idx] = idx;
+    __atomic_store_n(r->sqtail, ++r->tail, __ATOMIC_RELEASE);
+    r->queued++;
+    return(0);
+}
+
+int uringread(struct uring *r, int fd, void *buf, size_t len, loff_t off, uringcb cb, void *pdata)
+{
+    return(queue(r, IORING_OP_READV, fd, buf, len, off, cb, pdata));
+}
+
+int uringwrite(struct uring *r, int fd, const void *buf, size_t len, loff_t off, uringcb cb, void *pdata)
+{
+    return(queue(r, IORING_OP_WRITEV, fd, (void *)buf, len, off, cb, pdata));
+}
+
+/* Submits everything queued and waits until all requests have completed. */
+int uringwait(struct uring *r)
+{
+    while((r->queued > 0) || (r->inflight > 0)) {
+	if(reap(r, 1))
+	    return(-1);
+    }
+    return(0);
+}
+
+/*
+ * Like uringwait(), but meant for error paths: it does not stop at
+ * the first failure, so that nothing is left reading into buffers
+ * the caller is about to free. Returns -1 only if that cannot be
+ * guaranteed, in which case the buffers must be leaked.
+ */
+int uringdrain(struct uring *r)
+{
+    while((r->queued > 0) || (r->inflight > 0)) {
+	if(reap(r, 1) && (errno != EAGAIN) && (errno != EBUSY))
+	    return(-1);
+    }
+    return(0);
+}
+
+#else
+
+struct uring *newuring(unsigned int entries)
+{
+    errno = ENOSYS;
+    return(NULL);
+}
+
+void freeuring(struct uring *r)
+{
+}
+
+int uringread(struct uring *r, int fd, void *buf, size_t len, loff_t off, uringcb cb, void *pdata)
+{
+    errno = ENOSYS;
+    return(-1);
+}
+
+int uringwrite(struct uring *r, int fd, const void *buf, size_t len, loff_t off, uringcb cb, void *pdata)
+{
+    errno = ENOSYS;
+    return(-1);
+}
+
+int uringwait(struct uring *r)
+{
+    return(0);
+}
+
+int uringdrain(struct uring *r)
+{
+    return(0);
+}
+
+#endif
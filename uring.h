@@ -0,0 +1,21 @@
+#ifndef _URING_H
+#define _URING_H
+
+#include <sys/types.h>
+
+struct uring;
+
+/*
+ * Completion callbacks get the number of bytes transferred, or a
+ * negated errno value.
+ */
+typedef void (*uringcb)(ssize_t ret, void *pdata);
+
+struct uring *newuring(unsigned int entries);
+void freeuring(struct uring *r);
+int uringread(struct uring *r, int fd, void *buf, size_t len, loff_t off, uringcb cb, void *pdata);
+int uringwrite(struct uring *r, int fd, const void *buf, size_t len, loff_t off, uringcb cb, void *pdata);
+int uringwait(struct uring *r);
+int uringdrain(struct uring *r);
+
+#endif
@@ -0,0 +1,776 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include "store.h"
+#include "blocktree.h"
+#include "vcfs.h"
+#include "chunk.h"
+#include "revs.h"
+
+/*
+ * vcexport writes a revision to stdout as a tar archive, reading it
+ * straight from the store rather than through a mount. The main
+ * thread walks the directory tree and lays the archive out in a ring
+ * of slots, each holding the tar headers and the data block
+ * addresses of as many files as fit. Reader threads, each with a
+ * store of its own, fetch all the blocks of a slot with one
+ * storegetmany(), which lets the store read them in log order, and a
+ * writer thread writes the slots out in order with writev(), right
+ * from the buffers the blocks were read into. Holes are written from
+ * a buffer of zeroes.
+ */
+
+/* Data blocks and bytes per slot */
+#define SLOTBLKS 1024
+#define SLOTDATA (8 << 20)
+/* Header bytes after which a slot is handed on */
+#define SLOTHDR (1 << 20)
+#define DIRBATCH 256
+#define INOBATCH 256
+#define TARBLK 512
+#define TARREC 10240
+
+/* Slot states */
+#define SL_FREE 0
+#define SL_FILLING 1
+#define SL_READY 2
+#define SL_READING 3
+#define SL_DONE 4
+
+/* Pieces of a slot, in archive order */
+#define PC_HDR 0	/* len bytes of hdr at off */
+#define PC_BLK 1	/* Data block off */
+#define PC_END 2	/* The end of a file of len bytes, padded to TARBLK */
+
+struct piece {
+    int type;
+    size_t off, len;
+    char *path;
+};
+
+struct slot {
+    int state;
+    char *hdr;
+    size_t hlen, hsz;
+    struct piece *pcs;
+    int npcs, pcsz;
+    char *data;
+    size_t dlen;
+    int nblks;
+    struct addr as[SLOTBLKS];
+    void *bufs[SLOTBLKS];
+    size_t lens[SLOTBLKS];
+    ssize_t szs[SLOTBLKS];
+};
+
+struct export {
+    char *fsdir;
+    struct store *st;
+    struct btnode inotab;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct slot *slots, *cur;
+    int nslots;
+    long pseq, rseq, wseq;
+    int done, err;
+    u_int64_t aoff, fpos;
+    size_t nfiles;
+    u_int64_t nbytes;
+};
+
+struct ustar {
+    char name[100];
+    char mode[8];
+    char uid[8];
+    char gid[8];
+    char size[12];
+    char mtime[12];
+    char chksum[8];
+    char type;
+    char linkname[100];
+    char magic[6];
+    char version[2];
+    char uname[32];
+    char gname[32];
+    char devmajor[8];
+    char devminor[8];
+    char prefix[155];
+    char pad[12];
+};
+
+static char zeroes[CDCMAX];
+
+#define min(a, b) (((b) < (a))?(b):(a))
+
+static void seterr(struct export *ex)
+{
+    pthread_mutex_lock(&ex->lock);
+    ex->err = 1;
+    pthread_cond_broadcast(&ex->cond);
+    pthread_mutex_unlock(&ex->lock);
+}
+
+/* Returns the slot being filled, waiting for one to come free */
+static struct slot *curslot(struct export *ex)
+{
+    struct slot *s;
+    
+    if(ex->cur != NULL)
+	return(ex->cur);
+    s = &ex->slots[ex->pseq % ex->nslots];
+    pthread_mutex_lock(&ex->lock);
+    while(!ex->err && (s->state != SL_FREE))
+	pthread_cond_wait(&ex->cond, &ex->lock);
+    pthread_mutex_unlock(&ex->lock);
+    if(ex->err)
+	return(NULL);
+    s->state = SL_FILLING;
+    s->hlen = 0;
+    s->npcs = 0;
+    s->dlen = 0;
+    s->nblks = 0;
+    return(ex->cur = s);
+}
+
+static void publish(struct export *ex)
+{
+    if(ex->cur == NULL)
+	return;
+    pthread_mutex_lock(&ex->lock);
+    ex->cur->state = SL_READY;
+    ex->pseq++;
+    pthread_cond_broadcast(&ex->cond);
+    pthread_mutex_unlock(&ex->lock);
+    ex->cur = NULL;
+}
+
+static void addpiece(struct slot *s, int type, size_t off, size_t len, char *path)
+{
+    struct piece *pc;
+    
+    if(s->npcs == s->pcsz) {
+	s->pcsz = (s->pcsz == 0)?256:(s->pcsz * 2);
+	s->pcs = realloc(s->pcs, sizeof(*s->pcs) * s->pcsz);
+    }
+    pc = &s->pcs[s->npcs++];
+    pc->type = type;
+    pc->off = off;
+    pc->len = len;
+    pc->path = path;
+}
+
+static int addhdr(struct export *ex, const void *buf, size_t len)
+{
+    struct slot *s;
+    struct piece *pc;
+    
+    if(((s = curslot(ex)) != NULL) && (s->hlen + len > SLOTHDR) && (s->hlen > 0)) {
+	publish(ex);
+	s = curslot(ex);
+    }
+    if(s == NULL)
+	return(-1);
+    if(s->hlen + len > s->hsz) {
+	while(s->hlen + len > s->hsz)
+	    s->hsz = (s->hsz == 0)?65536:(s->hsz * 2);
+	s->hdr = realloc(s->hdr, s->hsz);
+    }
+    if(buf == NULL)
+	memset(s->hdr + s->hlen, 0, len);
+    else
+	memcpy(s->hdr + s->hlen, buf, len);
+    pc = (s->npcs > 0)?&s->pcs[s->npcs - 1]:NULL;
+    if((pc != NULL) && (pc->type == PC_HDR) && (pc->off + pc->len == s->hlen))
+	pc->len += len;
+    else
+	addpiece(s, PC_HDR, s->hlen, len, NULL);
+    s->hlen += len;
+    ex->aoff += len;
+    return(0);
+}
+
+/*
+ * Stores v in a numeric header field of w bytes, in octal if it
+ * fits, and in the base-256 form of GNU tar otherwise.
+ */
+static void tarnum(char *f, size_t w, u_int64_t v)
+{
+    int i;
+    
+    if(v < (1ULL << (3 * (w - 1)))) {
+	for(i = w - 2; i >= 0; i--, v >>= 3)
+	    f[i] = '0' + (v & 7);
+	f[w - 1] = 0;
+	return;
+    }
+    for(i = w - 1; i > 0; i--, v >>= 8)
+	f[i] = v & 0xff;
+    f[0] = 0x80;
+}
+
+static void tarsum(struct ustar *h)
+{
+    unsigned char *p;
+    unsigned int sum;
+    int i;
+    
+    memset(h->chksum, ' ', sizeof(h->chksum));
+    for(p = (unsigned char *)h, sum = 0, i = 0; i < sizeof(*h); i++)
+	sum += p[i];
+    snprintf(h->chksum, sizeof(h->chksum), "%06o", sum);
+    h->chksum[7] = ' ';
+}
+
+/* Appends a pax record, whose length counts its own digits */
+static size_t paxrec(char *buf, size_t off, const char *key, const char *val)
+{
+    size_t l, n;
+    
+    l = strlen(key) + strlen(val) + 3;
+    for(n = l + 1; snprintf(NULL, 0, "%zu", n) + l != n; n++);
+    return(off + sprintf(buf + off, "%zu %s=%s\n", n, key, val));
+}
+
+/*
+ * Splits path between the name and prefix fields, if it can be
+ * split at a slash so that both parts fit.
+ */
+static int tarname(struct ustar *h, const char *path)
+{
+    size_t l;
+    const char *p;
+    
+    if((l = strlen(path)) <= sizeof(h->name)) {
+	memcpy(h->name, path, l);
+	return(0);
+    }
+    for(p = path + l - 1; p > path; p--) {
+	if((*p == '/') && (l - (p - path) - 1 <= sizeof(h->name)) && (p - path <= sizeof(h->prefix)) && (p[1] != 0))
+	    break;
+    }
+    if(p == path || (p - path > sizeof(h->prefix)))
+	return(-1);
+    memcpy(h->prefix, path, p - path);
+    memcpy(h->name, p + 1, l - (p - path) - 1);
+    return(0);
+}
+
+/*
+ * Adds the header of an entry to the archive, preceded by a pax
+ * header holding its path and link target if they do not fit.
+ */
+static int addentry(struct export *ex, const char *path, struct inode *ino, char type, const char *link, u_int64_t size)
+{
+    struct ustar h, xh;
+    char *xbuf;
+    size_t xlen;
+    int ret;
+    
+    memset(&h, 0, sizeof(h));
+    xbuf = NULL;
+    xlen = 0;
+    if(tarname(&h, path)) {
+	xbuf = malloc(strlen(path) + (link?strlen(link):0) + 64);
+	xlen = paxrec(xbuf, xlen, "path", path);
+	strncpy(h.name, path, sizeof(h.name));
+    }
+    if(link != NULL) {
+	if(strlen(link) > sizeof(h.linkname)) {
+	    if(xbuf == NULL)
+		xbuf = malloc(strlen(link) + 64);
+	    xlen = paxrec(xbuf, xlen, "linkpath", link);
+	}
+	strncpy(h.linkname, link, sizeof(h.linkname));
+    }
+    tarnum(h.mode, sizeof(h.mode), ino->mode & 07777);
+    tarnum(h.uid, sizeof(h.uid), ino->uid);
+    tarnum(h.gid, sizeof(h.gid), ino->gid);
+    tarnum(h.size, sizeof(h.size), size);
+    tarnum(h.mtime, sizeof(h.mtime), ino->mtime);
+    h.type = type;
+    memcpy(h.magic, "ustar", 6);
+    memcpy(h.version, "00", 2);
+    tarnum(h.devmajor, sizeof(h.devmajor), 0);
+    tarnum(h.devminor, sizeof(h.devminor), 0);
+    ret = 0;
+    if(xbuf != NULL) {
+	xh = h;
+	memset(xh.name, 0, sizeof(xh.name));
+	memset(xh.prefix, 0, sizeof(xh.prefix));
+	memset(xh.linkname, 0, sizeof(xh.linkname));
+	strcpy(xh.name, "././@PaxHeader");
+	tarnum(xh.size, sizeof(xh.size), xlen);
+	xh.type = 'x';
+	tarsum(&xh);
+	if(addhdr(ex, &xh, sizeof(xh)) || addhdr(ex, xbuf, xlen) ||
+	   addhdr(ex, NULL, (TARBLK - (xlen % TARBLK)) % TARBLK))
+	    ret = -1;
+	free(xbuf);
+    }
+    tarsum(&h);
+    if(!ret && addhdr(ex, &h, sizeof(h)))
+	ret = -1;
+    return(ret);
+}
+
+/*
+ * Lays out the data of a file, in blocks of known length for files
+ * of fixed-size blocks, and of at most CDCMAX bytes for chunked
+ * ones.
+ */
+static int adddata(struct export *ex, const char *path, struct inode *ino)
+{
+    struct slot *s;
+    block_t bl, nb;
+    size_t len;
+    int i, k, n, got;
+    
+    nb = (ino->size + FILEBLKSZ - 1) / FILEBLKSZ;
+    for(bl = 0; (ino->chunks.d != 0) || (bl < nb); bl += got) {
+	if((s = curslot(ex)) == NULL)
+	    return(-1);
+	len = (ino->chunks.d != 0)?CDCMAX:FILEBLKSZ;
+	n = min(SLOTBLKS - s->nblks, (SLOTDATA - s->dlen) / len);
+	if(ino->chunks.d == 0)
+	    n = min(n, nb - bl);
+	if(n == 0) {
+	    publish(ex);
+	    got = 0;
+	    continue;
+	}
+	if((got = btleaves(ex->st, &ino->data, bl, n, s->as + s->nblks, FILEBLSIZE)) < 0) {
+	    fprintf(stderr, "vcexport: %s: %s\n", path, strerror(errno));
+	    return(-1);
+	}
+	for(i = 0; i < got; i++) {
+	    k = s->nblks++;
+	    if(ino->chunks.d == 0)
+		len = min(FILEBLKSZ, ino->size - ((bl + i) * FILEBLKSZ));
+	    s->bufs[k] = s->data + s->dlen;
+	    s->lens[k] = len;
+	    s->dlen += len;
+	    addpiece(s, PC_BLK, k, 0, NULL);
+	}
+	if(got < n)
+	    break;
+    }
+    if((s = curslot(ex)) == NULL)
+	return(-1);
+    addpiece(s, PC_END, 0, ino->size, strdup(path));
+    ex->aoff += ino->size + ((TARBLK - (ino->size % TARBLK)) % TARBLK);
+    return(0);
+}
+
+struct entry {
+    vc_ino_t ino;
+    int i;
+};
+
+static int entrycmp(const struct entry *a, const struct entry *b)
+{
+    return((a->ino < b->ino)?-1:((a->ino > b->ino)?1:0));
+}
+
+/*
+ * Gets the inodes of the entries of a directory. vcfs and vcimport
+ * mostly give the entries of a directory consecutive numbers, so
+ * they are fetched in runs of numbers close together.
+ */
+static int getinodes(struct export *ex, struct dentry *dents, struct inode *inos, int n)
+{
+    struct entry *ord;
+    struct inode buf[INOBATCH];
+    void *bufs[INOBATCH];
+    size_t lens[INOBATCH];
+    ssize_t szs[INOBATCH];
+    vc_ino_t first;
+    int i, j, k, c;
+    
+    ord = malloc(sizeof(*ord) * n);
+    for(i = 0; i < n; i++) {
+	ord[i].ino = dents[i].inode;
+	ord[i].i = i;
+    }
+    qsort(ord, n, sizeof(*ord), (int (*)(const void *, const void *))entrycmp);
+    for(i = 0; i < INOBATCH; i++) {
+	bufs[i] = &buf[i];
+	lens[i] = sizeof(buf[i]);
+    }
+    for(i = 0; i < n; i = j) {
+	first = ord[i].ino;
+	for(j = i + 1; (j < n) && (ord[j].ino - first < INOBATCH); j++);
+	c = ord[j - 1].ino - first + 1;
+	if(btgetmany(ex->st, &ex->inotab, first, c, bufs, lens, szs, INOBLSIZE) != c) {
+	    free(ord);
+	    return(-1);
+	}
+	for(k = i; k < j; k++) {
+	    inos[ord[k].i] = buf[ord[k].ino - first];
+	    if(szs[ord[k].ino - first] == OLDINOSZ) {
+		memset(&inos[ord[k].i].chunks, 0, sizeof(inos[ord[k].i].chunks));
+	    } else if(szs[ord[k].ino - first] != sizeof(struct inode)) {
+		free(ord);
+		errno = EIO;
+		return(-1);
+	    }
+	}
+    }
+    free(ord);
+    return(0);
+}
+
+static int exportdir(struct export *ex, const char *path, struct inode *dir)
+{
+    struct dentry *dents;
+    struct inode *inos;
+    void *bufs[DIRBATCH];
+    size_t lens[DIRBATCH];
+    ssize_t szs[DIRBATCH];
+    char *cpath, link[4096];
+    ssize_t sz;
+    block_t i;
+    int j, n, nd, base, ret;
+    
+    dents = malloc(sizeof(*dents) * (dir->size + 1));
+    for(i = 0, nd = 0; i < dir->size; i += n) {
+	n = min(DIRBATCH, dir->size - i);
+	for(j = 0; j < n; j++) {
+	    bufs[j] = &dents[nd + j];
+	    lens[j] = sizeof(dents[nd + j]);
+	}
+	if((n = btgetmany(ex->st, &dir->data, i, n, bufs, lens, szs, DIRBLSIZE)) <= 0) {
+	    if(n == 0)
+		errno = EIO;
+	    fprintf(stderr, "vcexport: %s: %s\n", path, strerror(errno));
+	    free(dents);
+	    return(-1);
+	}
+	/* Skip "." and ".." */
+	for(j = 0, base = nd; j < n; j++) {
+	    dents[base + j].name[sizeof(dents[0].name) - 1] = 0;
+	    if(strcmp(dents[base + j].name, ".") && strcmp(dents[base + j].name, "..")) {
+		if(nd != base + j)
+		    dents[nd] = dents[base + j];
+		nd++;
+	    }
+	}
+    }
+    inos = malloc(sizeof(*inos) * (nd + 1));
+    if(getinodes(ex, dents, inos, nd)) {
+	fprintf(stderr, "vcexport: %s: could not read inodes: %s\n", path, strerror(errno));
+	free(dents);
+	free(inos);
+	return(-1);
+    }
+    ret = 0;
+    for(j = 0; !ret && (j < nd); j++) {
+	cpath = malloc(strlen(path) + strlen(dents[j].name) + 3);
+	sprintf(cpath, "%s/%s", path, dents[j].name);
+	switch(inos[j].mode & S_IFMT) {
+	case S_IFDIR:
+	    strcat(cpath, "/");
+	    if(addentry(ex, cpath, &inos[j], '5', NULL, 0)) {
+		ret = -1;
+		break;
+	    }
+	    cpath[strlen(cpath) - 1] = 0;
+	    ret = exportdir(ex, cpath, &inos[j]);
+	    break;
+	case S_IFREG:
+	    if(addentry(ex, cpath, &inos[j], '0', NULL, inos[j].size) || adddata(ex, cpath, &inos[j]))
+		ret = -1;
+	    ex->nfiles++;
+	    ex->nbytes += inos[j].size;
+	    break;
+	case S_IFLNK:
+	    sz = 0;
+	    if((inos[j].size > 0) && ((sz = btget(ex->st, &inos[j].data, 0, link, sizeof(link) - 1, FILEBLSIZE)) < 0)) {
+		fprintf(stderr, "vcexport: %s: %s\n", cpath, strerror(errno));
+		ret = -1;
+		break;
+	    }
+	    link[min(sz, sizeof(link) - 1)] = 0;
+	    ret = addentry(ex, cpath, &inos[j], '2', link, 0);
+	    break;
+	case S_IFCHR:
+	    ret = addentry(ex, cpath, &inos[j], '3', NULL, 0);
+	    break;
+	case S_IFBLK:
+	    ret = addentry(ex, cpath, &inos[j], '4', NULL, 0);
+	    break;
+	case S_IFIFO:
+	    ret = addentry(ex, cpath, &inos[j], '6', NULL, 0);
+	    break;
+	default:
+	    fprintf(stderr, "vcexport: %s: cannot be archived, skipping\n", cpath);
+	    break;
+	}
+	free(cpath);
+    }
+    free(dents);
+    free(inos);
+    return(ret);
+}
+
+static int readslot(struct store *st, struct slot *s)
+{
+    void *bufs[SLOTBLKS];
+    size_t lens[SLOTBLKS];
+    struct addr as[SLOTBLKS];
+    ssize_t szs[SLOTBLKS];
+    int i, m;
+    
+    for(i = 0, m = 0; i < s->nblks; i++) {
+	if((s->szs[i] = btholelen(&s->as[i])) < 0) {
+	    bufs[m] = s->bufs[i];
+	    lens[m] = s->lens[i];
+	    as[m++] = s->as[i];
+	}
+    }
+    if(storegetmany(st, bufs, lens, as, szs, m))
+	return(-1);
+    for(i = 0, m = 0; i < s->nblks; i++) {
+	if(s->szs[i] < 0)
+	    s->szs[i] = szs[m++];
+	if((s->szs[i] < 0) || (s->szs[i] > s->lens[i])) {
+	    fprintf(stderr, "vcexport: block %s is %s\n", formataddr(&s->as[i]), (s->szs[i] < 0)?"missing":"too large");
+	    errno = EIO;
+	    return(-1);
+	}
+    }
+    return(0);
+}
+
+static void *reader(struct export *ex)
+{
+    struct store *st;
+    struct slot *s;
+    int ret;
+    
+    if((st = openstore(ex->fsdir, 0)) == NULL) {
+	seterr(ex);
+	return(NULL);
+    }
+    /* Nothing is read twice */
+    storenocache(st);
+    pthread_mutex_lock(&ex->lock);
+    while(1) {
+	while(!ex->err && !ex->done && (ex->rseq == ex->pseq))
+	    pthread_cond_wait(&ex->cond, &ex->lock);
+	if(ex->err || (ex->rseq == ex->pseq))
+	    break;
+	s = &ex->slots[ex->rseq++ % ex->nslots];
+	s->state = SL_READING;
+	pthread_mutex_unlock(&ex->lock);
+	if((ret = readslot(st, s)) != 0)
+	    fprintf(stderr, "vcexport: could not read data: %s\n", strerror(errno));
+	pthread_mutex_lock(&ex->lock);
+	if(ret)
+	    ex->err = 1;
+	else
+	    s->state = SL_DONE;
+	pthread_cond_broadcast(&ex->cond);
+    }
+    pthread_mutex_unlock(&ex->lock);
+    releasestore(st);
+    return(NULL);
+}
+
+static int writevall(int fd, struct iovec *iov, int n)
+{
+    ssize_t ret;
+    
+    while(n > 0) {
+	if((ret = writev(fd, iov, min(n, IOV_MAX))) < 0) {
+	    if(errno == EINTR)
+		continue;
+	    return(-1);
+	}
+	while((n > 0) && (ret >= iov->iov_len)) {
+	    ret -= iov->iov_len;
+	    iov++;
+	    n--;
+	}
+	if(n > 0) {
+	    iov->iov_base += ret;
+	    iov->iov_len -= ret;
+	}
+    }
+    return(0);
+}
+
+static int writeslot(struct export *ex, struct slot *s, struct iovec *iov)
+{
+    struct piece *pc;
+    int i, n;
+    
+    for(i = 0, n = 0; i < s->npcs; i++) {
+	pc = &s->pcs[i];
+	if(pc->type == PC_HDR) {
+	    iov[n].iov_base = s->hdr + pc->off;
+	    iov[n++].iov_len = pc->len;
+	} else if(pc->type == PC_BLK) {
+	    iov[n].iov_base = (btholelen(&s->as[pc->off]) >= 0)?zeroes:s->bufs[pc->off];
+	    iov[n++].iov_len = s->szs[pc->off];
+	    ex->fpos += s->szs[pc->off];
+	} else {
+	    if(ex->fpos != pc->len) {
+		fprintf(stderr, "vcexport: %s: data does not match its size\n", pc->path);
+		errno = EIO;
+		return(-1);
+	    }
+	    iov[n].iov_base = zeroes;
+	    iov[n++].iov_len = (TARBLK - (pc->len % TARBLK)) % TARBLK;
+	    ex->fpos = 0;
+	    free(pc->path);
+	}
+    }
+    if(writevall(1, iov, n)) {
+	fprintf(stderr, "vcexport: write error: %s\n", strerror(errno));
+	return(-1);
+    }
+    return(0);
+}
+
+static void *writer(struct export *ex)
+{
+    struct slot *s;
+    struct iovec *iov;
+    size_t iovsz;
+    int ret;
+    
+    iov = NULL;
+    iovsz = 0;
+    pthread_mutex_lock(&ex->lock);
+    while(1) {
+	s = &ex->slots[ex->wseq % ex->nslots];
+	while(!ex->err && !(ex->done && (ex->wseq == ex->pseq)) && ((ex->wseq == ex->pseq) || (s->state != SL_DONE)))
+	    pthread_cond_wait(&ex->cond, &ex->lock);
+	if(ex->err || (ex->wseq == ex->pseq))
+	    break;
+	pthread_mutex_unlock(&ex->lock);
+	if(s->npcs > iovsz) {
+	    iovsz = s->npcs;
+	    iov = realloc(iov, sizeof(*iov) * iovsz);
+	}
+	ret = writeslot(ex, s, iov);
+	pthread_mutex_lock(&ex->lock);
+	if(ret) {
+	    ex->err = 1;
+	} else {
+	    s->state = SL_FREE;
+	    ex->wseq++;
+	}
+	pthread_cond_broadcast(&ex->cond);
+    }
+    pthread_mutex_unlock(&ex->lock);
+    if(iov != NULL)
+	free(iov);
+    return(NULL);
+}
+
+static void usage(FILE *out)
+{
+    fprintf(out, "usage: vcexport [-h] [-j THREADS] DIR [REV|@TIME]\n");
+}
+
+int main(int argc, char **argv)
+{
+    struct export ex;
+    struct revdb *db;
+    struct revrec rr;
+    struct inode root;
+    vc_rev_t rev;
+    pthread_t *threads;
+    int c, i, nthreads;
+    ssize_t sz;
+    
+    memset(&ex, 0, sizeof(ex));
+    nthreads = 4;
+    while((c = getopt(argc, argv, "hj:")) >= 0) {
+	switch(c) {
+	case 'j':
+	    nthreads = atoi(optarg);
+	    break;
+	case 'h':
+	    usage(stdout);
+	    exit(0);
+	default:
+	    usage(stderr);
+	    exit(1);
+	}
+    }
+    if(argc - optind < 1) {
+	usage(stderr);
+	exit(1);
+    }
+    if(nthreads < 1)
+	nthreads = 1;
+    ex.fsdir = argv[optind];
+    if(isatty(1)) {
+	fprintf(stderr, "vcexport: will not write an archive to a terminal\n");
+	exit(1);
+    }
+    
+    if((db = openrevdb(ex.fsdir, 0)) == NULL)
+	exit(1);
+    rev = db->n - 1;
+    if((argc - optind > 1) && ((rev = parserev(db, argv[optind + 1])) < 0)) {
+	fprintf(stderr, "vcexport: %s: %s\n", argv[optind + 1], strerror(errno));
+	exit(1);
+    }
+    if(revget(db, rev, &rr)) {
+	fprintf(stderr, "vcexport: could not read revision %lli: %s\n", (long long)rev, strerror(errno));
+	exit(1);
+    }
+    closerevdb(db);
+    if((ex.st = openstore(ex.fsdir, 0)) == NULL)
+	exit(1);
+    ex.inotab = rr.root;
+    if((sz = btget(ex.st, &ex.inotab, 0, &root, sizeof(root), INOBLSIZE)) < 0) {
+	fprintf(stderr, "vcexport: could not read the root directory: %s\n", strerror(errno));
+	exit(1);
+    }
+    if(sz == OLDINOSZ)
+	memset(&root.chunks, 0, sizeof(root.chunks));
+    
+    ex.nslots = (nthreads * 2) + 2;
+    ex.slots = calloc(ex.nslots, sizeof(*ex.slots));
+    for(i = 0; i < ex.nslots; i++)
+	ex.slots[i].data = malloc(SLOTDATA);
+    pthread_mutex_init(&ex.lock, NULL);
+    pthread_cond_init(&ex.cond, NULL);
+    threads = malloc(sizeof(*threads) * (nthreads + 1));
+    for(i = 0; i < nthreads; i++)
+	pthread_create(&threads[i], NULL, (void *(*)(void *))reader, &ex);
+    pthread_create(&threads[nthreads], NULL, (void *(*)(void *))writer, &ex);
+    
+    if(!addentry(&ex, "./", &root, '5', NULL, 0) && !exportdir(&ex, ".", &root)) {
+	/* Two zero blocks end the archive, which is padded to a whole record */
+	addhdr(&ex, NULL, 2 * TARBLK);
+	addhdr(&ex, NULL, (TARREC - (ex.aoff % TARREC)) % TARREC);
+    } else {
+	seterr(&ex);
+    }
+    publish(&ex);
+    pthread_mutex_lock(&ex.lock);
+    ex.done = 1;
+    pthread_cond_broadcast(&ex.cond);
+    pthread_mutex_unlock(&ex.lock);
+    for(i = 0; i <= nthreads; i++)
+	pthread_join(threads[i], NULL);
+    if(ex.err)
+	exit(1);
+    releasestore(ex.st);
+    
+    fprintf(stderr, "exported %zu files (%llu bytes) of revision %lli\n", ex.nfiles, (unsigned long long)ex.nbytes, (long long)rev);
+    return(0);
+}
@@ -1,11 +1,15 @@
 #define _LARGEFILE64_SOURCE
 #include <stdlib.h>
 #include <stdio.h>
+#include <stddef.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <string.h>
 #include <errno.h>
 #include <assert.h>
+#include <pthread.h>
+#include <sys/xattr.h>
+#include <linux/falloc.h>
 #include <fuse_lowlevel.h>
 
 #include "utils.h"
@@ -13,6 +17,8 @@
 #include "store.h"
 #include "blocktree.h"
 #include "vcfs.h"
+#include "revs.h"
+#include "chunk.h"
 
 /* XXX: The current i-numbering scheme sucks. */
 
@@ -30,14 +36,51 @@ struct inoc {
 
 struct vcfsdata {
     struct store *st;
-    int revfd;
-    vc_rev_t currev;
+    struct revdb *revs;
     vc_ino_t nextino;
     struct btnode inotab;
     struct btree *inocbf, *inocbv;
     fuse_ino_t inocser;
+    fuse_ino_t revsino;
+    int stflags;
+    pthread_t warmth;
+    int warming;
+    volatile int warmstop;
+    pthread_mutex_t warmlock;
+    struct addr *warmas;
+    int warmn, warmoff;
+    time_t hotsaved;
 };
 
+/*
+ * The addresses of the most recently used blocks are saved in the
+ * manifest HOTFILE every HOTSAVEINT seconds and when the filesystem
+ * is unmounted. With "-o warm", they are read back in the background
+ * at the next mount, through a store of the warming thread's own,
+ * which brings them into the page cache (or the cache of a storesrv)
+ * before they are first needed. Since fsd->st is not for use by
+ * other threads, the warmer then hands each chunk it has read over to
+ * the FUSE thread, which loads WARMSTEP blocks at a time of them into
+ * the cache of fsd->st between requests. Reads through FST_DIRECT
+ * bypass the page cache, so then all of them are handed over at once.
+ */
+#define HOTFILE "hot"
+#define HOTMAX 16384
+#define WARMCHUNK 4096
+#define WARMSTEP 64
+#define HOTSAVEINT 600
+
+/*
+ * Historical revisions are reachable, read-only, through a virtual
+ * directory in the root (which is not listed by readdir), as either
+ * "/.revs/N" for revision N or "/.revs/@T" for the latest revision
+ * committed at or before the Unix time T. Since nothing under a
+ * historical inode table can ever change, the kernel is allowed to
+ * cache it indefinitely.
+ */
+#define REVSDIR ".revs"
+#define IMMUTTIMEOUT 1e9
+
 #define max(a, b) (((b) > (a))?(b):(a))
 static struct btnode nilnode = {0, };
 
@@ -132,9 +175,16 @@ static void *btreeget(struct btree *tree, void *key, int (*cmp)(void *, void *))
 
 static void dstrvcfs(struct vcfsdata *fsd)
 {
+    if(fsd->warming) {
+	fsd->warmstop = 1;
+	pthread_join(fsd->warmth, NULL);
+	if(fsd->warmas != NULL)
+	    free(fsd->warmas);
+    }
+    if(storesavehot(fsd->st, HOTFILE, HOTMAX))
+	flog(LOG_WARNING, "could not save %s: %s", HOTFILE, strerror(errno));
     releasestore(fsd->st);
-    fsync(fsd->revfd);
-    close(fsd->revfd);
+    closerevdb(fsd->revs);
     free(fsd);
 }
 
@@ -190,45 +240,52 @@ static fuse_ino_t cacheinode(struct vcfsdata *fsd, vc_ino_t inode, struct btnode
     return(ret);
 }
 
-static struct vcfsdata *initvcfs(char *dir)
+/*
+ * If revspec is non-NULL, the filesystem is opened read-only at the
+ * revision it specifies (see parserev()) instead of at the latest
+ * one. stflags are passed on to openstore().
+ */
+static struct vcfsdata *initvcfs(char *dir, char *revspec, int stflags)
 {
     struct vcfsdata *fsd;
-    char tbuf[1024];
-    struct stat64 sb;
-    struct revrec cr;
+    struct revrec cr, fr;
+    vc_rev_t rev;
     
     fsd = calloc(1, sizeof(*fsd));
-    snprintf(tbuf, sizeof(tbuf), "%s/revs", dir);
-    if((fsd->revfd = open(tbuf, O_RDWR | O_LARGEFILE)) < 0) {
-	flog(LOG_ERR, "could not open revision database: %s", strerror(errno));
-	free(fsd);
-	return(NULL);
-    }
-    if(fstat64(fsd->revfd, &sb)) {
-	flog(LOG_ERR, "could not stat revision database: %s", strerror(errno));
-	close(fsd->revfd);
+    pthread_mutex_init(&fsd->warmlock, NULL);
+    fsd->hotsaved = time(NULL);
+    if((fsd->revs = openrevdb(dir, 1)) == NULL) {
 	free(fsd);
 	return(NULL);
     }
-    if(sb.st_size % sizeof(struct revrec) != 0) {
-	flog(LOG_ERR, "revision database has illegal size");
-	close(fsd->revfd);
-	free(fsd);
-	return(NULL);
-    }
-    fsd->currev = (sb.st_size / sizeof(struct revrec)) - 1;
-    assert(!readall(fsd->revfd, &cr, sizeof(cr), fsd->currev * sizeof(struct revrec)));
+    assert(!revget(fsd->revs, fsd->revs->n - 1, &cr));
     fsd->inotab = cr.root;
-    if((fsd->st = newfstore(dir)) == NULL) {
-	close(fsd->revfd);
+    if(revspec != NULL) {
+	if((rev = parserev(fsd->revs, revspec)) < 0) {
+	    flog(LOG_ERR, "no such revision: %s", revspec);
+	    closerevdb(fsd->revs);
+	    free(fsd);
+	    return(NULL);
+	}
+	if(revget(fsd->revs, rev, &fr)) {
+	    flog(LOG_ERR, "revision %s has been expunged", revspec);
+	    closerevdb(fsd->revs);
+	    free(fsd);
+	    return(NULL);
+	}
+    }
+    if((fsd->st = openstore(dir, stflags)) == NULL) {
+	closerevdb(fsd->revs);
 	free(fsd);
 	return(NULL);
     }
+    fsd->stflags = stflags;
     fsd->inocser = 1;
-    cacheinode(fsd, 0, nilnode);
+    cacheinode(fsd, 0, (revspec != NULL)?fr.root:nilnode);
+    fsd->revsino = fsd->inocser++;
     if((fsd->nextino = btcount(fsd->st, &fsd->inotab, INOBLSIZE)) < 0) {
-	flog(LOG_ERR, "could not count inodes: %s");
-	close(fsd->revfd);
+	flog(LOG_ERR, "could not count inodes: %s", strerror(errno));
+	closerevdb(fsd->revs);
 	releasestore(fsd->st);
 	free(fsd);
 	return(NULL);
@@ -236,6 +293,101 @@ static struct vcfsdata *initvcfs(char *dir)
     return(fsd);
 }
 
+static void *warmer(struct vcfsdata *fsd)
+{
+    struct store *st;
+    struct addr *as;
+    int i, n, c;
+    
+    if((as = storeloadhot(HOTFILE, &n)) == NULL) {
+	if(errno != ENOENT)
+	    flog(LOG_WARNING, "could not read %s: %s", HOTFILE, strerror(errno));
+	return(NULL);
+    }
+    pthread_mutex_lock(&fsd->warmlock);
+    fsd->warmas = as;
+    pthread_mutex_unlock(&fsd->warmlock);
+    st = NULL;
+    /* The mount's own store does any scrubbing */
+    if(!(fsd->stflags & FST_DIRECT) && ((st = openstore(".", fsd->stflags & ~FST_SCRUB)) != NULL))
+	storenocache(st);
+    for(i = 0; (i < n) && !fsd->warmstop; i += c) {
+	c = (n - i < WARMCHUNK)?(n - i):WARMCHUNK;
+	if((st != NULL) && storewarm(st, as + i, c)) {
+	    flog(LOG_WARNING, "could not warm up cache: %s", strerror(errno));
+	    break;
+	}
+	pthread_mutex_lock(&fsd->warmlock);
+	fsd->warmn = i + c;
+	pthread_mutex_unlock(&fsd->warmlock);
+    }
+    if(st != NULL)
+	releasestore(st);
+    return(NULL);
+}
+
+/*
+ * Called by the FUSE thread before serving requests, to load some of
+ * what the warmer has read into the cache of fsd->st, and to save the
+ * manifest of hot blocks now and then.
+ */
+static void housekeep(struct vcfsdata *fsd)
+{
+    struct addr as[WARMSTEP];
+    time_t now;
+    int n;
+    
+    if(fsd->warming) {
+	pthread_mutex_lock(&fsd->warmlock);
+	n = fsd->warmn - fsd->warmoff;
+	if(n > WARMSTEP)
+	    n = WARMSTEP;
+	if(n > 0)
+	    memcpy(as, fsd->warmas + fsd->warmoff, sizeof(*as) * n);
+	fsd->warmoff += n;
+	pthread_mutex_unlock(&fsd->warmlock);
+	if((n > 0) && storewarm(fsd->st, as, n))
+	    flog(LOG_WARNING, "could not warm up cache: %s", strerror(errno));
+    }
+    now = time(NULL);
+    if(now - fsd->hotsaved >= HOTSAVEINT) {
+	if(storesavehot(fsd->st, HOTFILE, HOTMAX))
+	    flog(LOG_WARNING, "could not save %s: %s", HOTFILE, strerror(errno));
+	fsd->hotsaved = now;
+    }
+}
+
+struct leaves {
+    struct addr *as;
+    int n, sz;
+};
+
+static int addleaf(struct btnode *node, struct leaves *lv)
+{
+    if((node->d & 0x7f) != 0)
+	return(0);
+    if(lv->n == lv->sz)
+	lv->as = realloc(lv->as, sizeof(*lv->as) * (lv->sz = (lv->sz == 0)?1024:(lv->sz * 2)));
+    lv->as[lv->n++] = node->a;
+    return(0);
+}
+
+/* Reads the whole current inode table into the store cache. */
+static int preloadinotab(struct vcfsdata *fsd)
+{
+    struct leaves lv;
+    int ret;
+    
+    memset(&lv, 0, sizeof(lv));
+    if(btwalk(fsd->st, &fsd->inotab, (int (*)(struct btnode *, void *))addleaf, &lv))
+	ret = -1;
+    else
+	ret = storewarm(fsd->st, lv.as, lv.n);
+    if(lv.as != NULL)
+	free(lv.as);
+    return(ret);
+}
+
 static vc_ino_t dirlookup(struct vcfsdata *fsd, struct btnode *dirdata, const char *name, int *di)
 {
     struct dentry dent;
@@ -281,7 +433,9 @@ static int getinode(struct vcfsdata *fsd, struct btnode inotab, vc_ino_t ino, st
 	inotab = fsd->inotab;
     if((sz = btget(fsd->st, &inotab, ino, buf, sizeof(*buf), INOBLSIZE)) < 0)
 	return(-1);
-    if(sz != sizeof(*buf)) {
+    if(sz == OLDINOSZ) {
+	memset(&buf->chunks, 0, sizeof(buf->chunks));
+    } else if(sz != sizeof(*buf)) {
 	flog(LOG_ERR, "illegal size for inode %i", ino);
 	errno = EIO;
 	return(-1);
@@ -289,6 +443,23 @@ static int getinode(struct vcfsdata *fsd, struct btnode inotab, vc_ino_t ino, st
     return(0);
 }
 
+static int revsstat(struct vcfsdata *fsd, struct stat *sb)
+{
+    struct inode root;
+    struct revrec rr;
+    
+    if(getinode(fsd, nilnode, 0, &root) || revget(fsd->revs, fsd->revs->n - 1, &rr))
+	return(-1);
+    memset(sb, 0, sizeof(*sb));
+    sb->st_mode = S_IFDIR | 0555;
+    sb->st_atime = sb->st_mtime = sb->st_ctime = (time_t)rr.ct;
+    sb->st_uid = root.uid;
+    sb->st_gid = root.gid;
+    sb->st_nlink = 2;
+    sb->st_ino = fsd->revsino;
+    return(0);
+}
+
 static void fusegetattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
 {
     struct vcfsdata *fsd;
@@ -297,7 +468,16 @@ static void fusegetattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *f
     struct inode file;
     
     fsd = fuse_req_userdata(req);
+    housekeep(fsd);
     memset(&sb, 0, sizeof(sb));
+    if(ino == fsd->revsino) {
+	if(revsstat(fsd, &sb)) {
+	    fuse_reply_err(req, errno);
+	    return;
+	}
+	fuse_reply_attr(req, &sb, 0);
+	return;
+    }
     if((inoc = getinocbf(fsd, ino)) == NULL) {
 	fuse_reply_err(req, ENOENT);
 	return;
@@ -308,7 +488,33 @@ static void fusegetattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *f
     }
     fillstat(&sb, &file);
     sb.st_ino = ino;
-    fuse_reply_attr(req, &sb, 0);
+    fuse_reply_attr(req, &sb, (inoc->inotab.d != 0)?IMMUTTIMEOUT:0);
+}
+
+static void revslookup(fuse_req_t req, struct vcfsdata *fsd, const char *name)
+{
+    struct fuse_entry_param e;
+    struct revrec rr;
+    struct inode file;
+    vc_rev_t rev;
+    
+    if(((rev = parserev(fsd->revs, name)) < 0) || revget(fsd->revs, rev, &rr)) {
+	fuse_reply_err(req, ENOENT);
+	return;
+    }
+    if(getinode(fsd, rr.root, 0, &file)) {
+	fuse_reply_err(req, errno);
+	return;
+    }
+    memset(&e, 0, sizeof(e));
+    e.ino = cacheinode(fsd, 0, rr.root);
+    fillstat(&e.attr, &file);
+    e.attr.st_ino = e.ino;
+    e.attr_timeout = IMMUTTIMEOUT;
+    /* What "@T" refers to may change with later commits. */
+    if(*name != '@')
+	e.entry_timeout = IMMUTTIMEOUT;
+    fuse_reply_entry(req, &e);
 }
 
 static void fuselookup(fuse_req_t req, fuse_ino_t parent, const char *name)
@@ -320,10 +526,25 @@ static void fuselookup(fuse_req_t req, fuse_ino_t parent, const char *name)
     vc_ino_t target;
     
     fsd = fuse_req_userdata(req);
+    housekeep(fsd);
+    if(parent == fsd->revsino) {
+	revslookup(req, fsd, name);
+	return;
+    }
     if((inoc = getinocbf(fsd, parent)) == NULL) {
 	fuse_reply_err(req, ENOENT);
 	return;
     }
+    if((inoc->inode == 0) && (inoc->inotab.d == 0) && !strcmp(name, REVSDIR)) {
+	memset(&e, 0, sizeof(e));
+	if(revsstat(fsd, &e.attr)) {
+	    fuse_reply_err(req, errno);
+	    return;
+	}
+	e.ino = fsd->revsino;
+	fuse_reply_entry(req, &e);
+	return;
+    }
     if(getinode(fsd, inoc->inotab, inoc->inode, &file)) {
 	fuse_reply_err(req, errno);
 	return;
@@ -340,20 +561,74 @@ static void fuselookup(fuse_req_t req, fuse_ino_t parent, const char *name)
     e.ino = cacheinode(fsd, target, inoc->inotab);
     fillstat(&e.attr, &file);
     e.attr.st_ino = e.ino;
+    if(inoc->inotab.d != 0)
+	e.attr_timeout = e.entry_timeout = IMMUTTIMEOUT;
     fuse_reply_entry(req, &e);
 }
 
+static void revsreaddir(fuse_req_t req, struct vcfsdata *fsd, size_t size, off_t off)
+{
+    struct revrec rr;
+    struct stat sb;
+    char name[32];
+    ssize_t osz, bsz;
+    char *buf;
+    
+    bsz = 0;
+    buf = NULL;
+    for(; off < fsd->revs->n + 2; off++) {
+	memset(&sb, 0, sizeof(sb));
+	sb.st_mode = S_IFDIR;
+	if(off < 2) {
+	    strcpy(name, (off == 0)?".":"..");
+	    sb.st_ino = (off == 0)?fsd->revsino:1;
+	} else {
+	    if(revget(fsd->revs, off - 2, &rr)) {
+		if(buf != NULL)
+		    free(buf);
+		fuse_reply_err(req, errno);
+		return;
+	    }
+	    snprintf(name, sizeof(name), "%lli", (long long)(off - 2));
+	    sb.st_ino = cacheinode(fsd, 0, rr.root);
+	}
+	osz = bsz;
+	bsz += fuse_add_direntry(req, NULL, 0, name, NULL, 0);
+	if(bsz > size) {
+	    bsz = osz;
+	    break;
+	}
+	buf = realloc(buf, bsz);
+	fuse_add_direntry(req, buf + osz, bsz - osz, name, &sb, off + 1);
+    }
+    fuse_reply_buf(req, buf, bsz);
+    if(buf != NULL)
+	free(buf);
+}
+
+/* Directory entries are read this many at a time */
+#define READDIRBATCH 16
+
 static void fusereaddir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi)
 {
     struct vcfsdata *fsd;
     struct inoc *inoc;
     struct inode file;
-    struct dentry dent;
+    struct dentry dents[READDIRBATCH];
+    void *bufs[READDIRBATCH];
+    size_t lens[READDIRBATCH];
+    ssize_t szs[READDIRBATCH];
     struct stat sb;
-    ssize_t sz, osz, bsz;
+    ssize_t osz, bsz;
     char *buf;
+    int i, n;
     
     fsd = fuse_req_userdata(req);
+    housekeep(fsd);
+    if(ino == fsd->revsino) {
+	revsreaddir(req, fsd, size, off);
+	return;
+    }
     if((inoc = getinocbf(fsd, ino)) == NULL) {
 	fuse_reply_err(req, ENOENT);
 	return;
@@ -362,32 +637,39 @@ static void fusereaddir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
 	fuse_reply_err(req, errno);
 	return;
     }
+    for(i = 0; i < READDIRBATCH; i++) {
+	bufs[i] = &dents[i];
+	lens[i] = sizeof(dents[i]);
+    }
     bsz = 0;
     buf = NULL;
     while(bsz < size) {
-	memset(&dent, 0, sizeof(dent));
-	if((sz = btget(fsd->st, &file.data, off++, &dent, sizeof(dent), DIRBLSIZE)) < 0) {
-	    if(errno == ERANGE) {
-		if(buf != NULL)
-		    break;
-		fuse_reply_buf(req, NULL, 0);
-		return;
-	    }
+	memset(dents, 0, sizeof(dents));
+	if((n = btgetmany(fsd->st, &file.data, off, READDIRBATCH, bufs, lens, szs, DIRBLSIZE)) < 0) {
 	    fuse_reply_err(req, errno);
 	    if(buf != NULL)
 		free(buf);
 	    return;
 	}
-	if(dent.inode < 0)
-	    continue;
-	osz = bsz;
-	bsz += fuse_add_direntry(req, NULL, 0, dent.name, NULL, 0);
-	if(bsz > size)
+	if(n == 0)
+	    break;
+	for(i = 0; i < n; i++) {
+	    off++;
+	    if(dents[i].inode < 0)
+		continue;
+	    osz = bsz;
+	    bsz += fuse_add_direntry(req, NULL, 0, dents[i].name, NULL, 0);
+	    if(bsz > size) {
+		bsz = osz;
+		break;
+	    }
+	    buf = realloc(buf, bsz);
+	    memset(&sb, 0, sizeof(sb));
+	    sb.st_ino = cacheinode(fsd, dents[i].inode, inoc->inotab);
+	    fuse_add_direntry(req, buf + osz, bsz - osz, dents[i].name, &sb, off);
+	}
+	if(i < n)
 	    break;
-	buf = realloc(buf, bsz);
-	memset(&sb, 0, sizeof(sb));
-	sb.st_ino = cacheinode(fsd, dent.inode, inoc->inotab);
-	fuse_add_direntry(req, buf + osz, bsz - osz, dent.name, &sb, off);
     }
     fuse_reply_buf(req, buf, bsz);
     if(buf != NULL)
@@ -397,15 +679,16 @@ static void fusereaddir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
 static vc_rev_t commit(struct vcfsdata *fsd, struct btnode inotab)
 {
     struct revrec rr;
+    vc_rev_t rev;
     
     rr.ct = time(NULL);
     rr.root = inotab;
-    if(writeall(fsd->revfd, &rr, sizeof(rr), (fsd->currev + 1) * sizeof(struct revrec))) {
+    if((rev = revappend(fsd->revs, &rr)) < 0) {
 	flog(LOG_CRIT, "could not write new revision: %s", strerror(errno));
 	return(-1);
     }
     fsd->inotab = inotab;
-    return(++fsd->currev);
+    return(rev);
 }
 
 static int deldentry(struct vcfsdata *fsd, struct inode *ino, int di)
@@ -467,6 +750,10 @@ static void fusemkdir(fuse_req_t req, fuse_ino_t parent, const char *name, mode_
     
     fsd = fuse_req_userdata(req);
     ctx = fuse_req_ctx(req);
+    if(parent == fsd->revsino) {
+	fuse_reply_err(req, EROFS);
+	return;
+    }
     if((inoc = getinocbf(fsd, parent)) == NULL) {
 	fuse_reply_err(req, ENOENT);
 	return;
@@ -540,6 +827,10 @@ static void fuseunlink(fuse_req_t req, fuse_ino_t parent, const char *name)
     struct btnode inotab;
     
     fsd = fuse_req_userdata(req);
+    if(parent == fsd->revsino) {
+	fuse_reply_err(req, EROFS);
+	return;
+    }
     if((inoc = getinocbf(fsd, parent)) == NULL) {
 	fuse_reply_err(req, ENOENT);
 	return;
@@ -573,14 +864,631 @@ static void fuseunlink(fuse_req_t req, fuse_ino_t parent, const char *name)
     fuse_reply_err(req, 0);
 }
 
+/* Deletes of blocks past the end of a truncated file per btputmany() */
+#define TRUNCBATCH 4096
+
+/*
+ * Rewrites block bl of the file with len bytes, of which the range
+ * from zfrom to zto is zeroed, as is anything past its old length.
+ * Blocks left all zeroes become holes in the data tree.
+ */
+static int rewriteblock(struct vcfsdata *fsd, struct inode *file, block_t bl, size_t len, size_t zfrom, size_t zto)
+{
+    char *buf;
+    ssize_t sz;
+    int ret;
+    
+    buf = calloc(1, FILEBLKSZ);
+    if((sz = btget(fsd->st, &file->data, bl, buf, FILEBLKSZ, FILEBLSIZE)) < 0) {
+	free(buf);
+	return(-1);
+    }
+    if(zfrom < zto)
+	memset(buf + zfrom, 0, zto - zfrom);
+    ret = btput(fsd->st, &file->data, bl, buf, len, FILEBLSIZE);
+    free(buf);
+    return(ret);
+}
+
+/*
+ * Sets the size of a regular file. Shrinking it drops the blocks
+ * past its new end and cuts the last one short; extending it adds
+ * holes, after padding its old last block with zeroes. Chunked files
+ * can only be shrunk, through their size index, since their chunks do
+ * not line up with block numbers.
+ */
+static int truncfile(struct vcfsdata *fsd, struct inode *file, u_int64_t size)
+{
+    struct btop ops[TRUNCBATCH];
+    block_t onb, nnb, bl;
+    int i;
+    
+    if(size == 0) {
+	file->data.d = 0;
+	file->chunks.d = 0;
+	file->size = 0;
+	return(0);
+    }
+    if(file->chunks.d != 0) {
+	if(size < file->size)
+	    return(chunktrunc(fsd->st, file, size));
+	if(size == file->size)
+	    return(0);
+	errno = EOPNOTSUPP;
+	return(-1);
+    }
+    onb = (file->size + FILEBLKSZ - 1) / FILEBLKSZ;
+    nnb = (size + FILEBLKSZ - 1) / FILEBLKSZ;
+    if(size < file->size) {
+	for(bl = onb; bl > nnb; ) {
+	    for(i = 0; (i < TRUNCBATCH) && (bl > nnb); i++)
+		btmkop(ops + i, --bl, NULL, 0);
+	    if(btputmany(fsd->st, &file->data, ops, i, FILEBLSIZE))
+		return(-1);
+	}
+	if((size % FILEBLKSZ) && rewriteblock(fsd, file, nnb - 1, size % FILEBLKSZ, 0, 0))
+	    return(-1);
+    } else if(size > file->size) {
+	if(file->size % FILEBLKSZ) {
+	    if(rewriteblock(fsd, file, onb - 1, (nnb > onb)?FILEBLKSZ:(size - ((onb - 1) * FILEBLKSZ)), 0, 0))
+		return(-1);
+	}
+	if(nnb > onb) {
+	    if(btputhole(fsd->st, &file->data, onb, nnb - onb - ((size % FILEBLKSZ)?1:0), FILEBLKSZ, FILEBLSIZE))
+		return(-1);
+	    if((size % FILEBLKSZ) && btputhole(fsd->st, &file->data, nnb - 1, 1, size % FILEBLKSZ, FILEBLSIZE))
+		return(-1);
+	}
+    }
+    file->size = size;
+    return(0);
+}
+
+/*
+ * Zeroes the bytes from off to end of a file, which may be no
+ * further than its size. The blocks covered entirely become holes,
+ * and the partly covered ones at the edges are rewritten.
+ */
+static int punchhole(struct vcfsdata *fsd, struct inode *file, u_int64_t off, u_int64_t end)
+{
+    block_t b0, b1;
+    size_t l0, l1;
+    
+    if(off >= end)
+	return(0);
+    if(file->chunks.d != 0) {
+	errno = EOPNOTSUPP;
+	return(-1);
+    }
+    b0 = off / FILEBLKSZ;
+    b1 = (end - 1) / FILEBLKSZ;
+    l0 = (file->size - (b0 * FILEBLKSZ) < FILEBLKSZ)?(file->size - (b0 * FILEBLKSZ)):FILEBLKSZ;
+    l1 = (file->size - (b1 * FILEBLKSZ) < FILEBLKSZ)?(file->size - (b1 * FILEBLKSZ)):FILEBLKSZ;
+    if(b0 == b1)
+	return(rewriteblock(fsd, file, b0, l0, off - (b0 * FILEBLKSZ), end - (b0 * FILEBLKSZ)));
+    if(rewriteblock(fsd, file, b0, l0, off - (b0 * FILEBLKSZ), l0))
+	return(-1);
+    if((b1 > b0 + 1) && btputhole(fsd->st, &file->data, b0 + 1, b1 - b0 - 1, FILEBLKSZ, FILEBLSIZE))
+	return(-1);
+    return(rewriteblock(fsd, file, b1, l1, 0, end - (b1 * FILEBLKSZ)));
+}
+
+static void fusesetattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr, int to_set, struct fuse_file_info *fi)
+{
+    struct vcfsdata *fsd;
+    struct inoc *inoc;
+    struct inode file;
+    struct btnode inotab;
+    struct stat sb;
+    time_t now;
+    
+    fsd = fuse_req_userdata(req);
+    if(ino == fsd->revsino) {
+	fuse_reply_err(req, EROFS);
+	return;
+    }
+    if((inoc = getinocbf(fsd, ino)) == NULL) {
+	fuse_reply_err(req, ENOENT);
+	return;
+    }
+    if(inoc->inotab.d != 0) {
+	fuse_reply_err(req, EROFS);
+	return;
+    }
+    if(getinode(fsd, inoc->inotab, inoc->inode, &file)) {
+	fuse_reply_err(req, errno);
+	return;
+    }
+    now = time(NULL);
+    if(to_set & FUSE_SET_ATTR_SIZE) {
+	if(!S_ISREG(file.mode)) {
+	    fuse_reply_err(req, S_ISDIR(file.mode)?EISDIR:EINVAL);
+	    return;
+	}
+	if(truncfile(fsd, &file, attr->st_size)) {
+	    fuse_reply_err(req, errno);
+	    return;
+	}
+	file.mtime = now;
+    }
+    if(to_set & FUSE_SET_ATTR_MODE)
+	file.mode = (file.mode & S_IFMT) | (attr->st_mode & ~S_IFMT);
+    if(to_set & FUSE_SET_ATTR_UID)
+	file.uid = attr->st_uid;
+    if(to_set & FUSE_SET_ATTR_GID)
+	file.gid = attr->st_gid;
+    if(to_set & FUSE_SET_ATTR_MTIME)
+	file.mtime = attr->st_mtime;
+#ifdef FUSE_SET_ATTR_MTIME_NOW
+    if(to_set & FUSE_SET_ATTR_MTIME_NOW)
+	file.mtime = now;
+#endif
+    file.ctime = now;
+    inotab = fsd->inotab;
+    if(btput(fsd->st, &inotab, inoc->inode, &file, sizeof(file), INOBLSIZE)) {
+	fuse_reply_err(req, errno);
+	return;
+    }
+    commit(fsd, inotab);
+    memset(&sb, 0, sizeof(sb));
+    fillstat(&sb, &file);
+    sb.st_ino = ino;
+    fuse_reply_attr(req, &sb, 0);
+}
+
+#if FUSE_VERSION >= 29
+/*
+ * Nothing is ever allocated ahead of being written, so plain
+ * fallocate() only extends the file with holes, and punching a hole
+ * is the only other mode supported.
+ */
+static void fusefallocate(fuse_req_t req, fuse_ino_t ino, int mode, off_t off, off_t len, struct fuse_file_info *fi)
+{
+    struct vcfsdata *fsd;
+    struct inoc *inoc;
+    struct inode file;
+    struct btnode inotab;
+    u_int64_t end;
+    int ret;
+    
+    fsd = fuse_req_userdata(req);
+    if(ino == fsd->revsino) {
+	fuse_reply_err(req, EROFS);
+	return;
+    }
+    if((inoc = getinocbf(fsd, ino)) == NULL) {
+	fuse_reply_err(req, ENOENT);
+	return;
+    }
+    if(inoc->inotab.d != 0) {
+	fuse_reply_err(req, EROFS);
+	return;
+    }
+    if(getinode(fsd, inoc->inotab, inoc->inode, &file)) {
+	fuse_reply_err(req, errno);
+	return;
+    }
+    if(!S_ISREG(file.mode)) {
+	fuse_reply_err(req, ENODEV);
+	return;
+    }
+    end = off + len;
+    if(mode == 0) {
+	if(end <= file.size) {
+	    fuse_reply_err(req, 0);
+	    return;
+	}
+	ret = truncfile(fsd, &file, end);
+    } else if(mode == FALLOC_FL_KEEP_SIZE) {
+	fuse_reply_err(req, 0);
+	return;
+    } else if(mode == (FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE)) {
+	ret = punchhole(fsd, &file, off, (end < file.size)?end:file.size);
+    } else {
+	fuse_reply_err(req, EOPNOTSUPP);
+	return;
+    }
+    if(ret) {
+	fuse_reply_err(req, errno);
+	return;
+    }
+    file.mtime = file.ctime = time(NULL);
+    inotab = fsd->inotab;
+    if(btput(fsd->st, &inotab, inoc->inode, &file, sizeof(file), INOBLSIZE)) {
+	fuse_reply_err(req, errno);
+	return;
+    }
+    commit(fsd, inotab);
+    fuse_reply_err(req, 0);
+}
+#endif
+
+static vc_ino_t pathlookup(struct vcfsdata *fsd, struct btnode inotab, const char *path)
+{
+    struct inode file;
+    vc_ino_t cur;
+    char name[256];
+    const char *p;
+    size_t l;
+    
+    cur = 0;
+    while(1) {
+	while(*path == '/')
+	    path++;
+	if(!*path)
+	    return(cur);
+	if((p = strchr(path, '/')) == NULL)
+	    p = path + strlen(path);
+	if((l = p - path) >= sizeof(name)) {
+	    errno = ENAMETOOLONG;
+	    return(-1);
+	}
+	memcpy(name, path, l);
+	name[l] = 0;
+	if(getinode(fsd, inotab, cur, &file))
+	    return(-1);
+	if(!S_ISDIR(file.mode)) {
+	    errno = ENOTDIR;
+	    return(-1);
+	}
+	if((cur = dirlookup(fsd, &file.data, name, NULL)) < 0)
+	    return(-1);
+	path = p;
+    }
+}
+
+/*
+ * Cloning copies inode records only. Since the store is
+ * content-addressed, the new inodes simply point to the same data
+ * trees as the old ones, so no file data is ever read or
+ * rehashed. Cloning a single file is thus constant-time; cloning a
+ * directory is linear in the number of inodes beneath it, since its
+ * entries have to be renumbered into the live inode table.
+ */
+struct clonemap {
+    vc_ino_t src, dst;
+    u_int32_t links;
+};
+
+struct clonectx {
+    struct vcfsdata *fsd;
+    struct btnode srctab;
+    struct btree *map;
+    struct inode **new;
+    int nnew, anew;
+    time_t now;
+};
+
+static int clonemapcmp(struct clonemap *a, struct clonemap *b)
+{
+    if(a->src < b->src)
+	return(-1);
+    if(a->src > b->src)
+	return(1);
+    return(0);
+}
+
+static void freeclonemap(struct btree *tree)
+{
+    if(tree == NULL)
+	return;
+    freeclonemap(tree->l);
+    freeclonemap(tree->r);
+    free(tree->d);
+    free(tree);
+}
+
+static vc_ino_t clonenew(struct clonectx *cc, struct inode *file)
+{
+    if(cc->nnew == cc->anew) {
+	cc->anew = (cc->anew == 0)?16:(cc->anew * 2);
+	cc->new = realloc(cc->new, sizeof(*cc->new) * cc->anew);
+    }
+    cc->new[cc->nnew] = memcpy(malloc(sizeof(*file)), file, sizeof(*file));
+    return(cc->fsd->nextino + cc->nnew++);
+}
+
+static vc_ino_t cloneinode(struct clonectx *cc, vc_ino_t src, vc_ino_t parent);
+
+static int clonedir(struct clonectx *cc, struct inode *dir, vc_ino_t self, vc_ino_t parent)
+{
+    struct vcfsdata *fsd;
+    struct dentry *dents;
+    struct btop *ops;
+    struct btnode data;
+    vc_ino_t sub;
+    void **bufs;
+    size_t *lens;
+    ssize_t *szs;
+    int i, n, ret;
+    
+    fsd = cc->fsd;
+    dents = calloc(dir->size, sizeof(*dents));
+    ops = calloc(dir->size, sizeof(*ops));
+    bufs = malloc(sizeof(*bufs) * dir->size);
+    lens = malloc(sizeof(*lens) * dir->size);
+    szs = malloc(sizeof(*szs) * dir->size);
+    for(i = 0; i < dir->size; i++) {
+	bufs[i] = &dents[i];
+	lens[i] = sizeof(dents[i]);
+    }
+    ret = -1;
+    if((n = btgetmany(fsd->st, &dir->data, 0, dir->size, bufs, lens, szs, DIRBLSIZE)) < 0)
+	goto out;
+    if(n != dir->size) {
+	errno = EIO;
+	goto out;
+    }
+    for(i = 0; i < dir->size; i++) {
+	if(!strcmp(dents[i].name, ".")) {
+	    dents[i].inode = self;
+	} else if(!strcmp(dents[i].name, "..")) {
+	    dents[i].inode = parent;
+	} else {
+	    if((sub = cloneinode(cc, dents[i].inode, self)) < 0)
+		goto out;
+	    dents[i].inode = sub;
+	}
+	btmkop(ops + i, i, &dents[i], szs[i]);
+    }
+    data.d = 0;
+    if(btputmany(fsd->st, &data, ops, dir->size, DIRBLSIZE))
+	goto out;
+    dir->data = data;
+    ret = 0;
+
+out:
+    free(dents);
+    free(ops);
+    free(bufs);
+    free(lens);
+    free(szs);
+    return(ret);
+}
+
+static vc_ino_t cloneinode(struct clonectx *cc, vc_ino_t src, vc_ino_t parent)
+{
+    struct clonemap key, *m;
+    struct inode file;
+    vc_ino_t new;
+    
+    key.src = src;
+    if((m = btreeget(cc->map, &key, (int (*)(void *, void *))clonemapcmp)) != NULL) {
+	m->links++;
+	return(m->dst);
+    }
+    if(getinode(cc->fsd, cc->srctab, src, &file))
+	return(-1);
+    file.ctime = cc->now;
+    new = clonenew(cc, &file);
+    if(S_ISDIR(file.mode)) {
+	if(clonedir(cc, &file, new, parent))
+	    return(-1);
+	*cc->new[new - cc->fsd->nextino] = file;
+    } else {
+	m = malloc(sizeof(*m));
+	m->src = src;
+	m->dst = new;
+	m->links = 1;
+	bbtreeput(&cc->map, m, (int (*)(void *, void *))clonemapcmp);
+    }
+    return(new);
+}
+
+static void fixclonelinks(struct clonectx *cc, struct btree *tree)
+{
+    struct clonemap *m;
+    
+    if(tree == NULL)
+	return;
+    fixclonelinks(cc, tree->l);
+    fixclonelinks(cc, tree->r);
+    m = tree->d;
+    cc->new[m->dst - cc->fsd->nextino]->links = m->links;
+}
+
+/*
+ * Clones the inode at path in revision rev (or the current revision,
+ * if rev is negative) into the live directory dirino under the given
+ * name, and commits the result as a new revision. An existing entry
+ * of that name is replaced only if flags has XATTR_REPLACE, which
+ * also requires that there is one.
+ */
+static int clonepath(struct vcfsdata *fsd, vc_ino_t dirino, const char *name, vc_rev_t rev, const char *path, int flags)
+{
+    struct clonectx cc;
+    struct revrec rr;
+    struct inode dir, old;
+    struct btnode inotab;
+    struct btop *ops;
+    vc_ino_t src, new, oldino;
+    int i, di, ret;
+    
+    memset(&cc, 0, sizeof(cc));
+    cc.fsd = fsd;
+    cc.now = time(NULL);
+    if(rev >= 0) {
+	if(revget(fsd->revs, rev, &rr))
+	    return(-1);
+	cc.srctab = rr.root;
+    } else {
+	cc.srctab = fsd->inotab;
+    }
+    if(getinode(fsd, nilnode, dirino, &dir))
+	return(-1);
+    if(!S_ISDIR(dir.mode)) {
+	errno = ENOTDIR;
+	return(-1);
+    }
+    di = -1;
+    if((oldino = dirlookup(fsd, &dir.data, name, &di)) == -1) {
+	if(errno != ENOENT)
+	    return(-1);
+	if(flags & XATTR_REPLACE) {
+	    errno = ENODATA;
+	    return(-1);
+	}
+    } else {
+	if(!(flags & XATTR_REPLACE)) {
+	    errno = EEXIST;
+	    return(-1);
+	}
+	if(getinode(fsd, nilnode, oldino, &old))
+	    return(-1);
+	if(S_ISDIR(old.mode))
+	    dir.links--;
+    }
+    if((src = pathlookup(fsd, cc.srctab, path)) < 0)
+	return(-1);
+    
+    ret = -1;
+    ops = NULL;
+    if((new = cloneinode(&cc, src, dirino)) < 0)
+	goto out;
+    fixclonelinks(&cc, cc.map);
+    if(setdentry(fsd, &dir, di, name, new))
+	goto out;
+    if(S_ISDIR(cc.new[0]->mode))
+	dir.links++;
+    dir.mtime = cc.now;
+    ops = calloc(cc.nnew + 1, sizeof(*ops));
+    btmkop(ops + 0, dirino, &dir, sizeof(dir));
+    for(i = 0; i < cc.nnew; i++)
+	btmkop(ops + i + 1, fsd->nextino + i, cc.new[i], sizeof(*cc.new[i]));
+    inotab = fsd->inotab;
+    if(btputmany(fsd->st, &inotab, ops, cc.nnew + 1, INOBLSIZE))
+	goto out;
+    if(commit(fsd, inotab) < 0)
+	goto out;
+    fsd->nextino += cc.nnew;
+    ret = 0;
+
+out:
+    for(i = 0; i < cc.nnew; i++)
+	free(cc.new[i]);
+    if(cc.new != NULL)
+	free(cc.new);
+    if(ops != NULL)
+	free(ops);
+    freeclonemap(cc.map);
+    return(ret);
+}
+
+/*
+ * Clones are requested by setting an extended attribute named
+ * "user.vcfs.clone.NAME" on the target directory, where NAME is the
+ * name of the new entry, to the value "REV:PATH", where PATH is
+ * looked up from the root of revision REV (see parserev()). If REV
+ * is empty, the current revision is used. For example:
+ *
+ *   setfattr -n user.vcfs.clone.restored -v 42:/home/fredrik dir
+ *
+ * As with any attribute, XATTR_CREATE fails with EEXIST if the entry
+ * exists and XATTR_REPLACE with ENODATA if it does not. Without
+ * either, an existing entry is left alone and EEXIST returned.
+ */
+#define CLONEXATTR "user.vcfs.clone."
+
+static void fusesetxattr(fuse_req_t req, fuse_ino_t ino, const char *name, const char *value, size_t size, int flags)
+{
+    struct vcfsdata *fsd;
+    struct inoc *inoc;
+    char *buf, *p;
+    vc_rev_t rev;
+    
+    fsd = fuse_req_userdata(req);
+    if(strncmp(name, CLONEXATTR, strlen(CLONEXATTR))) {
+	fuse_reply_err(req, ENOTSUP);
+	return;
+    }
+    name += strlen(CLONEXATTR);
+    if(ino == fsd->revsino) {
+	fuse_reply_err(req, EROFS);
+	return;
+    }
+    if((inoc = getinocbf(fsd, ino)) == NULL) {
+	fuse_reply_err(req, ENOENT);
+	return;
+    }
+    if(inoc->inotab.d != 0) {
+	fuse_reply_err(req, EROFS);
+	return;
+    }
+    if(!*name || strchr(name, '/') || !strcmp(name, ".") || !strcmp(name, "..")) {
+	fuse_reply_err(req, EINVAL);
+	return;
+    }
+    buf = malloc(size + 1);
+    memcpy(buf, value, size);
+    buf[size] = 0;
+    if((p = strchr(buf, ':')) == NULL) {
+	free(buf);
+	fuse_reply_err(req, EINVAL);
+	return;
+    }
+    *(p++) = 0;
+    rev = -1;
+    if(*buf && ((rev = parserev(fsd->revs, buf)) < 0)) {
+	free(buf);
+	fuse_reply_err(req, errno);
+	return;
+    }
+    if(clonepath(fsd, inoc->inode, name, rev, p, flags)) {
+	free(buf);
+	fuse_reply_err(req, errno);
+	return;
+    }
+    free(buf);
+    fuse_reply_err(req, 0);
+}
+
 static struct fuse_lowlevel_ops fuseops = {
     .destroy = (void (*)(void *))fusedestroy,
     .lookup = fuselookup,
     .getattr = fusegetattr,
+    .setattr = fusesetattr,
     .readdir = fusereaddir,
     .mkdir = fusemkdir,
     .rmdir = fuseunlink,
     .unlink = fuseunlink,
+    .setxattr = fusesetxattr,
+#if FUSE_VERSION >= 29
+    .fallocate = fusefallocate,
+#endif
+};
+
+struct vcfsopts {
+    char *rev;
+    int compress, verifyonce, scrub, uring, warm, preload, align, direct;
+    unsigned int cache;
+};
+
+/*
+ * "-o rev=N" or "-o rev=@T" mounts the given revision read-only.
+ * "-o compress" compresses newly written blocks. "-o verifyonce"
+ * checks each block against its hash only when first read, and
+ * "-o scrub" checks the sealed parts of the log in the background.
+ * "-o uring" reads through io_uring where the kernel supports it.
+ * "-o align" starts new log entries on sector boundaries, and
+ * "-o direct" reads the log with O_DIRECT, so that together with
+ * "-o cache=N", which keeps up to N MiB of recently used blocks in
+ * memory, the store cache is the only cache holding blocks.
+ * "-o warm" reads the blocks that were hot at the last unmount in the
+ * background, and "-o preload" reads the whole inode table into the
+ * cache before mounting.
+ */
+static struct fuse_opt vcfsoptspec[] = {
+    {"rev=%s", offsetof(struct vcfsopts, rev), 0},
+    {"compress", offsetof(struct vcfsopts, compress), 1},
+    {"verifyonce", offsetof(struct vcfsopts, verifyonce), 1},
+    {"scrub", offsetof(struct vcfsopts, scrub), 1},
+    {"uring", offsetof(struct vcfsopts, uring), 1},
+    {"cache=%u", offsetof(struct vcfsopts, cache), 0},
+    {"warm", offsetof(struct vcfsopts, warm), 1},
+    {"preload", offsetof(struct vcfsopts, preload), 1},
+    {"align", offsetof(struct vcfsopts, align), 1},
+    {"direct", offsetof(struct vcfsopts, direct), 1},
+    FUSE_OPT_END
 };
 
 int main(int argc, char **argv)
@@ -589,11 +1497,27 @@ int main(int argc, char **argv)
     struct fuse_session *fs;
     struct fuse_chan *ch;
     struct vcfsdata *fsd;
+    struct vcfsopts opts;
     char *mtpt;
-    int err, fd;
+    int err, fd, stflags;
     
-    if((fsd = initvcfs(".")) == NULL)
+    memset(&opts, 0, sizeof(opts));
+    if(fuse_opt_parse(&args, &opts, vcfsoptspec, NULL) < 0)
+	exit(1);
+    stflags = (opts.compress?FST_COMPRESS:0) | (opts.verifyonce?FST_VERIFYONCE:0) | (opts.scrub?FST_SCRUB:0) | (opts.uring?FST_URING:0);
+    stflags |= (opts.align?FST_ALIGN:0) | (opts.direct?FST_DIRECT:0);
+    if((fsd = initvcfs(".", opts.rev, stflags)) == NULL)
 	exit(1);
+    if(opts.cache > 0)
+	fsd->st = newcachestore(fsd->st, (size_t)opts.cache << 20);
+    if(opts.preload && preloadinotab(fsd))
+	flog(LOG_WARNING, "could not preload inode table: %s", strerror(errno));
+    if(opts.warm) {
+	if(pthread_create(&fsd->warmth, NULL, (void *(*)(void *))warmer, fsd))
+	    flog(LOG_WARNING, "could not start warming up cache: %s", strerror(errno));
+	else
+	    fsd->warming = 1;
+    }
     if(fuse_parse_cmdline(&args, &mtpt, NULL, NULL) < 0)
 	exit(1);
     if((fd = fuse_mount(mtpt, &args)) < 0)
@@ -3,11 +3,16 @@
 
 #include <time.h>
 #include <inttypes.h>
+#include <stddef.h>
 
 #include "blocktree.h"
 
 #define DIRBLSIZE 4
 #define INOBLSIZE 4
+/* Files store their contents in FILEBLKSZ-byte blocks, the last
+ * one being short, unless they are chunked (see chunk.h). */
+#define FILEBLSIZE 8
+#define FILEBLKSZ 65536
 
 typedef loff_t vc_ino_t;
 typedef loff_t vc_rev_t;
@@ -25,8 +30,15 @@ struct inode {
     u_int32_t links;
     struct btnode data;
     struct btnode xattr;
+    struct btnode chunks;
 };
 
+/*
+ * Inodes written before the chunks field existed are shorter, and
+ * are read as having no chunks.
+ */
+#define OLDINOSZ ((offsetof(struct inode, chunks) + 7) & ~7)
+
 struct dentry {
     u_int64_t inode;
     char name[256];
@@ -0,0 +1,230 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+
+#include "store.h"
+#include "storeproto.h"
+#include "blocktree.h"
+#include "vcfs.h"
+#include "revs.h"
+#include "addrset.h"
+
+/*
+ * vcgc removes every block from a store that is not reachable from a
+ * retained set of revisions. Reachable blocks are marked by walking
+ * the inode table of each retained revision and the data and xattr
+ * trees of every inode in it. Since the store is content-addressed,
+ * a node that has already been walked has had its whole subtree
+ * marked as well, so unchanged subtrees shared between revisions are
+ * only walked once. Inode table nodes and data nodes are tracked
+ * apart, since a block that was walked as data may also be an inode
+ * table node whose inodes have not been. Marked blocks are then copied, in log order, into a
+ * new store, whose log segments and index replace the old ones.
+ *
+ * vcgc only works on plain filestores, and refuses to run while any
+ * other process has the store open, since such a process would go on
+ * reading the replaced log segments. The store is held exclusively,
+ * with its append lock taken, from before the marking until the new
+ * store has replaced it, so nothing can be added to it meanwhile.
+ * Collecting a store that is mounted would need every other opener
+ * to switch over to the new log and to report the blocks it is about
+ * to reference, which the store does not support, so the file system
+ * must be unmounted (and storesrv stopped) to run vcgc.
+ */
+
+struct gcdata {
+    struct store *st;
+    struct store *nst;
+    struct addrset marks, inoseen, dataseen;
+    size_t nblk, nkept;
+    size_t szblk, szkept;
+};
+
+static int markdata(struct btnode *node, void *pdata)
+{
+    struct gcdata *gc;
+    
+    gc = pdata;
+    if(addrsethas(&gc->dataseen, &node->a))
+	return(1);
+    addrsetadd(&gc->dataseen, &node->a);
+    addrsetadd(&gc->marks, &node->a);
+    return(0);
+}
+
+static int markinotab(struct btnode *node, void *pdata)
+{
+    struct gcdata *gc;
+    struct inode ino;
+    ssize_t sz;
+    
+    gc = pdata;
+    if(addrsethas(&gc->inoseen, &node->a))
+	return(1);
+    addrsetadd(&gc->inoseen, &node->a);
+    addrsetadd(&gc->marks, &node->a);
+    if((node->d & 0x7f) != 0)
+	return(0);
+    if((sz = storeget(gc->st, &ino, sizeof(ino), &node->a)) < 0) {
+	fprintf(stderr, "vcgc: could not read inode %s: %s\n", formataddr(&node->a), strerror(errno));
+	return(-1);
+    }
+    if(sz == OLDINOSZ) {
+	memset(&ino.chunks, 0, sizeof(ino.chunks));
+    } else if(sz != sizeof(ino)) {
+	fprintf(stderr, "vcgc: inode %s has illegal size\n", formataddr(&node->a));
+	return(-1);
+    }
+    if(btwalk(gc->st, &ino.data, markdata, gc) || btwalk(gc->st, &ino.xattr, markdata, gc) ||
+       btwalk(gc->st, &ino.chunks, markdata, gc))
+	return(-1);
+    return(0);
+}
+
+static int copyblock(struct addr *a, const void *buf, size_t len, void *pdata)
+{
+    struct gcdata *gc;
+    
+    gc = pdata;
+    gc->nblk++;
+    gc->szblk += len;
+    if(!addrsethas(&gc->marks, a))
+	return(0);
+    if(storeput(gc->nst, buf, len, NULL)) {
+	fprintf(stderr, "vcgc: could not copy block %s: %s\n", formataddr(a), strerror(errno));
+	return(-1);
+    }
+    gc->nkept++;
+    gc->szkept += len;
+    return(0);
+}
+
+static void usage(FILE *out)
+{
+    fprintf(out, "usage: vcgc [-hz] [-n KEEP] [-t TIME] DIR\n");
+}
+
+int main(int argc, char **argv)
+{
+    int c, i, stflags;
+    char *dir, nbuf[1024];
+    static char *kinds[] = {"tiers", "shards", "mirrors", NULL};
+    struct store *srv;
+    struct revdb *db;
+    struct revrec rr;
+    struct gcdata gc;
+    vc_rev_t rev, first, last, keep;
+    time_t t;
+    
+    keep = -1;
+    t = -1;
+    stflags = 0;
+    while((c = getopt(argc, argv, "hzn:t:")) >= 0) {
+	switch(c) {
+	case 'z':
+	    stflags |= FST_COMPRESS;
+	    break;
+	case 'n':
+	    keep = atoll(optarg);
+	    break;
+	case 't':
+	    t = atoll(optarg);
+	    break;
+	case 'h':
+	    usage(stdout);
+	    exit(0);
+	default:
+	    usage(stderr);
+	    exit(1);
+	}
+    }
+    if(argc - optind < 1) {
+	usage(stderr);
+	exit(1);
+    }
+    dir = argv[optind];
+    for(i = 0; kinds[i] != NULL; i++) {
+	snprintf(nbuf, sizeof(nbuf), "%s/%s", dir, kinds[i]);
+	if(!access(nbuf, F_OK)) {
+	    fprintf(stderr, "vcgc: %s is not a plain filestore (it has %s)\n", dir, nbuf);
+	    exit(1);
+	}
+    }
+    snprintf(nbuf, sizeof(nbuf), "%s/%s", dir, SP_SOCKNAME);
+    if(!access(nbuf, F_OK) && ((srv = opensockstore(nbuf)) != NULL)) {
+	releasestore(srv);
+	fprintf(stderr, "vcgc: %s is being served by storesrv\n", dir);
+	exit(1);
+    }
+    
+    memset(&gc, 0, sizeof(gc));
+    if((gc.st = openfstore(dir, 0)) == NULL)
+	exit(1);
+    if(fstoreexclusive(gc.st)) {
+	if(errno == EBUSY)
+	    fprintf(stderr, "vcgc: %s is in use by another process\n", dir);
+	else
+	    fprintf(stderr, "vcgc: could not lock %s: %s\n", dir, strerror(errno));
+	exit(1);
+    }
+    
+    if((db = openrevdb(dir, 1)) == NULL)
+	exit(1);
+    /* The latest revision is always retained. */
+    first = db->n - 1;
+    if(keep > 0)
+	first = (keep > db->n)?0:(db->n - keep);
+    if(t >= 0) {
+	if((rev = revbytime(db, t)) < 0)
+	    rev = 0;
+	if(rev < first)
+	    first = rev;
+    }
+    if((keep < 0) && (t < 0))
+	first = 0;
+    last = db->n - 1;
+    
+    for(rev = first; rev <= last; rev++) {
+	if(revget(db, rev, &rr))
+	    continue;
+	if(btwalk(gc.st, &rr.root, markinotab, &gc)) {
+	    fprintf(stderr, "vcgc: could not mark revision %lli\n", (long long)rev);
+	    exit(1);
+	}
+    }
+    addrsetfree(&gc.inoseen);
+    addrsetfree(&gc.dataseen);
+    
+    snprintf(nbuf, sizeof(nbuf), "%s/gc.new", dir);
+    /* Left behind by an interrupted run, and not yet moved into place */
+    if(rmfstore(nbuf) || mkfstore(nbuf))
+	exit(1);
+    if((gc.nst = openfstore(nbuf, stflags)) == NULL)
+	exit(1);
+    if(storebulk(gc.nst, 1))
+	exit(1);
+    if(fstorescan(gc.st, copyblock, &gc))
+	exit(1);
+    if(storebulk(gc.nst, 0))
+	exit(1);
+    releasestore(gc.nst);
+    
+    for(rev = 0; rev < first; rev++) {
+	if(revexpunge(db, rev)) {
+	    fprintf(stderr, "vcgc: could not expunge revision %lli: %s\n", (long long)rev, strerror(errno));
+	    exit(1);
+	}
+    }
+    closerevdb(db);
+    
+    snprintf(nbuf, sizeof(nbuf), "%s/gc.new", dir);
+    if(mvfstore(nbuf, dir))
+	exit(1);
+    releasestore(gc.st);
+    
+    printf("kept %zu of %zu blocks (%zu of %zu bytes) from revisions %lli to %lli\n",
+	   gc.nkept, gc.nblk, gc.szkept, gc.szblk, (long long)first, (long long)last);
+    return(0);
+}
@@ -0,0 +1,558 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <string.h>
+#include <errno.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "store.h"
+#include "blocktree.h"
+#include "vcfs.h"
+#include "revs.h"
+#include "chunk.h"
+
+/*
+ * vcimport copies a directory tree on the host into a new directory
+ * of a vcfs file system, and commits it as a single revision. The
+ * tree is walked by a pool of worker threads, each with a handle of
+ * its own on the store, so that hashing, compression and writing of
+ * the log all run in parallel. A worker that reads a directory gives
+ * inode numbers to everything in it at once, stores its dentries,
+ * and queues its subdirectories and files for any worker to take.
+ * Files are read FILEBATCH blocks at a time, each batch being stored
+ * with a single btputmany(), or with -c, split into content-defined
+ * chunks and stored FILEBATCH chunks at a time. The inodes pile up in
+ * memory until all workers are done; main() then links the imported
+ * tree into its parent directory and adds them all to the inode
+ * table in large batches.
+ *
+ * Hard links on the host are imported as separate files, whose data
+ * is shared in the store anyway. Nothing else may write to the file
+ * system while vcimport runs. Blocks stored by an import that fails
+ * are left for vcgc to remove.
+ */
+
+#define FILEBATCH 256
+#define DIRBATCH 4096
+#define INOBATCH 65536
+
+struct node {
+    struct node *next;
+    char *path;
+    vc_ino_t ino, parent;
+    struct inode inode;
+};
+
+struct import {
+    char *fsdir;
+    int stflags, cdc;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct node *queue;
+    int pending, err;
+    vc_ino_t base, nextino;
+    struct inode *inos;
+    size_t inosz;
+    size_t nfiles, ndirs;
+    u_int64_t nbytes;
+};
+
+static void statinode(struct inode *ino, struct stat *sb)
+{
+    memset(ino, 0, sizeof(*ino));
+    ino->mode = sb->st_mode;
+    ino->mtime = sb->st_mtime;
+    ino->ctime = sb->st_ctime;
+    ino->uid = sb->st_uid;
+    ino->gid = sb->st_gid;
+    ino->links = S_ISDIR(sb->st_mode)?2:1;
+}
+
+/* Must be called with the lock held */
+static vc_ino_t newino(struct import *imp)
+{
+    if(imp->nextino - imp->base >= imp->inosz) {
+	imp->inosz = (imp->inosz == 0)?1024:(imp->inosz * 2);
+	imp->inos = realloc(imp->inos, sizeof(*imp->inos) * imp->inosz);
+    }
+    return(imp->nextino++);
+}
+
+/* Must be called with the lock held */
+static void enqueue(struct import *imp, struct node *n)
+{
+    n->next = imp->queue;
+    imp->queue = n;
+    imp->pending++;
+    pthread_cond_signal(&imp->cond);
+}
+
+static struct node *newnode(char *dir, char *name, struct stat *sb, vc_ino_t ino, vc_ino_t parent)
+{
+    struct node *n;
+    
+    n = malloc(sizeof(*n));
+    n->path = malloc(strlen(dir) + strlen(name) + 2);
+    sprintf(n->path, "%s/%s", dir, name);
+    n->ino = ino;
+    n->parent = parent;
+    statinode(&n->inode, sb);
+    return(n);
+}
+
+static int namecmp(char **a, char **b)
+{
+    return(strcmp(*a, *b));
+}
+
+static int putdentries(struct store *st, struct inode *dir, struct dentry *dents, int n)
+{
+    struct btop ops[DIRBATCH];
+    int i;
+    
+    for(i = 0; i < n; i++)
+	btmkop(ops + i, dir->size + i, &dents[i], sizeof(dents[i]) - sizeof(dents[i].name) + strlen(dents[i].name) + 1);
+    if(btputmany(st, &dir->data, ops, n, DIRBLSIZE))
+	return(-1);
+    dir->size += n;
+    return(0);
+}
+
+/*
+ * Reads the directory of n, sorted by name so that importing the
+ * same tree twice yields the same blocks, and stores its entries.
+ * Subdirectories, files and symlinks are queued, whereas other kinds
+ * of files have nothing but their inode, which is done right away.
+ */
+static int importdir(struct import *imp, struct store *st, struct node *n)
+{
+    DIR *dp;
+    struct dirent *de;
+    struct stat sb;
+    struct dentry *dents;
+    struct inode ino;
+    char **names;
+    int i, nn, nd, namesz;
+    
+    if((dp = opendir(n->path)) == NULL)
+	return(-1);
+    names = NULL;
+    nn = namesz = 0;
+    while((de = readdir(dp)) != NULL) {
+	if(!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+	    continue;
+	if(nn == namesz) {
+	    namesz = (namesz == 0)?64:(namesz * 2);
+	    names = realloc(names, sizeof(*names) * namesz);
+	}
+	names[nn++] = strdup(de->d_name);
+    }
+    qsort(names, nn, sizeof(*names), (int (*)(const void *, const void *))namecmp);
+    
+    dents = calloc(DIRBATCH, sizeof(*dents));
+    dents[0].inode = n->ino;
+    strcpy(dents[0].name, ".");
+    dents[1].inode = n->parent;
+    strcpy(dents[1].name, "..");
+    nd = 2;
+    for(i = 0; i < nn; i++) {
+	if(strlen(names[i]) > 255) {
+	    errno = ENAMETOOLONG;
+	    goto err;
+	}
+	if(fstatat(dirfd(dp), names[i], &sb, AT_SYMLINK_NOFOLLOW))
+	    goto err;
+	pthread_mutex_lock(&imp->lock);
+	dents[nd].inode = newino(imp);
+	if(S_ISDIR(sb.st_mode) || S_ISREG(sb.st_mode) || S_ISLNK(sb.st_mode)) {
+	    enqueue(imp, newnode(n->path, names[i], &sb, dents[nd].inode, n->ino));
+	} else {
+	    statinode(&ino, &sb);
+	    imp->inos[dents[nd].inode - imp->base] = ino;
+	}
+	pthread_mutex_unlock(&imp->lock);
+	if(S_ISDIR(sb.st_mode))
+	    n->inode.links++;
+	strcpy(dents[nd].name, names[i]);
+	if(++nd == DIRBATCH) {
+	    if(putdentries(st, &n->inode, dents, nd))
+		goto err;
+	    memset(dents, 0, sizeof(*dents) * DIRBATCH);
+	    nd = 0;
+	}
+    }
+    if((nd > 0) && putdentries(st, &n->inode, dents, nd))
+	goto err;
+    for(i = 0; i < nn; i++)
+	free(names[i]);
+    if(names != NULL)
+	free(names);
+    free(dents);
+    closedir(dp);
+    return(0);
+    
+err:
+    for(i = 0; i < nn; i++)
+	free(names[i]);
+    if(names != NULL)
+	free(names);
+    free(dents);
+    closedir(dp);
+    return(-1);
+}
+
+static int importfile(struct store *st, struct node *n, char *buf)
+{
+    struct btop ops[FILEBATCH];
+    ssize_t ret;
+    size_t len;
+    int fd, i;
+    
+    if((fd = open(n->path, O_RDONLY)) < 0)
+	return(-1);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    while(1) {
+	for(len = 0; len < FILEBATCH * FILEBLKSZ; len += ret) {
+	    if((ret = read(fd, buf + len, (FILEBATCH * FILEBLKSZ) - len)) < 0) {
+		if(errno == EINTR) {
+		    ret = 0;
+		    continue;
+		}
+		close(fd);
+		return(-1);
+	    }
+	    if(ret == 0)
+		break;
+	}
+	if(len == 0)
+	    break;
+	for(i = 0; i * FILEBLKSZ < len; i++) {
+	    btmkop(ops + i, (n->inode.size / FILEBLKSZ) + i, buf + (i * FILEBLKSZ),
+		   (len - (i * FILEBLKSZ) < FILEBLKSZ)?(len - (i * FILEBLKSZ)):FILEBLKSZ);
+	}
+	if(btputmany(st, &n->inode.data, ops, i, FILEBLSIZE)) {
+	    close(fd);
+	    return(-1);
+	}
+	n->inode.size += len;
+	if(len < FILEBATCH * FILEBLKSZ)
+	    break;
+    }
+    close(fd);
+    return(0);
+}
+
+static int importchunked(struct store *st, struct node *n, char *buf)
+{
+    const void *bufs[FILEBATCH];
+    size_t lens[FILEBATCH];
+    size_t len, off, bsz;
+    ssize_t ret;
+    int fd, i, eof;
+    
+    if((fd = open(n->path, O_RDONLY)) < 0)
+	return(-1);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    bsz = FILEBATCH * FILEBLKSZ;
+    len = 0;
+    eof = 0;
+    while(!eof || (len > 0)) {
+	while(!eof && (len < bsz)) {
+	    if((ret = read(fd, buf + len, bsz - len)) < 0) {
+		if(errno == EINTR)
+		    continue;
+		close(fd);
+		return(-1);
+	    }
+	    if(ret == 0)
+		eof = 1;
+	    len += ret;
+	}
+	/* Chunks running into the end of the buffer wait for more data */
+	for(i = 0, off = 0; (i < FILEBATCH) && (off < len) && (eof || (len - off >= CDCMAX)); i++) {
+	    bufs[i] = buf + off;
+	    off += (lens[i] = cdcsplit(buf + off, len - off));
+	}
+	if(chunkappend(st, &n->inode, bufs, lens, i)) {
+	    close(fd);
+	    return(-1);
+	}
+	memmove(buf, buf + off, len - off);
+	len -= off;
+    }
+    close(fd);
+    return(0);
+}
+
+static int importlink(struct store *st, struct node *n)
+{
+    char buf[4096];
+    ssize_t len;
+    
+    if((len = readlink(n->path, buf, sizeof(buf))) < 0)
+	return(-1);
+    if(len > 0) {
+	if(btput(st, &n->inode.data, 0, buf, len, FILEBLSIZE))
+	    return(-1);
+    }
+    n->inode.size = len;
+    return(0);
+}
+
+static void *worker(struct import *imp)
+{
+    struct store *st;
+    struct node *n;
+    char *buf;
+    int ret;
+    
+    if((st = openstore(imp->fsdir, imp->stflags)) == NULL) {
+	pthread_mutex_lock(&imp->lock);
+	imp->err = 1;
+	pthread_cond_broadcast(&imp->cond);
+	pthread_mutex_unlock(&imp->lock);
+	return(NULL);
+    }
+    /* Nothing is ever read back */
+    storenocache(st);
+    buf = malloc(FILEBATCH * FILEBLKSZ);
+    pthread_mutex_lock(&imp->lock);
+    while(1) {
+	while(!imp->err && (imp->pending > 0) && (imp->queue == NULL))
+	    pthread_cond_wait(&imp->cond, &imp->lock);
+	if(imp->err || (imp->pending == 0))
+	    break;
+	n = imp->queue;
+	imp->queue = n->next;
+	pthread_mutex_unlock(&imp->lock);
+	if(S_ISDIR(n->inode.mode))
+	    ret = importdir(imp, st, n);
+	else if(S_ISLNK(n->inode.mode))
+	    ret = importlink(st, n);
+	else if(imp->cdc)
+	    ret = importchunked(st, n, buf);
+	else
+	    ret = importfile(st, n, buf);
+	if(ret)
+	    fprintf(stderr, "vcimport: %s: %s\n", n->path, strerror(errno));
+	pthread_mutex_lock(&imp->lock);
+	if(ret) {
+	    imp->err = 1;
+	} else {
+	    imp->inos[n->ino - imp->base] = n->inode;
+	    if(S_ISDIR(n->inode.mode))
+		imp->ndirs++;
+	    else
+		imp->nfiles++;
+	    if(S_ISREG(n->inode.mode))
+		imp->nbytes += n->inode.size;
+	}
+	if(imp->err || (--imp->pending == 0))
+	    pthread_cond_broadcast(&imp->cond);
+	free(n->path);
+	free(n);
+    }
+    pthread_mutex_unlock(&imp->lock);
+    free(buf);
+    releasestore(st);
+    return(NULL);
+}
+
+/*
+ * Finds the inode of the directory that path is in, and makes sure
+ * that its last component does not exist yet, returning a pointer to
+ * that component.
+ */
+static char *lookupparent(struct store *st, struct btnode *inotab, char *path, vc_ino_t *ino, struct inode *dir)
+{
+    struct dentry dent;
+    char *p, *e;
+    size_t l;
+    block_t i;
+    ssize_t sz;
+    
+    *ino = 0;
+    for(p = path; ; p = e) {
+	while(*p == '/')
+	    p++;
+	if((sz = btget(st, inotab, *ino, dir, sizeof(*dir), INOBLSIZE)) < 0)
+	    return(NULL);
+	if(sz == OLDINOSZ) {
+	    memset(&dir->chunks, 0, sizeof(dir->chunks));
+	} else if(sz != sizeof(*dir)) {
+	    errno = EIO;
+	    return(NULL);
+	}
+	if(!S_ISDIR(dir->mode)) {
+	    errno = ENOTDIR;
+	    return(NULL);
+	}
+	for(e = p; *e && (*e != '/'); e++);
+	l = e - p;
+	if((l == 0) || (l > 255)) {
+	    errno = (l == 0)?EINVAL:ENAMETOOLONG;
+	    return(NULL);
+	}
+	for(i = 0; i < dir->size; i++) {
+	    memset(&dent, 0, sizeof(dent));
+	    if(btget(st, &dir->data, i, &dent, sizeof(dent), DIRBLSIZE) < 0)
+		return(NULL);
+	    if(!strncmp(dent.name, p, l) && !dent.name[l])
+		break;
+	}
+	if(*e == 0) {
+	    if(i < dir->size) {
+		errno = EEXIST;
+		return(NULL);
+	    }
+	    return(p);
+	}
+	if(i == dir->size) {
+	    errno = ENOENT;
+	    return(NULL);
+	}
+	*ino = dent.inode;
+    }
+}
+
+static void usage(FILE *out)
+{
+    fprintf(out, "usage: vcimport [-hacz] [-j THREADS] SRCDIR DIR [PATH]\n");
+}
+
+int main(int argc, char **argv)
+{
+    int c, i, nthreads;
+    char *src, *path, *name, *p;
+    struct import imp;
+    struct store *st;
+    struct revdb *db;
+    struct revrec rr;
+    struct stat sb;
+    struct inode pdir;
+    struct dentry dent;
+    struct btop *ops;
+    vc_ino_t pino, ino, topino;
+    vc_rev_t rev;
+    pthread_t *threads;
+    
+    memset(&imp, 0, sizeof(imp));
+    nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    while((c = getopt(argc, argv, "haczj:")) >= 0) {
+	switch(c) {
+	case 'z':
+	    imp.stflags |= FST_COMPRESS;
+	    break;
+	case 'a':
+	    imp.stflags |= FST_ALIGN;
+	    break;
+	case 'c':
+	    imp.cdc = 1;
+	    break;
+	case 'j':
+	    nthreads = atoi(optarg);
+	    break;
+	case 'h':
+	    usage(stdout);
+	    exit(0);
+	default:
+	    usage(stderr);
+	    exit(1);
+	}
+    }
+    if(argc - optind < 2) {
+	usage(stderr);
+	exit(1);
+    }
+    if(nthreads < 1)
+	nthreads = 1;
+    src = argv[optind];
+    imp.fsdir = argv[optind + 1];
+    for(p = src + strlen(src); (p > src + 1) && (p[-1] == '/'); *--p = 0);
+    if(argc - optind > 2) {
+	path = argv[optind + 2];
+    } else {
+	path = ((p = strrchr(src, '/')) == NULL)?src:(p + 1);
+	if(!*path) {
+	    fprintf(stderr, "vcimport: a PATH must be given to import %s\n", src);
+	    exit(1);
+	}
+    }
+    if(stat(src, &sb)) {
+	fprintf(stderr, "vcimport: %s: %s\n", src, strerror(errno));
+	exit(1);
+    }
+    if(!S_ISDIR(sb.st_mode)) {
+	fprintf(stderr, "vcimport: %s: %s\n", src, strerror(ENOTDIR));
+	exit(1);
+    }
+    
+    if((db = openrevdb(imp.fsdir, 1)) == NULL)
+	exit(1);
+    if((st = openstore(imp.fsdir, imp.stflags)) == NULL)
+	exit(1);
+    if(revget(db, db->n - 1, &rr)) {
+	fprintf(stderr, "vcimport: could not read the latest revision: %s\n", strerror(errno));
+	exit(1);
+    }
+    if((name = lookupparent(st, &rr.root, path, &pino, &pdir)) == NULL) {
+	fprintf(stderr, "vcimport: %s: %s\n", path, strerror(errno));
+	exit(1);
+    }
+    if((imp.base = imp.nextino = btcount(st, &rr.root, INOBLSIZE)) < 0) {
+	fprintf(stderr, "vcimport: could not count inodes: %s\n", strerror(errno));
+	exit(1);
+    }
+    
+    pthread_mutex_init(&imp.lock, NULL);
+    pthread_cond_init(&imp.cond, NULL);
+    topino = newino(&imp);
+    enqueue(&imp, newnode(src, "", &sb, topino, pino));
+    threads = malloc(sizeof(*threads) * nthreads);
+    for(i = 0; i < nthreads; i++)
+	pthread_create(&threads[i], NULL, (void *(*)(void *))worker, &imp);
+    for(i = 0; i < nthreads; i++)
+	pthread_join(threads[i], NULL);
+    free(threads);
+    if(imp.err)
+	exit(1);
+    
+    memset(&dent, 0, sizeof(dent));
+    dent.inode = topino;
+    strcpy(dent.name, name);
+    if(btput(st, &pdir.data, pdir.size, &dent, sizeof(dent) - sizeof(dent.name) + strlen(name) + 1, DIRBLSIZE)) {
+	fprintf(stderr, "vcimport: could not link %s: %s\n", path, strerror(errno));
+	exit(1);
+    }
+    pdir.size++;
+    pdir.links++;
+    pdir.mtime = time(NULL);
+    if(btput(st, &rr.root, pino, &pdir, sizeof(pdir), INOBLSIZE)) {
+	fprintf(stderr, "vcimport: could not update inode table: %s\n", strerror(errno));
+	exit(1);
+    }
+    ops = malloc(sizeof(*ops) * INOBATCH);
+    for(ino = imp.base; ino < imp.nextino; ) {
+	for(i = 0; (i < INOBATCH) && (ino < imp.nextino); i++, ino++)
+	    btmkop(ops + i, ino, &imp.inos[ino - imp.base], sizeof(*imp.inos));
+	if(btputmany(st, &rr.root, ops, i, INOBLSIZE)) {
+	    fprintf(stderr, "vcimport: could not update inode table: %s\n", strerror(errno));
+	    exit(1);
+	}
+    }
+    free(ops);
+    
+    rr.ct = time(NULL);
+    if((rev = revappend(db, &rr)) < 0) {
+	fprintf(stderr, "vcimport: could not write new revision: %s\n", strerror(errno));
+	exit(1);
+    }
+    closerevdb(db);
+    releasestore(st);
+    printf("imported %zu files and %zu directories (%llu bytes) as revision %lli\n",
+	   imp.nfiles, imp.ndirs, (unsigned long long)imp.nbytes, (long long)rev);
+    return(0);
+}
@@ -0,0 +1,218 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+
+#include "store.h"
+#include "blocktree.h"
+#include "vcfs.h"
+#include "revs.h"
+#include "addrset.h"
+#include "pack.h"
+
+/*
+ * vcpack writes a pack of a revision to stdout. The revision is
+ * walked as vcgc walks it, skipping any subtree that has already
+ * been seen, and with a base revision given, the base is walked
+ * first without writing anything, so that only the blocks that have
+ * changed since are packed. Blocks are read PACKBATCH at a time, so
+ * that the store can order its reads.
+ */
+
+#define PACKBATCH 64
+/* Blocks larger than this are read again on their own */
+#define PACKBLKSZ (256 << 10)
+
+struct packdata {
+    struct store *st;
+    struct addrset seen;
+    int emit;
+    struct addr batch[PACKBATCH];
+    int n;
+    void *bufs[PACKBATCH];
+    void *big;
+    size_t nblk, szblk;
+};
+
+static int flushbatch(struct packdata *pd)
+{
+    size_t lens[PACKBATCH];
+    ssize_t szs[PACKBATCH];
+    struct packrec rec;
+    void *buf;
+    int i;
+    
+    for(i = 0; i < pd->n; i++)
+	lens[i] = PACKBLKSZ;
+    if(storegetmany(pd->st, pd->bufs, lens, pd->batch, szs, pd->n)) {
+	fprintf(stderr, "vcpack: could not read blocks: %s\n", strerror(errno));
+	return(-1);
+    }
+    for(i = 0; i < pd->n; i++) {
+	if(szs[i] < 0) {
+	    fprintf(stderr, "vcpack: block %s is missing\n", formataddr(&pd->batch[i]));
+	    return(-1);
+	}
+	buf = pd->bufs[i];
+	if(szs[i] > PACKBLKSZ) {
+	    if((szs[i] = storeget(pd->st, pd->big, STORE_MAXBLSZ, &pd->batch[i])) < 0) {
+		fprintf(stderr, "vcpack: could not read block %s: %s\n", formataddr(&pd->batch[i]), strerror(errno));
+		return(-1);
+	    }
+	    buf = pd->big;
+	}
+	memset(&rec, 0, sizeof(rec));
+	rec.a = pd->batch[i];
+	rec.len = szs[i];
+	if((fwrite(&rec, sizeof(rec), 1, stdout) != 1) || (fwrite(buf, 1, szs[i], stdout) != szs[i])) {
+	    fprintf(stderr, "vcpack: write error: %s\n", strerror(errno));
+	    return(-1);
+	}
+	pd->nblk++;
+	pd->szblk += szs[i];
+    }
+    pd->n = 0;
+    return(0);
+}
+
+static int packnode(struct packdata *pd, struct btnode *node)
+{
+    if(addrsethas(&pd->seen, &node->a))
+	return(1);
+    addrsetadd(&pd->seen, &node->a);
+    if(pd->emit) {
+	pd->batch[pd->n++] = node->a;
+	if((pd->n == PACKBATCH) && flushbatch(pd))
+	    return(-1);
+    }
+    return(0);
+}
+
+static int packdata(struct btnode *node, void *pdata)
+{
+    return(packnode(pdata, node));
+}
+
+static int packinotab(struct btnode *node, void *pdata)
+{
+    struct packdata *pd;
+    struct inode ino;
+    ssize_t sz;
+    int ret;
+    
+    pd = pdata;
+    if((ret = packnode(pd, node)) != 0)
+	return(ret);
+    if((node->d & 0x7f) != 0)
+	return(0);
+    if((sz = storeget(pd->st, &ino, sizeof(ino), &node->a)) < 0) {
+	fprintf(stderr, "vcpack: could not read inode %s: %s\n", formataddr(&node->a), strerror(errno));
+	return(-1);
+    }
+    if(sz == OLDINOSZ) {
+	memset(&ino.chunks, 0, sizeof(ino.chunks));
+    } else if(sz != sizeof(ino)) {
+	fprintf(stderr, "vcpack: inode %s has illegal size\n", formataddr(&node->a));
+	return(-1);
+    }
+    if(btwalk(pd->st, &ino.data, packdata, pd) || btwalk(pd->st, &ino.xattr, packdata, pd) ||
+       btwalk(pd->st, &ino.chunks, packdata, pd))
+	return(-1);
+    return(0);
+}
+
+static void usage(FILE *out)
+{
+    fprintf(out, "usage: vcpack [-h] [-b BASE] DIR [REV|@TIME]\n");
+}
+
+int main(int argc, char **argv)
+{
+    int c, i;
+    char *dir, *basespec;
+    struct revdb *db;
+    struct revrec rr;
+    struct packhdr hdr;
+    struct packrec end;
+    struct packdata pd;
+    vc_rev_t rev, base;
+    
+    basespec = NULL;
+    while((c = getopt(argc, argv, "hb:")) >= 0) {
+	switch(c) {
+	case 'b':
+	    basespec = optarg;
+	    break;
+	case 'h':
+	    usage(stdout);
+	    exit(0);
+	default:
+	    usage(stderr);
+	    exit(1);
+	}
+    }
+    if(argc - optind < 1) {
+	usage(stderr);
+	exit(1);
+    }
+    dir = argv[optind];
+    if(isatty(1)) {
+	fprintf(stderr, "vcpack: will not write a pack to a terminal\n");
+	exit(1);
+    }
+    
+    if((db = openrevdb(dir, 0)) == NULL)
+	exit(1);
+    rev = db->n - 1;
+    if((argc - optind > 1) && ((rev = parserev(db, argv[optind + 1])) < 0)) {
+	fprintf(stderr, "vcpack: %s: %s\n", argv[optind + 1], strerror(errno));
+	exit(1);
+    }
+    if(revget(db, rev, &rr)) {
+	fprintf(stderr, "vcpack: could not read revision %lli: %s\n", (long long)rev, strerror(errno));
+	exit(1);
+    }
+    memset(&pd, 0, sizeof(pd));
+    if((pd.st = openstore(dir, 0)) == NULL)
+	exit(1);
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, PACK_MAGIC, sizeof(hdr.magic));
+    if(basespec != NULL) {
+	if((base = parserev(db, basespec)) < 0) {
+	    fprintf(stderr, "vcpack: %s: %s\n", basespec, strerror(errno));
+	    exit(1);
+	}
+	if(revget(db, base, &hdr.base)) {
+	    fprintf(stderr, "vcpack: could not read revision %lli: %s\n", (long long)base, strerror(errno));
+	    exit(1);
+	}
+	if(btwalk(pd.st, &hdr.base.root, packinotab, &pd)) {
+	    fprintf(stderr, "vcpack: could not walk revision %lli\n", (long long)base);
+	    exit(1);
+	}
+    }
+    closerevdb(db);
+    
+    if(fwrite(&hdr, sizeof(hdr), 1, stdout) != 1) {
+	fprintf(stderr, "vcpack: write error: %s\n", strerror(errno));
+	exit(1);
+    }
+    pd.emit = 1;
+    for(i = 0; i < PACKBATCH; i++)
+	pd.bufs[i] = malloc(PACKBLKSZ);
+    pd.big = malloc(STORE_MAXBLSZ);
+    if(btwalk(pd.st, &rr.root, packinotab, &pd) || flushbatch(&pd)) {
+	fprintf(stderr, "vcpack: could not pack revision %lli\n", (long long)rev);
+	exit(1);
+    }
+    memset(&end, 0, sizeof(end));
+    if((fwrite(&end, sizeof(end), 1, stdout) != 1) || (fwrite(&rr, sizeof(rr), 1, stdout) != 1) || fflush(stdout)) {
+	fprintf(stderr, "vcpack: write error: %s\n", strerror(errno));
+	exit(1);
+    }
+    releasestore(pd.st);
+    
+    fprintf(stderr, "packed %zu blocks (%zu bytes) of revision %lli\n", pd.nblk, pd.szblk, (long long)rev);
+    return(0);
+}
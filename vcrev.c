@@ -0,0 +1,36 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#include "store.h"
+#include "revs.h"
+
+int main(int argc, char **argv)
+{
+    struct revdb *db;
+    struct revrec rr;
+    vc_rev_t rev;
+    
+    if(argc < 2) {
+	fprintf(stderr, "usage: vcrev DIR [REV|@TIME]\n");
+	exit(1);
+    }
+    if((db = openrevdb(argv[1], 0)) == NULL)
+	exit(1);
+    if(argc > 2) {
+	if((rev = parserev(db, argv[2])) < 0) {
+	    fprintf(stderr, "vcrev: %s: %s\n", argv[2], strerror(errno));
+	    exit(1);
+	}
+    } else {
+	rev = db->n - 1;
+    }
+    if(revget(db, rev, &rr)) {
+	fprintf(stderr, "vcrev: revision %lli has been expunged\n", (long long)rev);
+	exit(1);
+    }
+    printf("%lli %lli %i %s\n", (long long)rev, (long long)rr.ct, rr.root.d, formataddr(&rr.root.a));
+    closerevdb(db);
+    return(0);
+}
@@ -0,0 +1,173 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include "store.h"
+#include "blocktree.h"
+#include "vcfs.h"
+#include "revs.h"
+#include "pack.h"
+
+/*
+ * vcunpack reads a pack from stdin into the store in a directory,
+ * and appends its revision to the revision database there. The
+ * store is put in bulk mode, and blocks are put UNPACKBATCH at a
+ * time, or fewer if they amount to more than UNPACKMAX bytes, so
+ * that the store can write them sequentially and insert them into
+ * its index together. Each block is checked against its address as
+ * it is put. The revision is only appended once all of its blocks
+ * have been written, so an interrupted unpack leaves the revisions
+ * as they were.
+ */
+
+#define UNPACKBATCH 256
+#define UNPACKMAX (64 << 20)
+
+static int readfull(void *buf, size_t len)
+{
+    if(fread(buf, 1, len, stdin) != len) {
+	if(ferror(stdin))
+	    fprintf(stderr, "vcunpack: read error: %s\n", strerror(errno));
+	else
+	    fprintf(stderr, "vcunpack: pack is truncated\n");
+	return(-1);
+    }
+    return(0);
+}
+
+static int putbatch(struct store *st, const void **bufs, const size_t *lens, struct addr *want, int n)
+{
+    struct addr ats[UNPACKBATCH];
+    int i;
+    
+    if(n == 0)
+	return(0);
+    if(storeputmany(st, bufs, lens, ats, n)) {
+	fprintf(stderr, "vcunpack: could not store blocks: %s\n", strerror(errno));
+	return(-1);
+    }
+    for(i = 0; i < n; i++) {
+	if(addrcmp(&ats[i], &want[i])) {
+	    fprintf(stderr, "vcunpack: block %s is corrupt\n", formataddr(&want[i]));
+	    return(-1);
+	}
+    }
+    return(0);
+}
+
+static void usage(FILE *out)
+{
+    fprintf(out, "usage: vcunpack [-hanz] DIR\n");
+}
+
+int main(int argc, char **argv)
+{
+    int c, n, stflags, norev;
+    char *dir, *buf;
+    struct store *st;
+    struct revdb *db;
+    struct revrec rr;
+    struct packhdr hdr;
+    struct packrec rec;
+    const void *bufs[UNPACKBATCH];
+    size_t lens[UNPACKBATCH];
+    struct addr want[UNPACKBATCH];
+    size_t off, nblk, szblk;
+    vc_rev_t rev;
+    
+    stflags = 0;
+    norev = 0;
+    while((c = getopt(argc, argv, "hanz")) >= 0) {
+	switch(c) {
+	case 'n':
+	    norev = 1;
+	    break;
+	case 'z':
+	    stflags |= FST_COMPRESS;
+	    break;
+	case 'a':
+	    stflags |= FST_ALIGN;
+	    break;
+	case 'h':
+	    usage(stdout);
+	    exit(0);
+	default:
+	    usage(stderr);
+	    exit(1);
+	}
+    }
+    if(argc - optind < 1) {
+	usage(stderr);
+	exit(1);
+    }
+    dir = argv[optind];
+    
+    if(readfull(&hdr, sizeof(hdr)))
+	exit(1);
+    if(memcmp(hdr.magic, PACK_MAGIC, sizeof(hdr.magic))) {
+	fprintf(stderr, "vcunpack: not a pack\n");
+	exit(1);
+    }
+    db = NULL;
+    if(!norev && ((db = openrevdb(dir, 1)) == NULL))
+	exit(1);
+    if((st = openstore(dir, stflags)) == NULL)
+	exit(1);
+    if((hdr.base.root.d != 0) && (btholelen(&hdr.base.root.a) < 0) && (storeget(st, NULL, 0, &hdr.base.root.a) < 0)) {
+	fprintf(stderr, "vcunpack: the base revision of the pack is missing\n");
+	exit(1);
+    }
+    if(storebulk(st, 1))
+	exit(1);
+    buf = malloc(UNPACKMAX + STORE_MAXBLSZ);
+    nblk = szblk = 0;
+    for(n = 0, off = 0; ; ) {
+	if(readfull(&rec, sizeof(rec)))
+	    exit(1);
+	if(niladdr(&rec.a))
+	    break;
+	if(rec.len > STORE_MAXBLSZ) {
+	    fprintf(stderr, "vcunpack: block %s is too large\n", formataddr(&rec.a));
+	    exit(1);
+	}
+	if(readfull(buf + off, rec.len))
+	    exit(1);
+	bufs[n] = buf + off;
+	lens[n] = rec.len;
+	want[n] = rec.a;
+	n++;
+	off += rec.len;
+	nblk++;
+	szblk += rec.len;
+	if((n == UNPACKBATCH) || (off >= UNPACKMAX)) {
+	    if(putbatch(st, bufs, lens, want, n))
+		exit(1);
+	    n = 0;
+	    off = 0;
+	}
+    }
+    if(putbatch(st, bufs, lens, want, n))
+	exit(1);
+    if(readfull(&rr, sizeof(rr)))
+	exit(1);
+    if(storebulk(st, 0))
+	exit(1);
+    free(buf);
+    releasestore(st);
+    
+    if(!norev) {
+	/* The packed commit time may well be older than the local history */
+	rr.ct = time(NULL);
+	if((rev = revappend(db, &rr)) < 0) {
+	    fprintf(stderr, "vcunpack: could not append revision: %s\n", strerror(errno));
+	    exit(1);
+	}
+	closerevdb(db);
+	printf("%lli\n", (long long)rev);
+    }
+    fprintf(stderr, "unpacked %zu blocks (%zu bytes)\n", nblk, szblk);
+    return(0);
+}